@@ -17,6 +17,8 @@
 #include <TMath.h>
 #include <TGraph.h>
 #include <TVector3.h>
+#include <TParameter.h>
+#include <TVectorT.h>
 #include <TRandom3.h>
 
 #include "WCSimRootEvent.hh"
@@ -28,6 +30,7 @@
 #include "OPTICALFIT/utils/WCSIMDigitization.hh"
 
 #include "OPTICALFIT/utils/CalcGroupVelocity.hh"
+#include "OPTICALFIT/Carlson.hh"
 #include "OPTICALFIT/utils/LEDProfile.hh"
 #include "OPTICALFIT/utils/AttenuationZ.hh"
 
@@ -41,8 +44,11 @@ WCSimRootGeom *geo = 0;
 const int nPMTtypes = 2;
 double PMTradius[nPMTtypes];
 
-double CalcSolidAngle(double r, double R, double costh)
+double CalcSolidAngle(double r, double R, double costh, bool exact)
 {
+  // exact solid angle of the PMT as a disk seen off-axis
+  if (exact) return carlson::DiskSolidAngleR(r,R,costh);
+
   double weight = 2*TMath::Pi()*(1-R/sqrt(R*R+r*r));
   //weight *= 1.-0.5*sqrt(1-costh*costh);
   //weight *= 0.5+0.5*costh;
@@ -60,6 +66,7 @@ void HelpMessage()
             << "-w : Apply diffuser profile reweight\n"
             << "-z : Reweighing attenuation factor with input slope\n"
             << "-p : Set water parameters for attenuation factor reweight (ABWFF,RAYFF)\n"
+            << "-a : Use the exact off-axis solid angle of the PMTs\n"
             << "-b : Use only B&L PMTs\n"
             << "-d : Run with raw Cherenkov hits and perform ad-hoc digitization\n"
             << "-t : Use separated triggers\n"
@@ -81,6 +88,7 @@ int main(int argc, char **argv){
   bool separatedTriggers=false; //Assume two independent triggers, one for mPMT, one for B&L
   bool diffuserProfile = false; //Reweigh PMT hits by source angle
   bool zreweight = false; //Reweigh PMT hits by a z-dependence in attenuation length
+  bool exactSolidAngle = false; //Solid angle of the PMT disk seen off-axis instead of on-axis
   double slopeA = 0;
   double abwff = 1.3;
   double rayff = 0.75;
@@ -93,7 +101,7 @@ int main(int argc, char **argv){
   int endEvent=0;
   int seed = 0;
   char c;
-  while( (c = getopt(argc,argv,"f:o:b:s:e:l:r:z:p:hdtvw")) != -1 ){//input in c the argument (-f etc...) and in optarg the next argument. When the above test becomes -1, it means it fails to find a new argument.
+  while( (c = getopt(argc,argv,"f:o:b:s:e:l:r:z:p:hdtvwa")) != -1 ){//input in c the argument (-f etc...) and in optarg the next argument. When the above test becomes -1, it means it fails to find a new argument.
     switch(c){
       case 'f':
         filename = optarg;
@@ -135,6 +143,9 @@ int main(int argc, char **argv){
       case 'w':
         diffuserProfile = true;
         break;
+      case 'a':
+        exactSolidAngle = true;
+        break;
       case 'z':
         slopeA = std::stod(optarg);
         if (fabs(slopeA)>1.e-9)
@@ -297,11 +308,12 @@ int main(int argc, char **argv){
   if (diffuserProfile) led = new LEDProfile();
 
   // Reweight class for z-dependence attenuation length
-  AttenuationZ* attenZ;
-  if (zreweight) attenZ = new AttenuationZ(wavelength,vtxpos[2],slopeA,abwff,rayff);
+  AttenuationZWeight* attenZ;
+  if (zreweight) attenZ = new AttenuationZWeight(wavelength,vtxpos[2],slopeA,abwff,rayff);
 
   // Save the PMT geometry information relative to source
   double dist, costh, cosths, phis, omega, phim, costhm, dz;
+  double PMTx, PMTy, PMTz, PMTdirx, PMTdiry, PMTdirz, radius;
   int mPMT_id;
   TTree* pmt_type0 = new TTree("pmt_type0","pmt_type0");
   pmt_type0->Branch("R",&dist);          // distance to source
@@ -315,6 +327,13 @@ int main(int argc, char **argv){
   pmt_type0->Branch("PMT_id",&PMT_id);   // unique PMT id
   pmt_type0->Branch("mPMT_id",&mPMT_id); // dummy 
   pmt_type0->Branch("weight",&weight);   // weight from e.g. LED profile
+  pmt_type0->Branch("PMTx",&PMTx);       // raw PMT position and unit orientation, radius of the PMT
+  pmt_type0->Branch("PMTy",&PMTy);       // used to recompute the geometry for a moved source at fit time
+  pmt_type0->Branch("PMTz",&PMTz);
+  pmt_type0->Branch("PMTdirx",&PMTdirx);
+  pmt_type0->Branch("PMTdiry",&PMTdiry);
+  pmt_type0->Branch("PMTdirz",&PMTdirz);
+  pmt_type0->Branch("radius",&radius);
   TTree* pmt_type1 = new TTree("pmt_type1","pmt_type1");
   pmt_type1->Branch("R",&dist);
   pmt_type1->Branch("costh",&costh);
@@ -330,6 +349,13 @@ int main(int argc, char **argv){
                                          // 12 - 17: middle ring
                                          // 18: central PMT
   pmt_type1->Branch("weight",&weight); 
+  pmt_type1->Branch("PMTx",&PMTx);
+  pmt_type1->Branch("PMTy",&PMTy);
+  pmt_type1->Branch("PMTz",&PMTz);
+  pmt_type1->Branch("PMTdirx",&PMTdirx);
+  pmt_type1->Branch("PMTdiry",&PMTdiry);
+  pmt_type1->Branch("PMTdirz",&PMTdirz);
+  pmt_type1->Branch("radius",&radius);
 
   // Assume the "source" is the UK injection system, either diffuser or collimator
   // LI source direction is always perpendicular to the wall
@@ -418,7 +444,10 @@ int main(int argc, char **argv){
         if (pmtType==1) ledweight_type1[i]=wgt;
       }
       double pmtradius = pmtType==0 ? PMTradius[0] : PMTradius[1]; 
-      omega = CalcSolidAngle(pmtradius,dist,costh);
+      omega = CalcSolidAngle(pmtradius,dist,costh,exactSolidAngle);
+      PMTx = PMTpos[0]; PMTy = PMTpos[1]; PMTz = PMTpos[2];
+      PMTdirx = vOrientation[0]; PMTdiry = vOrientation[1]; PMTdirz = vOrientation[2];
+      radius = pmtradius;
       costhm = costh;
       phim = 0;
       // mPMT specific
@@ -457,6 +486,18 @@ int main(int argc, char **argv){
   outfile->cd();
   pmt_type0->Write();
   pmt_type1->Write();
+  // source position, direction and local x,y axes of phis, with the solid angle method, to recompute the geometry at fit time
+  TVectorD source_frame(12);
+  for (int j=0;j<3;j++)
+  {
+    source_frame[j] = vtxpos[j];
+    source_frame[3+j] = vDirSource[j];
+    source_frame[6+j] = vSource_localXaxis[j];
+    source_frame[9+j] = vSource_localYaxis[j];
+  }
+  source_frame.Write("source_frame");
+  TParameter<int> exact_solid_angle("exact_solid_angle",exactSolidAngle ? 1 : 0);
+  exact_solid_angle.Write();
 
   // Ad-hoc digitizer, PMT specific 
   BoxandLine20inchHQE_Digitizer* BnLDigitizer = new BoxandLine20inchHQE_Digitizer();
@@ -783,6 +824,9 @@ int main(int argc, char **argv){
   outfile->cd();
   hitRate_pmtType0->Write();
   hitRate_pmtType1->Write();
+  // group velocity (m/ns) used for timetof, lets the fitter shift timetof to another group velocity
+  TParameter<double> group_velocity("group_velocity",vg);
+  group_velocity.Write();
 
   outfile->Close();
   
@@ -27,7 +27,8 @@ void HelpMessage()
                 << "-c : Config file\n"
                 << "-s : RNG seed \n"
                 << "-n : Number of threads\n"
-                << "-t : Number of toy fits \n";
+                << "-t : Number of toy fits \n"
+                << "-m : Approximate math, 1 or 0 (overrides fast_math in the config)\n";
 }
 
 int main(int argc, char** argv)
@@ -37,9 +38,10 @@ int main(int argc, char** argv)
     int num_threads = 1;
     int seed = 0;
     int toys = 0;
+    int fast_math = -1;
 
     char option;
-    while((option = getopt(argc, argv, "j:f:o:c:n:s:t:h")) != -1)
+    while((option = getopt(argc, argv, "j:f:o:c:n:s:t:m:h")) != -1)
     {
         switch(option)
         {
@@ -63,6 +65,9 @@ int main(int argc, char** argv)
                 if (toys<0) toys = 0;
                 std::cout << TAG<<"Number of toys = "<<toys<<std::endl;
                 break;
+            case 'm':
+                fast_math = std::stoi(optarg) != 0;
+                break;
             case 'h':
                 HelpMessage();
             default:
@@ -196,6 +201,32 @@ int main(int argc, char** argv)
                     std::cout << TAG<<"Random timetof smearing per PMT, sampled from a Gaussian of mean = "<< mean << ", width = "<< width <<std::endl;
                     s->SetTimeSmear(true, mean, width);
                 }
+                else if (optname=="group_velocity")
+                {
+                    auto vg = toml_h::find<double>(opt,1);
+                    auto vg_min = toml_h::find<double>(opt,2);
+                    auto vg_max = toml_h::find<double>(opt,3);
+                    double vg_ref = opt.size()>4 ? toml_h::find<double>(opt,4) : -1;
+                    std::cout << TAG<<"Shifting timetof to group velocity = "<< vg <<" m/ns, allowed range = ["<<vg_min<<","<<vg_max<<"]"<<std::endl;
+                    s->UseGroupVelocity(vg, vg_min, vg_max, vg_ref);
+                }
+                else if (optname=="led_reweight")
+                {
+                    std::cout << TAG<<"Reweighting data by the LED profile"<<std::endl;
+                    if (opt.size()>3)
+                        s->SetDataLEDWeight(toml_h::find<std::string>(opt,1), toml_h::find<std::string>(opt,2), toml_h::find<std::string>(opt,3));
+                    else
+                        s->SetDataLEDWeight();
+                }
+                else if (optname=="z_reweight")
+                {
+                    auto slope = toml_h::find<double>(opt,1);
+                    double wavelength = opt.size()>2 ? toml_h::find<double>(opt,2) : 400;
+                    double abwff = opt.size()>3 ? toml_h::find<double>(opt,3) : 1.3;
+                    double rayff = opt.size()>4 ? toml_h::find<double>(opt,4) : 0.75;
+                    std::cout << TAG<<"Reweighting data by attenuation length with linear z-dependence, slope = "<<slope<<std::endl;
+                    s->SetDataAttenuationZWeight(slope, wavelength, abwff, rayff);
+                }
                 else if (optname=="z0")
                 {
                     auto z0 = toml_h::find<double>(opt,1);
@@ -239,6 +270,12 @@ int main(int argc, char** argv)
                     std::cout << TAG << "Apply PMT efficiency variation with 1-sigma =  "<< sigma << std::endl;
                     s->SetPMTEffVar(sigma);
                 }
+                else if (optname=="sort_by_bin")
+                {
+                    auto flag = toml_h::find<bool>(opt,1);
+                    std::cout << TAG << "Sort PMTs by sample bin = " << flag << std::endl;
+                    s->SetSortByBin(flag);
+                }
             }
         }
 
@@ -346,6 +383,40 @@ int main(int argc, char** argv)
                     //auto num = toml_h::find<int>(opt,3);
                     fitpara->SetSpline(fname,sname);
                 } 
+                else if (optname=="spline_mode") // interpolation of the spline reweight
+                {
+                    auto mode = toml_h::find<std::string>(opt,1);
+                    std::cout << TAG<<"Using "<<mode<<" spline interpolation"<<std::endl;
+                    fitpara->SetSplineMode(mode=="cubic" ? SplineEngine::kCubic : SplineEngine::kLinear);
+                } 
+                else if (optname=="spline_pars") // parameter index of each dimension of the spline response grids
+                {
+                    auto pars = toml_h::find<std::vector<int>>(opt,1);
+                    fitpara->SetSplinePars(pars);
+                } 
+                else if (optname=="formula") // expression of the Formula function type
+                {
+                    auto expr = toml_h::find<std::string>(opt,1);
+                    fitpara->SetFormula(expr);
+                } 
+                else if (optname=="led_spectra") // power and variation spectra of the LEDProfile function type
+                {
+                    auto fname = toml_h::find<std::string>(opt,1);
+                    auto power = toml_h::find<std::string>(opt,2);
+                    auto variation = toml_h::find<std::string>(opt,3);
+                    fitpara->SetLEDSpectra(fname, power, variation);
+                } 
+                else if (optname=="time_shape") // resolution function of the TimeResolution function type
+                {
+                    auto shape = toml_h::find<std::string>(opt,1);
+                    fitpara->SetTimeShape(shape=="BnL" ? TimeSmearEngine::kBnL : TimeSmearEngine::kGaussian);
+                } 
+                else if (optname=="compress") // compressed attenuation sum with relative tolerance
+                {
+                    auto tol = toml_h::find<double>(opt,1);
+                    std::cout << TAG<<"Compressing attenuation with tolerance "<<tol<<std::endl;
+                    fitpara->SetCompression(tol);
+                } 
             }
         }
         fitpara->SetParameterFunction(functype);
@@ -369,7 +440,12 @@ int main(int argc, char** argv)
     min_settings.max_fcn = toml_h::find<double>(minimizer_config, "max_fcn");
 
     fitter.SetMinSettings(min_settings);
-    fitter.InitFitter(fitparas);
+    if (fast_math < 0)
+        fast_math = toml_h::contains(minimizer_config, "fast_math") && toml_h::find<bool>(minimizer_config, "fast_math");
+    fitter.SetFastMath(fast_math);
+    if (toml_h::contains(minimizer_config, "affinity"))
+        fitter.SetAffinity(ThreadAffinity::ParsePolicy(toml_h::find<std::string>(minimizer_config, "affinity")));
+    fitter.InitFitter(fitparas, samples);
 
     bool stat_fluc = toml_h::find<bool>(minimizer_config, "stat_fluc");
     bool did_converge = false;
@@ -399,6 +475,16 @@ int main(int argc, char** argv)
         fitter.ParameterScans(ParameterScans,ScanSteps);
     }
 
+    // optional profile scan of the group velocity
+    if (toml_h::contains(minimizer_config, "vg_scan"))
+    {
+        auto vg_scan = toml_h::find<toml::array>(minimizer_config, "vg_scan");
+        auto vg_low = toml_h::find<double>(vg_scan,0);
+        auto vg_high = toml_h::find<double>(vg_scan,1);
+        auto vg_steps = toml_h::find<int>(vg_scan,2);
+        fitter.GroupVelocityScan(vg_low, vg_high, vg_steps);
+    }
+
     fout->Close();
 
     std::cout << TAG << "Output saved to " << fname_output << std::endl;
@@ -407,7 +493,22 @@ int main(int argc, char** argv)
     {
         std::cout << TAG << "Running " << toys << " toy fits..." << std::endl;
 
-        for (int i=0;i<toys;i++)
+        // optionally fit several toys in lockstep, sharing the pass over the PMTs
+        int toy_lanes = 1;
+        if (toml_h::contains(minimizer_config, "toy_lanes"))
+            toy_lanes = toml_h::find<int>(minimizer_config, "toy_lanes");
+        bool toys_done = false;
+        if (toy_lanes > 1)
+        {
+            toys_done = fitter.FitToyLanes(samples, toys, toy_lanes, stat_fluc, [&fname_output](int i)
+            {
+                std::string toy_output = fname_output;
+                toy_output.insert(toy_output.size()-5,Form("_toy%i",i));
+                return toy_output;
+            });
+        }
+
+        for (int i=0;i<toys && !toys_done;i++)
         {
             std::cout << TAG << "Processing Toy Fit " << i << " :" << std::endl;
 
@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include <TDirectory.h>
+#include <TFile.h>
+#include <TGraph.h>
+#include <TKey.h>
+#include <TVectorT.h>
+
+#include "OPTICALFIT/ColorOutput.hh"
+#include "OPTICALFIT/SplineFile.hh"
+
+// Converts the spline directory layout of macro/build_template_and_spline.c,
+// i.e. splineName/PMT<PMT_id>/Bin_<bin> TGraphs, into the binary spline file read by AnaFitParameters::LoadSpline.
+// Response grids over several parameters have the knots of dimension d as the TVectorD splineName/Knots_<d>
+// and the grid values of each PMT and bin as the TVectorD splineName/PMT<PMT_id>/Bin_<bin>, last dimension fastest.
+
+const std::string TAG = color::GREEN_STR + "[spline_convert]: " + color::RESET_STR;
+const std::string ERR = color::RED_STR + "[ERROR]: " + color::RESET_STR;
+const std::string WAR = color::RED_STR + "[WARNING]: " + color::RESET_STR;
+
+void HelpMessage()
+{
+    std::cout   << TAG << "USAGE: "
+                << "spline_convert" << "\nOPTIONS:\n"
+                << "-f : Input ROOT file\n"
+                << "-s : Spline directory name, e.g. Spline_Att\n"
+                << "-o : Output spline file\n"
+                << "-b : Number of time bins per PMT (default: number of graphs in the first PMT directory)\n";
+}
+
+int main(int argc, char** argv)
+{
+    std::string fname_input;
+    std::string fname_output;
+    std::string spline_name;
+    int nbins = 0;
+
+    char option;
+    while((option = getopt(argc, argv, "f:s:o:b:h")) != -1)
+    {
+        switch(option)
+        {
+            case 'f':
+                fname_input = optarg;
+                break;
+            case 's':
+                spline_name = optarg;
+                break;
+            case 'o':
+                fname_output = optarg;
+                break;
+            case 'b':
+                nbins = std::stoi(optarg);
+                break;
+            case 'h':
+                HelpMessage();
+            default:
+                return 0;
+        }
+    }
+
+    if (fname_input.size()==0 || fname_output.size()==0 || spline_name.size()==0)
+    {
+        std::cout << ERR << "Need input file, output file and spline name!" << std::endl;
+        HelpMessage();
+        return -1;
+    }
+
+    TFile f(fname_input.c_str());
+    if (!f.IsOpen())
+    {
+        std::cout << ERR << "Could not open input file: " << fname_input << std::endl;
+        return -1;
+    }
+
+    TDirectory* dir = f.GetDirectory(spline_name.c_str());
+    if (!dir)
+    {
+        std::cout << ERR << "Could not find " << spline_name << " in " << fname_input << std::endl;
+        return -1;
+    }
+
+    // PMT ids present in the file
+    std::vector<int> pmt_ids;
+    int max_id = -1;
+    TIter next(dir->GetListOfKeys());
+    while (TKey* key = (TKey*)next())
+    {
+        int pmtID;
+        if (sscanf(key->GetName(), "PMT%i", &pmtID) != 1 || pmtID < 0)
+            continue;
+        pmt_ids.push_back(pmtID);
+        if (pmtID > max_id) max_id = pmtID;
+    }
+    if (pmt_ids.size()==0)
+    {
+        std::cout << ERR << "No PMT directory in " << spline_name << std::endl;
+        return -1;
+    }
+
+    if (nbins <= 0)
+    {
+        TDirectory* pmtdir = dir->GetDirectory(Form("PMT%i", pmt_ids[0]));
+        nbins = pmtdir ? pmtdir->GetListOfKeys()->GetSize() : 0;
+    }
+    if (nbins <= 0)
+    {
+        std::cout << ERR << "Could not determine the number of bins, use -b" << std::endl;
+        return -1;
+    }
+
+    std::cout << TAG << "Converting " << pmt_ids.size() << " PMTs with " << nbins << " bins from " << fname_input << ":" << spline_name << std::endl;
+
+    // knots of the response grid dimensions, none for TGraph splines
+    std::vector<std::vector<double>> grid_knots;
+    std::size_t npoints = 1;
+    for (int d = 0; ; d++)
+    {
+        TVectorD* v = (TVectorD*)dir->Get(Form("Knots_%i", d));
+        if (!v) break;
+        grid_knots.emplace_back(v->GetMatrixArray(), v->GetMatrixArray()+v->GetNrows());
+        npoints *= v->GetNrows();
+        delete v;
+    }
+    if (grid_knots.size() > 0)
+        std::cout << TAG << "Response grids of " << grid_knots.size() << " dimensions with " << npoints << " points" << std::endl;
+
+    std::vector<double> knots;
+    std::vector<uint8_t> present(max_id+1, 0);
+    std::vector<double> values;
+    int nmissing = 0;
+    if (grid_knots.size() > 0)
+        values.assign((std::size_t)(max_id+1)*nbins*npoints, 1.0);
+
+    for (auto pmtID : pmt_ids)
+    {
+        for (int j = 1; j <= nbins; j++)
+        {
+            std::string graphname = Form("%s/PMT%i/Bin_%i", spline_name.c_str(), pmtID, j);
+
+            if (grid_knots.size() > 0)
+            {
+                TVectorD* grid = (TVectorD*)f.Get(graphname.c_str());
+                if (!grid)
+                {
+                    std::cout << WAR << "Could not find " << graphname << ", using flat grid" << std::endl;
+                    nmissing++;
+                    continue;
+                }
+                if (grid->GetNrows() != npoints)
+                {
+                    std::cout << ERR << graphname << " has " << grid->GetNrows() << " values, expect " << npoints << std::endl;
+                    return -1;
+                }
+                std::copy(grid->GetMatrixArray(), grid->GetMatrixArray()+npoints, values.begin() + ((std::size_t)pmtID*nbins + j-1)*npoints);
+                present[pmtID] = 1;
+                delete grid;
+                continue;
+            }
+
+            TGraph* graph = (TGraph*)f.Get(graphname.c_str());
+
+            // the knots of the first graph are used for the whole file
+            if (graph && knots.size()==0)
+            {
+                knots.assign(graph->GetX(), graph->GetX()+graph->GetN());
+                values.assign((std::size_t)(max_id+1)*nbins*knots.size(), 1.0);
+            }
+
+            if (!graph)
+            {
+                std::cout << WAR << "Could not find " << graphname << ", using flat spline" << std::endl;
+                nmissing++;
+                continue;
+            }
+
+            const int nknots = knots.size();
+            bool same_knots = graph->GetN() == nknots;
+            for (int k = 0; k < nknots && same_knots; k++)
+                same_knots = std::fabs(graph->GetX()[k] - knots[k]) <= 1e-9*std::fabs(knots[k]);
+            if (!same_knots)
+            {
+                std::cout << ERR << graphname << " does not share the knots of the other splines" << std::endl;
+                return -1;
+            }
+
+            std::copy(graph->GetY(), graph->GetY()+nknots, values.begin() + ((std::size_t)pmtID*nbins + j-1)*nknots);
+            present[pmtID] = 1;
+            delete graph;
+        }
+    }
+
+    if (grid_knots.size() == 0)
+        grid_knots.emplace_back(knots);
+    for (const auto& k : grid_knots)
+    {
+        if (k.size() < 2)
+        {
+            std::cout << ERR << "Need splines with at least two knots" << std::endl;
+            return -1;
+        }
+        for (std::size_t i = 1; i < k.size(); i++)
+        {
+            if (k[i] <= k[i-1])
+            {
+                std::cout << ERR << "Spline knots are not increasing" << std::endl;
+                return -1;
+            }
+        }
+    }
+
+    if (!SplineFile::Write(fname_output, grid_knots, nbins, present, values))
+    {
+        std::cout << ERR << "Failed to write " << fname_output << std::endl;
+        return -1;
+    }
+
+    std::cout << TAG << "Wrote " << pmt_ids.size()*nbins << " splines with " << values.size()/((max_id+1)*nbins) << " knots to " << fname_output;
+    if (nmissing > 0) std::cout << ", " << nmissing << " missing graphs set to 1";
+    std::cout << std::endl;
+
+    return 0;
+}
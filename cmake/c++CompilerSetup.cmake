@@ -15,4 +15,7 @@ else()
     cmessage(STATUS "OpenMP not found. Threading not available.")
 endif()
 
+# sqrt and the other math functions do not set errno, so the loops calling them can be vectorized
+add_compile_options(-fno-math-errno)
+
 add_compile_options(-Wall -Wno-unused-variable -Wno-sign-compare -Wno-unused-function -Wno-unused-but-set-variable -Wno-reorder)
\ No newline at end of file
@@ -0,0 +1,20 @@
+#!/bin/bash
+# Accuracy check of the fast_math mode: runs optical_fit twice on the same config and seed,
+# with exact and with approximate math, then reports the shifts in best-fit parameters, errors and chi2.
+# USAGE: check_fast_math.sh config.toml [nthreads] [seed] [max_pull]
+
+if [ $# -lt 1 ]; then
+    echo "USAGE: $0 config.toml [nthreads] [seed] [max_pull]"
+    exit 1
+fi
+
+config=$1
+nthreads=${2:-1}
+seed=${3:-0}
+max_pull=${4:-0.01}
+macro_dir=$(cd "$(dirname "$0")" && pwd)
+
+optical_fit -c ${config} -n ${nthreads} -s ${seed} -m 0 -o fitoutput_exact.root || exit 1
+optical_fit -c ${config} -n ${nthreads} -s ${seed} -m 1 -o fitoutput_fast.root || exit 1
+
+root -l -b -q "${macro_dir}/compare_precision.c(\"fitoutput_exact.root\",\"fitoutput_fast.root\",${max_pull},\"exact\",\"fast_math\")"
@@ -0,0 +1,65 @@
+// Validation report of a fit in mixed precision (cmake -DMIXED_PRECISION=1) against the double precision build.
+// Run optical_fit with the same config and seed in both builds, then
+// root -l -b -q 'compare_precision.c("fitoutput_double.root","fitoutput_mixed.root")'
+// Also used by check_fast_math.sh to compare the exact and approximate math fits.
+void compare_precision(std::string fname_ref = "fitoutput_double.root", std::string fname_test = "fitoutput_mixed.root", double max_pull = 0.01,
+                       std::string label_ref = "double", std::string label_test = "mixed"){
+
+    TFile* fref = new TFile(fname_ref.c_str());
+    TFile* ftest = new TFile(fname_test.c_str());
+
+    TVectorD* par_ref = (TVectorD*)fref->Get("res_vector");
+    TVectorD* par_test = (TVectorD*)ftest->Get("res_vector");
+    TMatrixDSym* cov_ref = (TMatrixDSym*)fref->Get("res_cov_matrix");
+    TMatrixDSym* cov_test = (TMatrixDSym*)ftest->Get("res_cov_matrix");
+    TVectorD* chi2_ref = (TVectorD*)fref->Get("chi2_tuple_postfit");
+    TVectorD* chi2_test = (TVectorD*)ftest->Get("chi2_tuple_postfit");
+
+    if (!par_ref || !par_test || !cov_ref || !cov_test || !chi2_ref || !chi2_test) {
+        std::cout<<"Missing fit results in "<<fname_ref<<" or "<<fname_test<<std::endl;
+        return;
+    }
+    if (par_ref->GetNrows() != par_test->GetNrows()) {
+        std::cout<<"Number of parameters differs: "<<par_ref->GetNrows()<<" vs "<<par_test->GetNrows()<<std::endl;
+        return;
+    }
+
+    // parameter names from the bin labels of hist_*_final
+    std::vector<std::string> names;
+    TIter next(fref->GetListOfKeys());
+    while (TKey* key = (TKey*)next()) {
+        std::string kname = key->GetName();
+        if (kname.find("hist_")!=0 || kname.size()<6 || kname.substr(kname.size()-6)!="_final" || kname.find("_error_")!=std::string::npos) continue;
+        TH1D* h = (TH1D*)key->ReadObj();
+        for (int i=1;i<=h->GetNbinsX();i++) names.push_back(h->GetXaxis()->GetBinLabel(i));
+    }
+    if (names.size()!=par_ref->GetNrows()) {
+        names.clear();
+        for (int i=0;i<par_ref->GetNrows();i++) names.push_back(Form("par%i",i));
+    }
+
+    std::cout<<std::setw(40)<<"parameter"<<std::setw(15)<<label_ref<<std::setw(15)<<label_test<<std::setw(15)<<"diff/error"<<std::setw(15)<<"error ratio-1"<<std::endl;
+    double worst = 0, worst_err = 0;
+    int nbad = 0;
+    for (int i=0;i<par_ref->GetNrows();i++) {
+        double err = sqrt((*cov_ref)(i,i));
+        double err_test = sqrt((*cov_test)(i,i));
+        double diff = (*par_test)[i]-(*par_ref)[i];
+        double pull = err>0 ? diff/err : 0;
+        double err_shift = err>0 ? err_test/err-1 : 0;
+        worst = std::max(worst, fabs(pull));
+        worst_err = std::max(worst_err, fabs(err_shift));
+        if (fabs(pull)>max_pull || fabs(err_shift)>max_pull) nbad++;
+        std::cout<<std::setw(40)<<names[i]<<std::setw(15)<<(*par_ref)[i]<<std::setw(15)<<(*par_test)[i]<<std::setw(15)<<pull<<std::setw(15)<<err_shift
+                 <<(fabs(pull)>max_pull || fabs(err_shift)>max_pull ? "  <--" : "")<<std::endl;
+    }
+
+    const char* chi2_names[] = {"stat", "syst", "reg", "total"};
+    std::cout<<"\nPost-fit chi2"<<std::endl;
+    for (int i=0;i<chi2_ref->GetNrows() && i<4;i++)
+        std::cout<<std::setw(10)<<chi2_names[i]<<std::setw(15)<<(*chi2_ref)[i]<<std::setw(15)<<(*chi2_test)[i]
+                 <<std::setw(15)<<(*chi2_test)[i]-(*chi2_ref)[i]<<std::endl;
+
+    std::cout<<"\nLargest parameter shift = "<<worst<<" sigma, largest relative error change = "<<worst_err<<std::endl;
+    std::cout<<nbad<<" parameters above "<<max_pull<<std::endl;
+}
@@ -0,0 +1,54 @@
+#ifndef ALIGNEDALLOCATOR_HH
+#define ALIGNEDALLOCATOR_HH
+
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Cache-line aligned allocator for the columnar PMT arrays.
+// Elements are default-initialized on resize(n), so plain numbers are left untouched
+// until they are written. Use resize(n, val) or assign(n, val) to get defined values.
+template <typename T, std::size_t Align = 64>
+class AlignedAllocator
+{
+public:
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef AlignedAllocator<U, Align> other;
+    };
+
+    AlignedAllocator() {}
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Align>&) {}
+
+    T* allocate(std::size_t n)
+    {
+        void* ptr = nullptr;
+        if(posix_memalign(&ptr, Align, n * sizeof(T)) != 0)
+            throw std::bad_alloc();
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, std::size_t) { std::free(ptr); }
+
+    template <typename U>
+    void construct(U* ptr) { ::new(static_cast<void*>(ptr)) U; }
+
+    template <typename U, typename... Args>
+    void construct(U* ptr, Args&&... args) { ::new(static_cast<void*>(ptr)) U(std::forward<Args>(args)...); }
+};
+
+template <typename T, typename U, std::size_t Align>
+inline bool operator==(const AlignedAllocator<T, Align>&, const AlignedAllocator<U, Align>&) { return true; }
+
+template <typename T, typename U, std::size_t Align>
+inline bool operator!=(const AlignedAllocator<T, Align>&, const AlignedAllocator<U, Align>&) { return false; }
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+#endif
@@ -29,6 +29,12 @@ class AnaEvent
             m_nPE_indirect_err = 0.0;
             m_timetof   = -999.0;
             m_eff = 1.0;
+            for(int j = 0; j < 3; ++j)
+            {
+                m_pmtpos[j] = 0;
+                m_pmtdir[j] = 0;
+            }
+            m_pmtradius = -1;
             m_wght     = 1.0;
             m_wghtMC   = 1.0;
         }
@@ -75,6 +81,16 @@ class AnaEvent
         inline void SetR(double val){ m_R = val; }
         inline double GetR() const { return m_R; }
 
+        // raw PMT position (cm), unit orientation and radius (cm), radius < 0 if the input does not store them
+        inline void SetPMTPosition(double x, double y, double z){ m_pmtpos[0] = x; m_pmtpos[1] = y; m_pmtpos[2] = z; }
+        inline double GetPMTPosition(int j) const { return m_pmtpos[j]; }
+
+        inline void SetPMTOrientation(double x, double y, double z){ m_pmtdir[0] = x; m_pmtdir[1] = y; m_pmtdir[2] = z; }
+        inline double GetPMTOrientation(int j) const { return m_pmtdir[j]; }
+
+        inline void SetPMTRadius(double val){ m_pmtradius = val; }
+        inline double GetPMTRadius() const { return m_pmtradius; }
+
         inline void SetPE(double val){ m_nPE = val; }
         inline double GetPE() const { return m_nPE; }
 
@@ -93,22 +109,13 @@ class AnaEvent
         inline void SetEff(double val){ m_eff = val; }
         inline double GetEff() const { return m_eff; }
 
-        inline void SetTimetofNom(std::vector<double> val){ m_timetof_nom = val; }
-        inline std::vector<double> GetTimetofNom() const { return m_timetof_nom; }
-
-        inline void SetTimetofNomSig2(std::vector<double> val){ m_timetof_nom_sig2 = val; }
-        inline std::vector<double> GetTimetofNomSig2() const { return m_timetof_nom_sig2; }
-
-        inline void SetTimetofPred(std::vector<double> val){ m_timetof_pred = val; }
-        inline std::vector<double> GetTimetofPred() const { return m_timetof_pred; }
-
         inline void SetEvWght(double val){ m_wght  = val; }
         inline double GetEvWght() const { return m_wght; }
         inline void AddEvWght(double val){ m_wght *= val; }
         inline void SetEvWghtMC(double val){ m_wghtMC  = val; }
         inline double GetEvWghtMC() const { return m_wghtMC; }
 
-        inline void ResetEvWght(){ m_wght = m_wghtMC; m_timetof_pred = m_timetof_nom; }
+        inline void ResetEvWght(){ m_wght = m_wghtMC; }
 
         void Print() const
         {
@@ -197,6 +204,9 @@ class AnaEvent
         double m_dz;       // z-pos relative to source
         double m_z0;       // diffuser z-pos
         double m_R;        //distance to source
+        double m_pmtpos[3]; //PMT position
+        double m_pmtdir[3]; //PMT orientation
+        double m_pmtradius; //PMT radius
         double m_nPE;      //number of PE
         //double m_nPE_tail; //number of PE at the tail
         double m_nPE_indirect; //indirect PE prediction
@@ -205,9 +215,6 @@ class AnaEvent
         double m_eff;      // PMT relative efficiency
         double m_wght;     //event weight
         double m_wghtMC;   //event weight from original MC
-        std::vector<double> m_timetof_nom;      // template nominal prediction
-        std::vector<double> m_timetof_nom_sig2; // template nominal prediction sigma^2
-        std::vector<double> m_timetof_pred;     // template prediction modified by parameter spline
         std::vector<int> par_list;
         std::vector<double> reco_var;
 
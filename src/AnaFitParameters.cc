@@ -8,12 +8,18 @@ AnaFitParameters::AnaFitParameters(const std::string& par_name, const int pmttyp
     , m_do_cap_weights(false)
     , m_weight_cap(1000)
     , m_info_frac(1.00)
+    , m_cache_valid(false)
     , m_decompose(false)
     , eigen_decomp(nullptr)
     , covariance(nullptr)
     , covarianceI(nullptr)
     , original_cov(nullptr)
     , m_spline(false)
+    , m_spline_mode(SplineEngine::kLinear)
+    , m_flatspline(nullptr)
+    , m_time_shape(TimeSmearEngine::kGaussian)
+    , m_compress_tol(0.0)
+    , m_fast_math(false)
 
 {
     m_func = new Identity;
@@ -31,6 +37,7 @@ AnaFitParameters::~AnaFitParameters()
         delete covarianceI;
     if(original_cov != nullptr)
         delete original_cov;
+    ClearSplineGraphs();
 
 }
 
@@ -109,12 +116,72 @@ void AnaFitParameters::SetParameterFunction(const std::string& func_name)
         m_func = new Spline;
         m_func_type = kSpline;
     }
+    else if(func_name == "Formula")
+    {
+        std::cout << TAG << "Setting function to Formula " << m_formula << std::endl;
+        Formula* f = new Formula;
+        std::string error;
+        if(f->engine.Compile(m_formula, error))
+        {
+            m_func = f;
+            m_func_type = kFormula;
+        }
+        else
+        {
+            std::cout << ERR << "Cannot compile formula: " << error << std::endl
+                      << WAR << "Setting function to Identity." << std::endl;
+            delete f;
+            m_func = new Identity;
+            m_func_type = kIdentity;
+        }
+    }
+    else if(func_name == "SolidAngle")
+    {
+        std::cout << TAG << "Setting function to SolidAngle." << std::endl;
+        m_func = new SolidAngle;
+        m_func_type = kSolidAngle;
+    }
+    else if(func_name == "Geometry")
+    {
+        std::cout << TAG << "Setting function to Geometry." << std::endl;
+        m_func = new SourceGeometry;
+        m_func_type = kGeometry;
+    }
+    else if(func_name == "TimeResolution")
+    {
+        std::cout << TAG << "Setting function to TimeResolution with "
+                  << (m_time_shape == TimeSmearEngine::kBnL ? "B&L" : "Gaussian") << " shape." << std::endl;
+        m_func = new TimeSmear;
+        m_func_type = kTimeSmear;
+    }
+    else if(func_name == "LEDProfile")
+    {
+        std::cout << TAG << "Setting function to LEDProfile." << std::endl;
+        LEDProfileFunction* f = new LEDProfileFunction;
+        if(!m_led_file.empty())
+        {
+            std::cout << TAG << "Using LED spectra " << m_led_power << ", " << m_led_variation << " from " << m_led_file << std::endl;
+            TFile file(m_led_file.c_str());
+            TH1* hpower = (TH1*)file.Get(m_led_power.c_str());
+            TH1* hvariation = (TH1*)file.Get(m_led_variation.c_str());
+            if(hpower != nullptr && hvariation != nullptr)
+            {
+                f->profile.SetPowerSpectrum(hpower);
+                f->profile.SetVariationSpectrum(hvariation);
+            }
+            else
+                std::cout << ERR << "LED spectra not found, using the default profile." << std::endl;
+        }
+        m_func = f;
+        m_func_type = kLEDProfile;
+    }
     else
     {
         std::cout << WAR << "Invalid function name. Setting to Identity by default." << std::endl;
         m_func = new Identity;
         m_func_type = kIdentity;
     }
+    m_func->fast_math = m_fast_math;
 }
 
 void AnaFitParameters::InitParameters(std::vector<std::string> names, std::vector<double> priors, std::vector<double> steps, 
@@ -185,12 +252,44 @@ void AnaFitParameters::InitParameters(std::vector<std::string> names, std::vecto
         // Propagate polynomial orders and ranges to ParameterFunction
         ((PolynomialCosth*)m_func)->pol_orders = pol_orders;
         ((PolynomialCosth*)m_func)->pol_range = pol_range;
+        ((PolynomialCosth*)m_func)->BuildBasis();
         //((PolynomialCosth*)m_func)->Print();
     }
 
     Npar = pars_name.size();
     pars_original = pars_prior;
 
+    if (m_func_type == kFormula && ((Formula*)m_func)->engine.GetMaxParIndex() >= (int)Npar)
+    {
+        std::cout << ERR << "Formula " << m_formula << " uses parameter ["
+                  << ((Formula*)m_func)->engine.GetMaxParIndex() << "] but " << m_name << " has only "
+                  << Npar << " parameters. Setting function to Identity." << std::endl;
+        delete m_func;
+        m_func = new Identity;
+        m_func_type = kIdentity;
+        m_func->fast_math = m_fast_math;
+    }
+
+    if (m_func_type == kLEDProfile && Npar != 2)
+    {
+        std::cout << ERR << "LEDProfile needs 2 parameters (power and phi variation scales) but " << m_name << " has "
+                  << Npar << ". Setting function to Identity." << std::endl;
+        delete m_func;
+        m_func = new Identity;
+        m_func_type = kIdentity;
+        m_func->fast_math = m_fast_math;
+    }
+
+    if (m_func_type == kGeometry && Npar != 3 && Npar != 6)
+    {
+        std::cout << ERR << "Geometry needs 3 (source) or 6 (source and PMT) shifts but " << m_name << " has "
+                  << Npar << ". Setting function to Identity." << std::endl;
+        delete m_func;
+        m_func = new Identity;
+        m_func_type = kIdentity;
+        m_func->fast_math = m_fast_math;
+    }
+
     std::cout << TAG<<"Number of parameters = "<<Npar<<std::endl;
 
     if(m_decompose) // eigen-decomposition is useful if there are a large number of highly correlated parameters
@@ -214,7 +313,8 @@ void AnaFitParameters::InitParameters(std::vector<std::string> names, std::vecto
 void AnaFitParameters::InitEventMap(std::vector<AnaSample*> &sample)
 {
     // Determine whether a specific PMT is affected by the parameters
-    m_evmap.clear();
+    m_parbin_slot.clear();
+    m_cache_valid = false;
 
     std::vector<bool> params_used(Npar,false);
 
@@ -239,100 +339,295 @@ void AnaFitParameters::InitEventMap(std::vector<AnaSample*> &sample)
             else sample_map.push_back(PASSEVENT);
         }
         std::cout << TAG<<"InitEventMap: built event map for sample "<< sample[s]->GetName() << " of total "<< sample[s] -> GetNPMTs() << "PMTs"<<std::endl;
-        m_evmap.push_back(sample_map);
+        m_parbin_slot.push_back(sample[s]->GetPMTStore()->SetParBinIndex(m_name, sample_map));
+
+        // fixed basis row of every PMT, the reweight is then a GEMV with the parameters
+        int width = 0;
+        if (m_func_type == kPolynomialCosth)
+            width = ((PolynomialCosth*)m_func)->pol_npar;
+        else if (m_func_type == kLEDProfile)
+            width = 2;
+        if (width > 0)
+        {
+            PMTStore* pmts = sample[s]->GetPMTStore();
+            const int num_pmts = pmts->GetNPMTs();
+            pmts->SetParBasis(m_parbin_slot.back(), width, std::vector<double>((std::size_t)num_pmts*width), std::vector<int>(num_pmts));
+            UpdateBasis(pmts, s, 0, num_pmts);
+        }
     }
 
     if (m_spline)
+    {
         LoadSpline(sample);
+        // the response grids read their parameters whatever the PMT bins
+        for (const auto& grid : m_grid_engine)
+            for (int d=0;d<grid.GetNDim();d++)
+                params_used[SplinePar(d)] = true;
+    }
+
+    // spectra of the nominal template, the kernel range covers the upper limit of the parameters
+    m_smear_engine.clear();
+    if (m_func_type == kTimeSmear)
+    {
+        const double max_par = pars_limhigh.empty() ? 0. : *std::max_element(pars_limhigh.begin(), pars_limhigh.end());
+        for(std::size_t s=0; s < sample.size(); s++)
+        {
+            m_smear_engine.emplace_back();
+            if (!sample[s]->UseTemplate())
+            {
+                std::cout << WAR << "Sample " << sample[s]->GetName() << " has no timetof template, "
+                          << m_name << " is ignored for it." << std::endl;
+                continue;
+            }
+            PMTStore* pmts = sample[s]->GetPMTStore();
+            const TAxis* axis = sample[s]->GetTemplate()->GetYaxis();
+            m_smear_engine.back().Init(pmts->GetTemplateNom(), pmts->GetNPMTs(), pmts->GetNTimeBins(),
+                                       axis->GetBinWidth(1), m_time_shape, max_par);
+            pmts->InitTemplateSmear();
+        }
+    }
 
-    // Fixing the un-used parameters in fit for proper error calculation
-    if (m_func_type != kPolynomialCosth && m_func_type != kAttenuationZ)
+    // Fixing the un-used parameters in fit for proper error calculation,
+    // a formula with [k] parameters uses them independently of the PMT bins
+    const bool global_pars = m_func_type == kFormula && ((Formula*)m_func)->engine.GetMaxParIndex() >= 0;
+    if (m_func_type != kPolynomialCosth && m_func_type != kAttenuationZ && m_func_type != kLEDProfile && m_func_type != kGeometry && !global_pars)
         for (int i=0;i<Npar;i++)
             if (!params_used[i]) pars_fixed[i]=true;
 }
 
 void AnaFitParameters::ApplyParameters(std::vector<double>& params)
 {
-    // Update parameters before reweight
+    // Update parameters before reweight, the kernels themselves only read the parameter array
     if (m_func_type == kPolynomialCosth)
         ((PolynomialCosth*)m_func)->SetPolynomial(params);
-    else if (m_func_type == kAttenuationZ)
+}
+
+template <typename T>
+void AnaFitParameters::ApplyKernel(const double* par, const PMTStore& pmts, int slot, T* wght, int begin, int end) const
+{
+    switch(m_func_type)
     {
-        ((AttenuationZ*)m_func)->alpha0 = params[0];
-        ((AttenuationZ*)m_func)->slopeA = params[1];
+        case kIdentity:
+            ReWeightKernel<kIdentity>::Apply(m_func, par, pmts, slot, wght, begin, end);
+            break;
+        case kAttenuation:
+            ReWeightKernel<kAttenuation>::Apply(m_func, par, pmts, slot, wght, begin, end);
+            break;
+        case kPolynomialCosth:
+            ReWeightKernel<kPolynomialCosth>::Apply(m_func, par, pmts, slot, wght, begin, end);
+            break;
+        case kAttenuationZ:
+            ReWeightKernel<kAttenuationZ>::Apply(m_func, par, pmts, slot, wght, begin, end);
+            break;
+        case kSourcePhiVar:
+            ReWeightKernel<kSourcePhiVar>::Apply(m_func, par, pmts, slot, wght, begin, end);
+            break;
+        case kFormula:
+            ReWeightKernel<kFormula>::Apply(m_func, par, pmts, slot, wght, begin, end);
+            break;
+        case kLEDProfile:
+            ReWeightKernel<kLEDProfile>::Apply(m_func, par, pmts, slot, wght, begin, end);
+            break;
+        case kSolidAngle:
+            ReWeightKernel<kSolidAngle>::Apply(m_func, par, pmts, slot, wght, begin, end);
+            break;
+        default: // kScatter and kSpline do not change the direct PE weight
+            break;
     }
 }
 
-void AnaFitParameters::ReWeight(AnaEvent* event, int pmttype, int nsample, int nevent, std::vector<double>& params)
+void AnaFitParameters::UpdateFactor(PMTStore* pmts, int nsample, int begin, int end, std::vector<double>& params)
 {
 #ifndef NDEBUG
-    if(m_evmap.empty()) //need to build an event map first
+    if(m_parbin_slot.empty()) //need to build an event map first
     {
-        std::cerr  << ERR << "In AnaFitParameters::ReWeight()\n"
+        std::cerr  << ERR << "In AnaFitParameters::UpdateFactor()\n"
                    << "Need to build event map index for " << m_name << std::endl;
         return;
     }
 #endif
 
-    //if (m_pmttype >=0 && pmttype != m_pmttype) return;
+    const int slot = m_parbin_slot[nsample];
+    pmt_real* factor = pmts->GetFactor(slot);
+    for(int i = begin; i < end; ++i)
+        factor[i] = 1.0;
 
-    if (m_spline)
-    {
-        ReWeightSpline(event, pmttype, nsample, nevent, params);
-    }
+    // Dispatch once per PMT range, the kernels themselves are not virtual
+    ApplyKernel(params.data(), *pmts, slot, factor, begin, end);
+}
 
-    const int bin = m_evmap[nsample][nevent];
-    if(bin == PASSEVENT || bin == BADBIN)
+void AnaFitParameters::ReWeight(PMTStore* pmts, int nsample, int begin, int end)
+{
+    pmts->MultiplyFactor(m_parbin_slot[nsample], begin, end);
+}
+
+void AnaFitParameters::UpdateBasis(PMTStore* pmts, int nsample, int begin, int end)
+{
+    const int slot = m_parbin_slot[nsample];
+    const int width = pmts->GetParBasisWidth(slot);
+    if (width == 0)
         return;
-    else
+
+    pmt_real* rows = pmts->GetParBasis(slot);
+    int* len = pmts->GetParBasisLen(slot);
+    std::vector<double> row(width);
+    if (m_func_type == kPolynomialCosth)
     {
-#ifndef NDEBUG
-        if(bin > params.size())
+        const PolynomialCosth* f = (const PolynomialCosth*)m_func;
+        const pmt_real* costh = pmts->GetCosth();
+        for (int i=begin;i<end;i++)
         {
-            std::cout << ERR  << "In ReWeight()\n"
-                        << "Number of bins in " << m_name << " does not match num of parameters.\n"
-                        << "Setting event weight to zero." << std::endl;
-            event -> AddEvWght(0.0);
+            f->BasisRow(costh[i], row.data(), len[i]);
+            std::copy(row.begin(), row.end(), rows + (std::size_t)i*width);
         }
-#endif
-        double wgt = (*m_func)(params[bin],*event);
+    }
+    else if (m_func_type == kLEDProfile)
+    {
+        const LEDProfileFunction* f = (const LEDProfileFunction*)m_func;
+        const pmt_real* cosths = pmts->GetCosths();
+        const pmt_real* phis = pmts->GetPhis();
+        for (int i=begin;i<end;i++)
+        {
+            f->BasisRow(cosths[i], phis[i], row.data());
+            len[i] = 2;
+            std::copy(row.begin(), row.end(), rows + (std::size_t)i*width);
+        }
+    }
+}
+
+void AnaFitParameters::SetSmearKernels(int nsample, int point, const std::vector<double>& params)
+{
+    if (HasTimeSmear(nsample))
+        m_smear_engine[nsample].SetKernels(point, params);
+}
 
-        event -> AddEvWght(wgt);
+void AnaFitParameters::SmearTemplate(PMTStore* pmts, int nsample, int point, int begin, int end) const
+{
+    if (HasTimeSmear(nsample))
+        m_smear_engine[nsample].Smear(point, pmts->GetParBinIndex(m_parbin_slot[nsample]), pmts->GetTemplateSmear(), begin, end);
+}
+
+void AnaFitParameters::AddGeometryShift(const std::vector<double>& params, double* src, double* pmt) const
+{
+    for (int j=0;j<3;j++)
+    {
+        src[j] += params[j];
+        if (Npar == 6) pmt[j] += params[3+j];
     }
 }
 
-double AnaFitParameters::GetWeight(AnaEvent* event, int pmttype, int nsample, int nevent, std::vector<double>& params)
+bool AnaFitParameters::ParametersChanged(const std::vector<double>& params)
 {
-#ifndef NDEBUG
-    if(m_evmap.empty()) //need to build an event map first
+    if(m_cache_valid && params == m_cached_pars)
+        return false;
+
+    m_cached_pars = params;
+    m_cache_valid = true;
+    return true;
+}
+
+bool AnaFitParameters::FactorizeBins(const PMTStore* pmts, int nsample, int nbins, std::vector<int>& bin_map) const
+{
+    // Only the Identity factor depends on nothing but the parameter bin of the PMT,
+    // splines also act on the template which is not binned in the sample bins
+    if (m_func_type != kIdentity || m_spline || m_parbin_slot.size() <= nsample)
+        return false;
+
+    const int num_pmts = pmts->GetNPMTs();
+    const int* parbin = pmts->GetParBinIndex(m_parbin_slot[nsample]);
+    const int* bins = pmts->GetSampleBin();
+    bin_map.assign(nbins, BADBIN);
+    for (int k=0;k<num_pmts;k++)
     {
-        std::cerr  << "In AnaFitParameters::ReWeight()\n"
-                   << "Need to build event map index for " << m_name << std::endl;
-        return 1.;
+        const int b = bins[k];
+        if (b < 0) continue;
+        const int p = parbin[k] < 0 ? PASSEVENT : parbin[k];
+        if (bin_map[b] == BADBIN)
+            bin_map[b] = p;
+        else if (bin_map[b] != p)
+            return false;
     }
-#endif
 
-    if (m_pmttype >=0 && pmttype != m_pmttype) return 1.;
+    // bins without PMTs have no prediction to scale
+    for (auto& p : bin_map)
+        if (p == BADBIN) p = PASSEVENT;
 
-    const int bin = m_evmap[nsample][nevent];
-    if(bin == PASSEVENT || bin == BADBIN)
-        return 1.;
-    else
+    return true;
+}
+
+void AnaFitParameters::MultiplyBinFactor(const std::vector<double>& params, const std::vector<int>& bin_map, double* factor) const
+{
+    for (std::size_t b=0;b<bin_map.size();b++)
+        if (bin_map[b] >= 0)
+            factor[b] *= params[bin_map[b]];
+}
+
+void AnaFitParameters::BuildCompressed(const PMTStore* pmts, int nsample, int nbins)
+{
+    if (m_att_moments.size() <= nsample)
+        m_att_moments.resize(nsample+1);
+
+    // the cell width is set by the smallest attenuation length the fit can reach
+    double alpha_min = -1;
+    for (int i=0;i<Npar;i++)
+    {
+        const double a = pars_limlow[i] > 0 ? pars_limlow[i] : 0.5*pars_original[i];
+        if (a > 0 && (alpha_min < 0 || a < alpha_min))
+            alpha_min = a;
+    }
+    if (alpha_min <= 0)
+    {
+        std::cout << ERR << "Cannot compress " << m_name << " without positive attenuation lengths" << std::endl;
+        m_att_moments[nsample].Clear();
+        return;
+    }
+
+    const int* parbin = pmts->GetParBinIndex(m_parbin_slot[nsample]);
+    const double width = AttenuationMoments::CellWidth(m_compress_tol, alpha_min);
+    m_att_moments[nsample].Build(*pmts, parbin, nbins, width);
+
+    // achieved error at the prior values and at the smallest attenuation length
+    std::vector<double> approx(nbins), exact(nbins);
+    std::vector<std::vector<double>> test_pars = {pars_original, std::vector<double>(Npar, alpha_min)};
+    double max_err = 0;
+    for (const auto& par : test_pars)
     {
+        m_att_moments[nsample].Eval(par.data(), approx.data());
+        AttenuationMoments::EvalExact(*pmts, parbin, nbins, par.data(), exact.data());
+        for (int b=0;b<nbins;b++)
+            if (exact[b] > 0)
+                max_err = std::max(max_err, std::fabs(approx[b]/exact[b]-1));
+    }
+
+    std::cout << TAG << "Compressed " << m_name << " for sample " << nsample << ": " << pmts->GetNPMTs() << " PMTs into "
+              << m_att_moments[nsample].GetNCells() << " R cells of " << width << " cm, max relative error "
+              << max_err << " (tolerance " << m_compress_tol << ")" << std::endl;
+    if (max_err > m_compress_tol)
+        std::cout << WAR << "Compression error of " << m_name << " exceeds the tolerance" << std::endl;
+}
+
+void AnaFitParameters::EvalCompressed(int nsample, const std::vector<double>& params, double* direct) const
+{
+    m_att_moments[nsample].Eval(params.data(), direct);
+}
+
+void AnaFitParameters::GetWeights(const PMTStore* pmts, int nsample, std::vector<double>& params, std::vector<double>& weights)
+{
+    weights.assign(pmts->GetNPMTs(), 1.);
+
 #ifndef NDEBUG
-        if(bin > params.size())
-        {
-            std::cout << ERR  << "In GetWeight()\n"
-                        << "Number of bins in " << m_name << " does not match num of parameters.\n"
-                        << "Setting event weight to zero." << std::endl;
-            return 1.;
-        }
-#endif
-        double wgt = (*m_func)(params[bin],*event);
-        return wgt;
+    if(m_parbin_slot.empty()) //need to build an event map first
+    {
+        std::cerr  << ERR << "In AnaFitParameters::GetWeights()\n"
+                   << "Need to build event map index for " << m_name << std::endl;
+        return;
     }
+#endif
+
+    ApplyKernel(params.data(), *pmts, m_parbin_slot[nsample], weights.data(), 0, weights.size());
 }
 
+
 void AnaFitParameters::SetCovarianceMatrix(const TMatrixDSym& covmat, bool decompose)
 {
     if(covariance != nullptr)
@@ -415,18 +710,46 @@ void AnaFitParameters::LoadSpline(std::vector<AnaSample*> &sample)
 {
     // Load spline
 
-    spline.clear();
+    ClearSplineGraphs();
+    m_spline_engine.clear();
+    m_grid_engine.clear();
+
+    for (const int par : m_spline_par)
+    {
+        if (par < 0 || par >= Npar)
+        {
+            std::cout << ERR << "Spline parameter index " << par << " of " << m_name << " is out of range, using parameter 0" << std::endl;
+            m_spline_par.assign(1, 0);
+            break;
+        }
+    }
 
     double x[] = {-100000,100000};
     double y[] = {1,1};
-    TGraph* flatspline = new TGraph(2,x,y);
+    m_flatspline = new TGraph(2,x,y);
 
     for(std::size_t s=0; s < sample.size(); s++)
     {
         int nbins = sample[s]->UseTemplate() ? sample[s]->GetTemplate()->GetNbinsY() : 0 ;
 
-        //std::vector<std::vector<TGraph>> sample_map(sample[s] -> GetNPMTs(), std::vector<TGraph>(nbins,flatspline) );
         std::vector<std::vector<TGraph*>> sample_map;
+        SplineEngine engine;
+        GridEngine grid;
+
+        // binary file from app/spline_convert.cc, filled in one pass without any TGraph
+        if (nbins > 0 && SplineFile::IsSplineFile(m_spline_file_name[s]))
+        {
+            if (!LoadSplineFile(sample[s], m_spline_file_name[s], nbins, engine, grid))
+            {
+                std::cout << ERR << "Failed to load spline file " << m_spline_file_name[s] << ", splines of sample "
+                          << sample[s]->GetName() << " are set to 1" << std::endl;
+                sample_map.assign(sample[s]->GetNPMTs(), std::vector<TGraph*>(nbins, m_flatspline));
+            }
+            m_spline_engine.emplace_back(engine);
+            m_grid_engine.emplace_back(grid);
+            spline.emplace_back(sample_map);
+            continue;
+        }
 
         TFile f(m_spline_file_name[s].c_str());
         if (!f.IsOpen()){
@@ -448,25 +771,33 @@ void AnaFitParameters::LoadSpline(std::vector<AnaSample*> &sample)
                 TGraph* graph = (TGraph*)f.Get(graphname.c_str());
                 if (graph)
                 {
-                    //graph->SetDirectory(0);
                     pmt_map.push_back(graph);
-                    //std::cout << TAG << "Get graph: " << graphname << std::endl;
-                    // TGraph g(*graph);
-                    // sample_map[i][j-1] = g;
                 }
                 else
                 {
                     std::cout << WAR << "Could not find "<< graphname <<std::endl;
-                    pmt_map.push_back(flatspline);
+                    pmt_map.push_back(m_flatspline);
                 }
             }
 
-            //std::cout << TAG << "Loaded spline for PMT "<< i <<std::endl;
-
             sample_map.emplace_back(pmt_map);
         }
 
         std::cout << TAG << "Loaded spline for sample "<< sample[s]->GetName() << " of total "<< sample[s] -> GetNPMTs() << "PMTs"<<std::endl;
+
+        if (nbins > 0 && PackSpline(sample_map, m_flatspline, engine))
+        {
+            std::cout << TAG << "Packed " << engine.GetNSplines() << " splines with " << engine.GetNKnots() << " shared knots, "
+                      << (m_spline_mode == SplineEngine::kCubic ? "cubic" : "linear") << " interpolation" << std::endl;
+
+            // the TGraphs are not needed once packed
+            for (auto& pmt_map : sample_map)
+                for (auto g : pmt_map)
+                    if (g != m_flatspline) delete g;
+            sample_map.clear();
+        }
+        m_spline_engine.emplace_back(engine);
+        m_grid_engine.emplace_back(grid);
         spline.emplace_back(sample_map);
 
         f.Close();
@@ -474,15 +805,192 @@ void AnaFitParameters::LoadSpline(std::vector<AnaSample*> &sample)
 
 }
 
-void AnaFitParameters::ReWeightSpline(AnaEvent* event, int pmttype, int nsample, int nevent, std::vector<double>& params)
+bool AnaFitParameters::LoadSplineFile(AnaSample* sample, const std::string& fname, const int nbins, SplineEngine& engine, GridEngine& grid) const
+{
+    SplineFile sf;
+    if (!sf.Open(fname))
+        return false;
+
+    if (sf.GetNBins() != nbins)
+    {
+        std::cout << ERR << "Spline file " << fname << " has " << sf.GetNBins() << " bins per PMT, but the template has " << nbins << std::endl;
+        return false;
+    }
+
+    const int ndim = sf.GetNDim();
+    if (!m_spline_par.empty() && m_spline_par.size() != ndim)
+    {
+        std::cout << ERR << "Spline file " << fname << " has " << ndim << " dimensions, but the spline_pars of " << m_name
+                  << " map " << m_spline_par.size() << std::endl;
+        return false;
+    }
+    std::vector<std::vector<double>> knots(ndim);
+    for (int d=0;d<ndim;d++)
+    {
+        knots[d].assign(sf.GetKnots(d), sf.GetKnots(d) + sf.GetNKnots(d));
+        for (int k=1;k<knots[d].size();k++)
+        {
+            if (knots[d][k] <= knots[d][k-1])
+            {
+                std::cout << ERR << "Spline knots in " << fname << " are not increasing" << std::endl;
+                return false;
+            }
+        }
+        if (SplinePar(d) >= Npar)
+        {
+            std::cout << ERR << "Spline file " << fname << " has " << ndim << " dimensions, but " << m_name << " has "
+                      << Npar << " parameters, map them with the spline_pars option" << std::endl;
+            return false;
+        }
+    }
+
+    // each (PMT, time bin) is a response grid over the parameters, packed in a GridEngine
+    const int nknots = sf.GetNKnots();
+    const int npmts = sample->GetNPMTs();
+    if (ndim > 1)
+    {
+        grid.Init(knots, npmts*nbins, m_spline_mode);
+        int nmissing = 0;
+        for (int i=0;i<npmts;i++)
+        {
+            const double* val = sf.GetValues(sample->GetPMT(i)->GetPMTID());
+            if (val == nullptr)
+            {
+                nmissing++;
+                continue;
+            }
+            for (int j=0;j<nbins;j++)
+                grid.SetRow(i*nbins+j, val + j*nknots);
+        }
+
+        if (nmissing > 0)
+            std::cout << WAR << nmissing << " PMTs of sample " << sample->GetName() << " are not in " << fname << ", using flat grids" << std::endl;
+        std::cout << TAG << "Loaded " << grid.GetNRows() << " response grids of " << ndim << " parameters with " << nknots
+                  << " shared grid points from " << fname << ", " << (m_spline_mode == SplineEngine::kCubic ? "cubic" : "linear")
+                  << " interpolation" << std::endl;
+        return true;
+    }
+
+    // splines of PMTs missing from the file stay flat after Init
+    engine.Init(knots[0], npmts*nbins, m_spline_mode);
+    int nmissing = 0;
+    for (int i=0;i<npmts;i++)
+    {
+        const double* val = sf.GetValues(sample->GetPMT(i)->GetPMTID());
+        if (val == nullptr)
+        {
+            nmissing++;
+            continue;
+        }
+        for (int j=0;j<nbins;j++)
+            engine.SetSpline(i*nbins+j, val + j*nknots);
+    }
+
+    if (nmissing > 0)
+        std::cout << WAR << nmissing << " PMTs of sample " << sample->GetName() << " are not in " << fname << ", using flat splines" << std::endl;
+    std::cout << TAG << "Loaded " << engine.GetNSplines() << " splines with " << nknots << " shared knots from " << fname << ", "
+              << (m_spline_mode == SplineEngine::kCubic ? "cubic" : "linear") << " interpolation" << std::endl;
+
+    return true;
+}
+
+void AnaFitParameters::ClearSplineGraphs()
+{
+    for (auto& sample_map : spline)
+        for (auto& pmt_map : sample_map)
+            for (auto g : pmt_map)
+                if (g != m_flatspline) delete g;
+    spline.clear();
+
+    if (m_flatspline != nullptr)
+        delete m_flatspline;
+    m_flatspline = nullptr;
+}
+
+bool AnaFitParameters::PackSpline(const std::vector<std::vector<TGraph*>>& graphs, const TGraph* flatspline, SplineEngine& engine) const
 {
-    std::vector<double> timetof_pred = event->GetTimetofPred();
-    for (int i=0;i<timetof_pred.size();i++)
+    // Splines from macro/build_template_and_spline.c share the same knots,
+    // missing graphs are replaced by the flat spline which is 1 at any knot
+    const TGraph* ref = nullptr;
+    for (const auto& pmt_graphs : graphs)
     {
-        double weight = spline[nsample][nevent][i]->Eval(params[0]);
-        timetof_pred[i] *= weight;
+        for (const auto g : pmt_graphs)
+            if (g != flatspline) { ref = g; break; }
+        if (ref != nullptr) break;
     }
+    if (ref == nullptr)
+        return false;
 
-    event->SetTimetofPred(timetof_pred);
+    const int nknots = ref->GetN();
+    std::vector<double> knots(ref->GetX(), ref->GetX() + nknots);
+    for (int k=1;k<nknots;k++)
+    {
+        if (knots[k] <= knots[k-1])
+        {
+            std::cout << WAR << "Spline knots of " << m_name << " are not increasing, using TGraph::Eval" << std::endl;
+            return false;
+        }
+    }
+
+    const int nbins = graphs[0].size();
+    engine.Init(knots, graphs.size()*nbins, m_spline_mode);
+    std::vector<double> ones(nknots, 1.0);
+    for (int i=0;i<graphs.size();i++)
+    {
+        for (int j=0;j<nbins;j++)
+        {
+            const TGraph* g = graphs[i][j];
+            if (g == flatspline)
+            {
+                engine.SetSpline(i*nbins+j, ones.data());
+                continue;
+            }
+            bool same_knots = g->GetN() == nknots;
+            for (int k=0;k<nknots && same_knots;k++)
+                same_knots = std::fabs(g->GetX()[k] - knots[k]) <= 1e-9*std::fabs(knots[k]);
+            if (!same_knots)
+            {
+                std::cout << WAR << "Splines of " << m_name << " do not share the same knots, using TGraph::Eval" << std::endl;
+                engine.Clear();
+                return false;
+            }
+            engine.SetSpline(i*nbins+j, g->GetY());
+        }
+    }
+
+    return true;
 }
 
+void AnaFitParameters::ReWeightSpline(PMTStore* pmts, int nsample, int begin, int end, std::vector<double>& params)
+{
+    if (!m_spline) return;
+
+    // scale the template prediction of each PMT in place
+    const int ntbins = pmts->GetNTimeBins();
+    double* timetof_pred = pmts->GetTemplatePred();
+    const GridEngine& grid = m_grid_engine[nsample];
+    if (!grid.IsEmpty())
+    {
+        std::vector<double> x(grid.GetNDim());
+        for (int d=0;d<x.size();d++)
+            x[d] = params[SplinePar(d)];
+        grid.Scale(x.data(), timetof_pred, begin*ntbins, end*ntbins);
+        return;
+    }
+
+    const double x = params[SplinePar(0)];
+    const SplineEngine& engine = m_spline_engine[nsample];
+    if (!engine.IsEmpty())
+    {
+        engine.Scale(x, timetof_pred, begin*ntbins, end*ntbins);
+        return;
+    }
+
+    for (int k=begin;k<end;k++)
+    {
+        const std::vector<TGraph*>& pmt_spline = spline[nsample][k];
+        double* pred = timetof_pred + k*ntbins;
+        for (int i=0;i<ntbins;i++)
+            pred[i] *= pmt_spline[i]->Eval(x);
+    }
+}
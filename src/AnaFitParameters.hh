@@ -14,6 +14,11 @@ using TMatrixDSym = TMatrixTSym<double>;
 #include "AnaSample.hh"
 #include "BinManager.hh"
 #include "ParameterFunction.hh"
+#include "SplineEngine.hh"
+#include "GridEngine.hh"
+#include "SplineFile.hh"
+#include "TimeSmearEngine.hh"
+#include "AttenuationMoments.hh"
 #include "EigenDecomp.hh"
 #include "ColorOutput.hh"
 
@@ -31,8 +36,11 @@ public:
                         std::vector<double> lows, std::vector<double> highs, std::vector<bool> fixed);
     void InitEventMap(std::vector<AnaSample*>& sample);
     void ApplyParameters(std::vector<double>& params);
-    void ReWeight(AnaEvent* event, int pmttype, int nsample, int nevent, std::vector<double>& params);
-    double GetWeight(AnaEvent* event, int pmttype, int nsample, int nevent, std::vector<double>& params);
+    void UpdateFactor(PMTStore* pmts, int nsample, int begin, int end, std::vector<double>& params);
+    void ReWeight(PMTStore* pmts, int nsample, int begin, int end);
+    // Rebuilds the basis rows of PMTs [begin, end) from the geometry columns, after they moved
+    void UpdateBasis(PMTStore* pmts, int nsample, int begin, int end);
+    void GetWeights(const PMTStore* pmts, int nsample, std::vector<double>& params, std::vector<double>& weights);
 
     std::string GetName() const { return m_name; }
 
@@ -72,6 +80,22 @@ public:
     inline void SetBinVar(std::vector<std::string> vec) { m_binvar = vec; }
 
     void SetParameterFunction(const std::string& func_name);
+    // Geometry classes move the source and PMTs instead of reweighting, adds their shifts (cm) to src and pmt
+    inline bool IsGeometry() const { return m_func_type == kGeometry; }
+    void AddGeometryShift(const std::vector<double>& params, double* src, double* pmt) const;
+    // Time resolution classes smear the timetof template instead of reweighting, see TimeSmearEngine
+    inline bool IsTimeSmear() const { return m_func_type == kTimeSmear; }
+    inline bool HasTimeSmear(int nsample) const { return nsample < m_smear_engine.size() && !m_smear_engine[nsample].IsEmpty(); }
+    inline void SetTimeShape(const int shape) { m_time_shape = shape; }
+    void SetSmearKernels(int nsample, int point, const std::vector<double>& params);
+    void SmearTemplate(PMTStore* pmts, int nsample, int point, int begin, int end) const;
+    // Expression of the Formula function type, set before SetParameterFunction
+    inline void SetFormula(const std::string& expr) { m_formula = expr; }
+    // Power and variation spectra of the LEDProfile function, see LEDProfile::SetPowerSpectrum
+    inline void SetLEDSpectra(const std::string& fname, const std::string& power, const std::string& variation)
+    {
+        m_led_file = fname; m_led_power = power; m_led_variation = variation;
+    }
 
     inline void SetPMTType(const int val) { m_pmttype = val; }
     inline int GetPMTType() const { return m_pmttype; }
@@ -99,11 +123,37 @@ public:
 
     void SetSpline(const std::vector<std::string> file_name, const std::vector<std::string> spline_name);
     void LoadSpline(std::vector<AnaSample*>& sample);
-    void ReWeightSpline(AnaEvent* event, int pmttype, int nsample, int nevent, std::vector<double>& params);
+    void ReWeightSpline(PMTStore* pmts, int nsample, int begin, int end, std::vector<double>& params);
+    inline bool UseSpline() const { return m_spline; }
+    inline void SetSplineMode(const int mode) { m_spline_mode = mode; }
+    // Parameter index of each spline dimension, default is parameter d for dimension d
+    inline void SetSplinePars(const std::vector<int>& pars) { m_spline_par = pars; }
+
+    // Returns true if params differ from the last call, and remembers them
+    bool ParametersChanged(const std::vector<double>& params);
+    inline void InvalidateCache() { m_cache_valid = false; }
+
+    // Factorization out of the PMT sums: if the factor of this class is the same for all PMTs
+    // in each sample bin, fills bin_map with the parameter bin of each sample bin (PASSEVENT for factor 1)
+    bool FactorizeBins(const PMTStore* pmts, int nsample, int nbins, std::vector<int>& bin_map) const;
+    void MultiplyBinFactor(const std::vector<double>& params, const std::vector<int>& bin_map, double* factor) const;
+
+    // Compressed attenuation: the direct PE of each sample bin is evaluated from R moments
+    // to a relative tolerance, instead of summing over the PMTs
+    inline void SetCompression(const double tol) { m_compress_tol = tol; }
+    inline bool UseCompression() const { return m_compress_tol > 0 && m_func_type == kAttenuation && !m_decompose && !m_spline; }
+    void BuildCompressed(const PMTStore* pmts, int nsample, int nbins);
+    void EvalCompressed(int nsample, const std::vector<double>& params, double* direct) const;
+
+    // Approximate exp/pow in the reweight kernels, see FastMath.hh
+    inline void SetFastMath(const bool flag) { m_fast_math = flag; m_func->fast_math = flag; }
 
 
 protected:
     bool CheckDims(const std::vector<double>& params) const;
+    // wght is the float or double factor column of the PMTStore, or a double array of output weights
+    template <typename T>
+    void ApplyKernel(const double* par, const PMTStore& pmts, int slot, T* wght, int begin, int end) const;
 
     std::size_t Npar;
     std::string m_name;
@@ -115,7 +165,9 @@ protected:
     std::vector<double> pars_limhigh;
     std::vector<bool> pars_fixed;
 
-    std::vector<std::vector<int>> m_evmap;
+    std::vector<int> m_parbin_slot; // slot of the parameter bin index array in each sample's PMTStore
+    std::vector<double> m_cached_pars; // parameters of the cached per-PMT factors
+    bool m_cache_valid;
     bool m_rng_start;
     bool m_do_cap_weights;
     double m_weight_cap;
@@ -127,12 +179,15 @@ protected:
 
     ParameterFunction* m_func;
     int m_func_type;
+    std::string m_formula;
+    std::string m_led_file, m_led_power, m_led_variation;
 
     EigenDecomp* eigen_decomp;
     TMatrixDSym* covariance;
     TMatrixDSym* covarianceI;
     TMatrixDSym* original_cov;
     bool m_decompose;
+    bool m_fast_math;
 
     std::vector<int> pol_orders; // order of polynomial in each piece 
     std::vector<double> pol_range; // applicable range for each polynomial
@@ -143,6 +198,24 @@ protected:
     std::vector<std::string> m_spline_name;
     std::vector<std::vector<std::vector<TGraph*>>> spline;
     //std::vector<TGraph> spline;
+    // packed shared-knot splines of each sample, empty if the TGraphs have to be evaluated one by one
+    std::vector<SplineEngine> m_spline_engine;
+    // response grids of each sample for splines of more than one parameter
+    std::vector<GridEngine> m_grid_engine;
+    int m_spline_mode;
+    std::vector<int> m_spline_par;
+    inline int SplinePar(const int d) const { return m_spline_par.empty() ? d : m_spline_par[d]; }
+    bool PackSpline(const std::vector<std::vector<TGraph*>>& graphs, const TGraph* flatspline, SplineEngine& engine) const;
+    bool LoadSplineFile(AnaSample* sample, const std::string& fname, const int nbins, SplineEngine& engine, GridEngine& grid) const;
+    void ClearSplineGraphs();
+    TGraph* m_flatspline; // shared by all missing graphs
+
+    // nominal template spectra of each sample for the time resolution function
+    std::vector<TimeSmearEngine> m_smear_engine;
+    int m_time_shape;
+
+    double m_compress_tol;
+    std::vector<AttenuationMoments> m_att_moments; // per sample
 
     const std::string TAG = color::GREEN_STR + "[AnaFitParameters]: " + color::RESET_STR;
     const std::string ERR = color::RED_STR + "[AnaFitParameters ERROR]: " + color::RESET_STR;
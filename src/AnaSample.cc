@@ -1,4 +1,6 @@
 #include "AnaSample.hh"
+#include "utils/LEDProfile.hh"
+#include "utils/AttenuationZ.hh"
 
 AnaSample::AnaSample(int sample_id, const std::string& name, const std::string& binning, int pmt_type)
     : m_sample_id(sample_id)
@@ -21,6 +23,19 @@ AnaSample::AnaSample(int sample_id, const std::string& name, const std::string&
     , m_time_offset(false)
     , m_time_smear(false)
     , m_z0(0.)
+    , m_has_source(false)
+    , m_group_vel(false)
+    , m_vg(0.)
+    , m_vg_min(0.)
+    , m_vg_max(0.)
+    , m_vg_ref(-1.)
+    , m_fine_window(false)
+    , m_data_led(false)
+    , m_data_attz(false)
+    , m_data_attz_slope(0.)
+    , m_data_attz_wl(400.)
+    , m_data_attz_abwff(1.)
+    , m_data_attz_rayff(1.)
     , m_htimetof_data(nullptr)
     , m_htimetof_pred(nullptr)
     , m_htimetof_pred_w2(nullptr)
@@ -31,6 +46,16 @@ AnaSample::AnaSample(int sample_id, const std::string& name, const std::string&
     , m_eff_var(false)
     , m_eff_sig(0.0)
     , m_template(false)
+    , m_acc_chunk(PMT_CHUNK_SIZE)
+    , m_acc_nchunks(0)
+    , m_acc_ngroups(0)
+    , m_acc_npoints(1)
+    , m_acc_off_tpred(0)
+    , m_acc_buf_size(0)
+    , m_chi2_template(0.0)
+    , m_hist_stale(false)
+    , m_sort_by_bin(false)
+    , m_fast_math(false)
     , selTree(nullptr)
 {
     TH1::SetDefaultSumw2(true);
@@ -101,6 +126,7 @@ void AnaSample::LoadEventsFromFile(const std::string& file_name, const std::stri
 
     std::cout << TAG  << "Reading PMT geometry...\n";
     std::vector<AnaEvent> pmt_vec = selTree->GetPMTs();
+    m_has_source = selTree->GetSourceFrame(m_source);
 
     m_pmts.clear();
     // Add PMT geometry
@@ -136,6 +162,9 @@ void AnaSample::LoadEventsFromFile(const std::string& file_name, const std::stri
     int nPMTs = selTree->GetPMTEntries();
     m_hdata_pmt = new TH1D("","",nPMTs,0,nPMTs);
 
+    if (m_group_vel) InitFineTime(nPMTs);
+    InitDataWeight(nPMTs);
+
     // determine the random offset for each PMT
     std::vector<double> timetof_shift;
     if (m_time_offset)
@@ -176,6 +205,12 @@ void AnaSample::LoadEventsFromFile(const std::string& file_name, const std::stri
         if (m_time_offset) timetof += timetof_shift[pmtID];
         if (m_time_smear) timetof += gRandom->Gaus(0,time_resolution[pmtID]);
 
+        if (m_group_vel)
+        {
+            FillFineTime(pmtID,timetof,nPE);
+            continue;
+        }
+
         bool skip = false;
 
         for (int j=0;j<m_cutvar.size();j++) {
@@ -209,9 +244,220 @@ void AnaSample::LoadEventsFromFile(const std::string& file_name, const std::stri
         else m_hdata_pmt->Fill(pmtID+0.5, nPE);
     }
 
+    if (m_group_vel) SetGroupVelocity(m_vg);
+
     PrintStats();
 }
 
+void AnaSample::InitDataWeight(const int nPMTs)
+{
+    m_data_weight.clear();
+    if (!m_data_led && !m_data_attz) return;
+
+    LEDProfile* led = nullptr;
+    if (m_data_led)
+    {
+        led = new LEDProfile();
+        if (!m_data_led_file.empty())
+        {
+            TFile f(m_data_led_file.c_str());
+            TH1* hpower = (TH1*)f.Get(m_data_led_power.c_str());
+            TH1* hvariation = (TH1*)f.Get(m_data_led_variation.c_str());
+            if (hpower != nullptr && hvariation != nullptr)
+            {
+                led->SetPowerSpectrum(hpower);
+                led->SetVariationSpectrum(hvariation);
+            }
+            else std::cout << ERR << "LED spectra not found in " << m_data_led_file << ", using the default profile." << std::endl;
+        }
+    }
+    AttenuationZWeight* attenZ = nullptr;
+    if (m_data_attz) attenZ = new AttenuationZWeight(m_data_attz_wl, m_z0, m_data_attz_slope, m_data_attz_abwff, m_data_attz_rayff);
+
+    m_data_weight.assign(nPMTs, 1.);
+    for (const auto& e : m_pmts)
+    {
+        double wgt = 1.;
+        if (led) wgt *= led->GetLEDWeight(e.GetCosths(), e.GetPhis());
+        if (attenZ) wgt *= attenZ->GetAttenuationZWeight(e.GetR(), e.GetDz());
+        m_data_weight[e.GetPMTID()] = wgt;
+    }
+
+    std::cout << TAG << "Reweighting the data of sample " << m_name << " by"
+              << (led ? " the LED profile" : "") << (attenZ ? " the z-dependent attenuation" : "") << std::endl;
+
+    if (led) delete led;
+    if (attenZ) delete attenZ;
+}
+
+void AnaSample::InitFineTime(const int nPMTs)
+{
+    if (m_vg_ref <= 0) m_vg_ref = selTree->GetGroupVelocity();
+    if (m_vg_ref <= 0)
+    {
+        std::cout << ERR << "Group velocity of the conversion not found in the file, set it in the group_velocity option." << std::endl;
+        std::cout << ERR << "Group velocity option is disabled for sample " << m_name << std::endl;
+        m_group_vel = false;
+        return;
+    }
+    if (m_vg_min > m_vg_max) std::swap(m_vg_min, m_vg_max);
+    m_vg_min = std::min(m_vg_min, m_vg);
+    m_vg_max = std::max(m_vg_max, m_vg);
+
+    // direct and control windows: the timetof cuts, intersected with the scattering windows
+    const double inf = std::numeric_limits<double>::infinity();
+    double cut_lo = -inf, cut_hi = inf;
+    for (int j=0;j<m_cutvar.size();j++)
+    {
+        if (m_cutvar[j]!="timetof") continue;
+        cut_lo = std::max(cut_lo, m_cutlow[j]);
+        cut_hi = std::min(cut_hi, m_cuthigh[j]);
+    }
+    m_fine_direct[0] = cut_lo; m_fine_direct[1] = cut_hi;
+    m_fine_control[0] = m_fine_control[1] = 0;
+    if (m_scatter || m_scatter_map)
+    {
+        m_fine_direct[0] = std::max(cut_lo, m_scatter_time1);
+        m_fine_direct[1] = std::min(cut_hi, m_scatter_time2);
+        m_fine_control[0] = std::max(cut_lo, m_scatter_time2);
+        m_fine_control[1] = std::min(cut_hi, m_scatter_time3);
+    }
+    m_fine_window = !std::isinf(m_fine_direct[0]) || !std::isinf(m_fine_direct[1]);
+
+    // timetof range that must be resolved: the finite window edges and the template data.
+    // The hits below or above the fine bins of a PMT stay below or above this range for all vg,
+    // they are only counted per PMT for the open ends of a half-infinite window.
+    double lo = inf, hi = -inf;
+    std::vector<double> edges = {m_fine_direct[0], m_fine_direct[1]};
+    if (m_scatter || m_scatter_map)
+    {
+        edges.push_back(m_fine_control[0]);
+        edges.push_back(m_fine_control[1]);
+    }
+    for (const double e : edges)
+    {
+        if (std::isinf(e)) continue;
+        lo = std::min(lo, e);
+        hi = std::max(hi, e);
+    }
+    if (m_template)
+    {
+        lo = std::min(lo, m_htimetof_pmt_data->GetYaxis()->GetXmin() - m_timetof_offset);
+        hi = std::max(hi, m_htimetof_pmt_data->GetYaxis()->GetXmax() - m_timetof_offset);
+    }
+    if (!m_fine_window && !m_template)
+    {
+        std::cout << WAR << "No timetof window or template in sample " << m_name << ", the group velocity has no effect." << std::endl;
+        m_group_vel = false;
+        return;
+    }
+
+    // each PMT covers the range shifted by R/vg_ref - R/vg for all vg in [vg_min, vg_max], R in cm.
+    // PMT IDs without MC keep R = 0, their hits are not shifted.
+    m_fine_R.assign(nPMTs, 0.);
+    for (const auto& e : m_pmts)
+        m_fine_R[e.GetPMTID()] = e.GetR();
+    m_fine_start.assign(nPMTs, 0.);
+    m_fine_offset.assign(nPMTs+1, 0);
+    for (int i=0;i<nPMTs;i++)
+    {
+        const double d_min = m_fine_R[i]*1e-2*(1./m_vg_ref-1./m_vg_min);
+        const double d_max = m_fine_R[i]*1e-2*(1./m_vg_ref-1./m_vg_max);
+        m_fine_start[i] = lo - d_max;
+        const long nbins = std::ceil((hi - d_min - m_fine_start[i])/FINE_TIME_WIDTH);
+        m_fine_offset[i+1] = m_fine_offset[i] + nbins;
+    }
+
+    bool npe_cut = false;
+    for (int j=0;j<m_cutvar.size();j++)
+        if (m_cutvar[j]=="nPE") npe_cut = true;
+
+    m_fine_pe.assign(m_fine_offset[nPMTs], 0.);
+    m_fine_pe_all.assign(m_template && npe_cut ? m_fine_offset[nPMTs] : 0, 0.);
+    m_fine_below.assign(nPMTs, 0.);
+    m_fine_above.assign(nPMTs, 0.);
+
+    std::cout << TAG << "Fine timetof histograms of " << m_fine_offset[nPMTs] << " bins for group velocity in ["
+              << m_vg_min << ", " << m_vg_max << "] m/ns, conversion group velocity = " << m_vg_ref << " m/ns" << std::endl;
+}
+
+void AnaSample::FillFineTime(const int pmtID, const double timetof, const double nPE)
+{
+    if (pmtID<0 || pmtID+1>=m_fine_offset.size()) return;
+
+    bool pass = true;
+    for (int j=0;j<m_cutvar.size();j++)
+        if (m_cutvar[j]=="nPE" && (nPE<m_cutlow[j] || nPE>m_cuthigh[j])) pass = false;
+
+    const double x = std::floor((timetof - m_fine_start[pmtID])/FINE_TIME_WIDTH);
+    if (x < 0 || x >= m_fine_offset[pmtID+1]-m_fine_offset[pmtID])
+    {
+        if (pass && x < 0) m_fine_below[pmtID] += nPE;
+        else if (pass) m_fine_above[pmtID] += nPE;
+        return;
+    }
+    const long bin = m_fine_offset[pmtID] + (long)x;
+
+    if (pass) m_fine_pe[bin] += nPE;
+    if (!m_fine_pe_all.empty()) m_fine_pe_all[bin] += nPE;
+}
+
+bool AnaSample::SetGroupVelocity(double vg)
+{
+    if (!m_group_vel) return false;
+
+    if (vg < m_vg_min || vg > m_vg_max)
+    {
+        std::cout << WAR << "Group velocity " << vg << " outside of the fine histogram range [" << m_vg_min << ", " << m_vg_max
+                  << "] of sample " << m_name << ", hits beyond the range are lost." << std::endl;
+    }
+    m_vg = vg;
+
+    m_hdata_pmt->Reset();
+    if (m_scatter || m_scatter_map) m_hdata_pmt_control->Reset();
+    if (m_template) m_htimetof_pmt_data->Reset();
+
+    // fraction of a fine bin [a,a+FINE_TIME_WIDTH) inside window w, the hits are taken as uniform within the bin.
+    // An open end of w contains all the fine bins on its side.
+    auto overlap = [](const double a, const double* w)
+    {
+        return std::max(0., std::min(a+FINE_TIME_WIDTH, w[1]) - std::max(a, w[0]))/FINE_TIME_WIDTH;
+    };
+    // nPE outside of the fine bins of PMT i that fall in window w
+    auto outside = [this](const int i, const double* w)
+    {
+        return (std::isinf(w[0]) ? m_fine_below[i] : 0.) + (std::isinf(w[1]) ? m_fine_above[i] : 0.);
+    };
+    const bool scatter = m_scatter || m_scatter_map;
+
+    const int nPMTs = m_fine_offset.size()-1;
+    for (int i=0;i<nPMTs;i++)
+    {
+        const double shift = m_fine_R[i]*1e-2*(1./m_vg_ref-1./m_vg);
+        double direct = outside(i, m_fine_direct);
+        double control = scatter ? outside(i, m_fine_control) : 0.;
+        for (long k=m_fine_offset[i];k<m_fine_offset[i+1];k++)
+        {
+            const double a = m_fine_start[i] + (k-m_fine_offset[i])*FINE_TIME_WIDTH + shift;
+            const double pe = m_fine_pe[k];
+            if (pe!=0)
+            {
+                direct += pe*overlap(a, m_fine_direct);
+                if (scatter) control += pe*overlap(a, m_fine_control);
+            }
+            if (m_template)
+            {
+                const double pe_all = m_fine_pe_all.empty() ? pe : m_fine_pe_all[k];
+                if (pe_all!=0) m_htimetof_pmt_data->Fill(i+0.5, a+0.5*FINE_TIME_WIDTH+m_timetof_offset, pe_all);
+            }
+        }
+        m_hdata_pmt->SetBinContent(i+1, direct);
+        if (scatter) m_hdata_pmt_control->SetBinContent(i+1, control);
+    }
+
+    return true;
+}
+
 AnaEvent* AnaSample::GetPMT(const unsigned int evnum)
 {
 #ifndef NDEBUG
@@ -297,27 +543,39 @@ void AnaSample::InitEventMap()
         e.SetSampleBin(b);
     }
 
+    if (m_sort_by_bin)
+    {
+        // PMTs of the same sample bin become contiguous, so the fused pass sums each bin as one segment
+        std::stable_sort(m_pmts.begin(), m_pmts.end(),
+                         [](const AnaEvent& a, const AnaEvent& b) { return a.GetSampleBin() < b.GetSampleBin(); });
+        std::cout << TAG << "Sorted PMTs by sample bin." << std::endl;
+    }
+
+    m_store.Build(m_pmts);
+    if (m_has_source) m_store.SetSource(m_source);
+
     if (m_template)
     {
-        for(auto& e : m_pmts)
+        // nominal template of each PMT goes into the flat buffers of the store
+        const int ny = m_htimetof_pmt_pred->GetNbinsY();
+        m_store.InitTemplate(ny);
+        double* timetof_nom = m_store.GetTemplateNom();
+        double* timetof_nom_sig2 = m_store.GetTemplateNomSig2();
+        for(int k = 0; k < m_pmts.size(); ++k)
         {
-            const int pmtID = e.GetPMTID();
-            std::vector<double> timetof_nom;
-            std::vector<double> timetof_nom_sig2;
-            for (int i=1;i<=m_htimetof_pmt_pred->GetNbinsY();i++)
+            const int pmtID = m_pmts[k].GetPMTID();
+            for (int i=0;i<ny;i++)
             {
-                timetof_nom.push_back(m_htimetof_pmt_pred->GetBinContent(pmtID+1,i));
-                double sig2 = m_htimetof_pmt_pred->GetBinError(pmtID+1,i);
-                if (sig2>0) sig2 = sig2*sig2/timetof_nom[i-1]/timetof_nom[i-1];
-                timetof_nom_sig2.push_back(sig2);
+                const double nom = m_htimetof_pmt_pred->GetBinContent(pmtID+1,i+1);
+                double sig2 = m_htimetof_pmt_pred->GetBinError(pmtID+1,i+1);
+                if (sig2>0) sig2 = sig2*sig2/nom/nom;
+                timetof_nom[k*ny+i] = nom;
+                timetof_nom_sig2[k*ny+i] = sig2;
             }
-            e.SetTimetofNom(timetof_nom);
-            e.SetTimetofNomSig2(timetof_nom_sig2);
-            e.SetTimetofPred(timetof_nom);
         }
+        m_store.ResetTemplatePred(0, m_pmts.size());
 
         int nx = m_template_combine ? 1 : m_nbins ;
-        int ny = m_htimetof_pmt_pred->GetNbinsY();
         if(m_htimetof_pred != nullptr)
             delete m_htimetof_pred;
         if(m_htimetof_pred_w2 != nullptr)
@@ -331,6 +589,22 @@ void AnaSample::InitEventMap()
         m_htimetof_data = new TH2D(Form("%s_timetof_data", m_name.c_str()), Form("%s_timetof_data", m_name.c_str()), nx, 0, nx, ny, 0, ny );
         m_htimetof_data->SetDirectory(0);
     }
+
+    ResizeFlatHist();
+}
+
+void AnaSample::ResizeFlatHist()
+{
+    m_pred.assign(m_nbins, 0.0);
+    m_pred_direct.assign(m_nbins, 0.0);
+    m_pred_indirect.assign(m_nbins, 0.0);
+    m_pred_err2.assign(m_nbins, 0.0);
+    m_data.assign(m_nbins, 0.0);
+
+    const int ntbins = m_template ? m_htimetof_pred->GetNbinsX()*m_htimetof_pred->GetNbinsY() : 0;
+    m_tpred.assign(ntbins, 0.0);
+    m_tpred_w2.assign(ntbins, 0.0);
+    m_tdata.assign(ntbins, 0.0);
 }
 
 void AnaSample::FillEventHist(bool reset_weights)
@@ -343,48 +617,281 @@ void AnaSample::FillEventHist(bool reset_weights)
         return;
     }
 #endif
-    m_hpred->Reset();
-    if (m_scatter||m_scatter_map) m_hpred_err2->Reset();
+    // same chunks and reduction tree as the fused pass of the fit, so both give identical bins
+    const pmt_real* wght = reset_weights ? m_store.GetWeightMC() : m_store.GetWeight();
+    BeginAccumulate(PMT_CHUNK_SIZE);
+    for(int g = 0; g < m_acc_ngroups; ++g)
+        AccumulateGroup(g, nullptr, wght);
+    ReduceGroups();
 
-    if (m_template) 
-    {
-        m_htimetof_pred->Reset();
-        m_htimetof_pred_w2->Reset();
-    }
+    for(int b = 0; b < m_nbins; ++b)
+        m_pred[b] = m_pred_direct[b] + m_pred_indirect[b];
+
+    SyncEventHist();
+}
+
+void AnaSample::BeginAccumulate(const int chunk_size, const int npoints)
+{
+    // The chunks are split into a fixed number of contiguous groups, each summed in chunk order by one thread,
+    // then the groups are combined per bin with PairwiseSum. None of this depends on the number of threads.
+    const int num_pmts = m_store.GetNPMTs();
+    const bool scatter = m_scatter || m_scatter_map;
+    const int ntbins = m_template ? m_tpred.size() : 0;
+
+    // accumulator layout: [direct pred | pred_err2 | indirect pred | template pred | template w2]
+    m_acc_chunk = chunk_size;
+    m_acc_nchunks = (num_pmts + chunk_size - 1) / chunk_size;
+    m_acc_off_tpred = scatter ? 3*m_nbins : m_nbins;
+    m_acc_buf_size = m_acc_off_tpred + 2*ntbins;
+    m_acc_ngroups = NumReduceGroups(m_acc_nchunks, m_acc_buf_size);
+    m_acc_npoints = npoints;
+    if (m_group_buf.size() < npoints * m_acc_ngroups * m_acc_buf_size)
+        m_group_buf.resize(npoints * m_acc_ngroups * m_acc_buf_size);
+}
 
-    for(const auto& e : m_pmts)
+void AnaSample::DistributePMTs(const int nthreads)
+{
+    BeginAccumulate(PMT_CHUNK_SIZE);
+
+    const int num_pmts = m_store.GetNPMTs();
+    // first PMT of the first group of each thread, threads without a group get an empty range
+    std::vector<int> part_begin(nthreads + 1, num_pmts);
+    for(int g = m_acc_ngroups - 1; g >= 0; --g)
     {
-        const double weight = reset_weights ? e.GetEvWghtMC() : e.GetEvWght();
-        const int reco_bin  = e.GetSampleBin();
-        m_hpred->Fill(reco_bin + 0.5, weight); // direct PE prediction
+        const long first_chunk = (long)m_acc_nchunks * g / m_acc_ngroups;
+        part_begin[GetGroupOwner(g, nthreads)] = std::min(first_chunk * m_acc_chunk, (long)num_pmts);
+    }
+    for(int t = nthreads - 1; t >= 0; --t)
+        part_begin[t] = std::min(part_begin[t], part_begin[t + 1]);
+    part_begin[0] = 0;
+    m_store.Distribute(part_begin);
+}
 
-        if (m_scatter||m_scatter_map)
-        {
-            m_hpred->Fill(reco_bin + 0.5, e.GetPEIndirect()); // indirect PE prediction
-            m_hpred_err2->Fill(reco_bin + 0.5, e.GetPEIndirectErr()); // MC stat error of indirect PE prediction
-        }
+void AnaSample::AccumulateGroup(const int g, const ChunkReweight* reweight, const pmt_real* wght)
+{
+    const bool scatter = m_scatter || m_scatter_map;
+    if (scatter && m_template)
+        AccumulateGroupImpl<true, true>(g, reweight, wght);
+    else if (scatter)
+        AccumulateGroupImpl<true, false>(g, reweight, wght);
+    else if (m_template)
+        AccumulateGroupImpl<false, true>(g, reweight, wght);
+    else
+        AccumulateGroupImpl<false, false>(g, reweight, wght);
+}
 
-        if (m_template)
+template <bool Scatter, bool Template>
+void AnaSample::AccumulateGroupImpl(const int g, const ChunkReweight* reweight, const pmt_real* wght)
+{
+    const int num_pmts = m_store.GetNPMTs();
+    const int chunk_size = m_acc_chunk;
+    const int ny = Template ? m_htimetof_pred->GetNbinsY() : 0;
+    const int off_err2 = m_nbins;
+    const int off_ind = 2*m_nbins;
+    const int off_tpred = m_acc_off_tpred;
+    const int off_tw2 = off_tpred + (Template ? m_tpred.size() : 0);
+
+    const int* bins = m_store.GetSampleBin();
+    const pmt_real* pe_indirect = m_store.GetPEIndirect();
+    const pmt_real* pe_indirect_err = m_store.GetPEIndirectErr();
+    const double* tpred_pmt = m_store.GetTemplatePred();
+    const double* tsig2_pmt = m_store.GetTemplateNomSig2();
+
+    // accumulators of group g for every point of the batch
+    const std::size_t point_stride = (std::size_t)m_acc_ngroups * m_acc_buf_size;
+    for(int p = 0; p < m_acc_npoints; ++p)
+        std::fill(m_group_buf.data() + p * point_stride + g * m_acc_buf_size,
+                  m_group_buf.data() + p * point_stride + (g + 1) * m_acc_buf_size, 0.0);
+
+    // the columns of a chunk stay in cache while it is reweighted and summed for all points
+    const int chunk_begin = (long)m_acc_nchunks * g / m_acc_ngroups;
+    const int chunk_end = (long)m_acc_nchunks * (g + 1) / m_acc_ngroups;
+    for(int c = chunk_begin; c < chunk_end; ++c)
+    {
+        const int begin = c * chunk_size;
+        const int end = std::min(begin + chunk_size, num_pmts);
+        for(int p = 0; p < m_acc_npoints; ++p)
         {
-            std::vector<double> timetof_pred = e.GetTimetofPred();
-            std::vector<double> timetof_nom_sig2 = e.GetTimetofNomSig2();
-            for (int i=1;i<=m_htimetof_pred->GetNbinsY();i++)
+            if (reweight != nullptr)
+                (*reweight)(p, begin, end);
+
+            double* buf = m_group_buf.data() + p * point_stride + g * m_acc_buf_size;
+            // segmented sum over runs of PMTs in the same bin, one write per run
+            int cur_bin = bins[begin];
+            double sum = 0.0;
+            double sum_err2 = 0.0;
+            double sum_ind = 0.0;
+            for(int k = begin; k < end; ++k)
             {
-                if (!m_template_combine) 
+                const int b = bins[k];
+                if (b != cur_bin)
+                {
+                    if (cur_bin >= 0)
+                    {
+                        buf[cur_bin] += sum;
+                        if (Scatter)
+                        {
+                            buf[off_err2+cur_bin] += sum_err2;
+                            buf[off_ind+cur_bin] += sum_ind;
+                        }
+                    }
+                    cur_bin = b;
+                    sum = 0.0;
+                    sum_err2 = 0.0;
+                    sum_ind = 0.0;
+                }
+                sum += wght[k];
+                if (Scatter)
                 {
-                    m_htimetof_pred->Fill(reco_bin + 0.5,i-0.5,timetof_pred[i-1]);
-                    m_htimetof_pred_w2->Fill(reco_bin + 0.5,i-0.5,timetof_nom_sig2[i-1]*timetof_pred[i-1]*timetof_pred[i-1]);
+                    sum_ind += pe_indirect[k];
+                    sum_err2 += pe_indirect_err[k];
                 }
-                else
+
+                if (Template)
+                {
+                    const int x = m_template_combine ? 0 : b;
+                    if (x < 0) continue;
+                    const double* timetof_pred = tpred_pmt + k*ny;
+                    const double* timetof_nom_sig2 = tsig2_pmt + k*ny;
+                    double* tpred = buf + off_tpred + x*ny;
+                    double* tw2 = buf + off_tw2 + x*ny;
+                    for (int i=0;i<ny;i++)
+                    {
+                        tpred[i] += timetof_pred[i];
+                        tw2[i] += timetof_nom_sig2[i]*timetof_pred[i]*timetof_pred[i];
+                    }
+                }
+            }
+            if (cur_bin >= 0)
+            {
+                buf[cur_bin] += sum;
+                if (Scatter)
                 {
-                    m_htimetof_pred->Fill(0.5,i-0.5,timetof_pred[i-1]);
-                    m_htimetof_pred_w2->Fill(0.5,i-0.5,timetof_nom_sig2[i-1]*timetof_pred[i-1]*timetof_pred[i-1]);
+                    buf[off_err2+cur_bin] += sum_err2;
+                    buf[off_ind+cur_bin] += sum_ind;
                 }
             }
         }
     }
+}
 
-    return;
+void AnaSample::ReduceGroups(const int point)
+{
+    const bool scatter = m_scatter || m_scatter_map;
+    const int nbins = m_nbins;
+    const int ngroups = m_acc_ngroups;
+    const std::size_t stride = m_acc_buf_size;
+    const double* group_buf = m_group_buf.data() + point * ngroups * stride;
+
+#pragma omp for schedule(static)
+    for(int b = 0; b < nbins; ++b)
+    {
+        m_pred_direct[b] = PairwiseSum(group_buf + b, ngroups, stride);
+        m_pred_err2[b] = scatter ? PairwiseSum(group_buf + nbins + b, ngroups, stride) : 0.0;
+        m_pred_indirect[b] = scatter ? PairwiseSum(group_buf + 2*nbins + b, ngroups, stride) : 0.0;
+    }
+
+    if (m_template)
+    {
+        const int ntbins = m_tpred.size();
+        const double* tpred = group_buf + m_acc_off_tpred;
+        const double* tw2 = tpred + ntbins;
+#pragma omp for schedule(static)
+        for(int b = 0; b < ntbins; ++b)
+        {
+            m_tpred[b] = PairwiseSum(tpred + b, ngroups, stride);
+            m_tpred_w2[b] = PairwiseSum(tw2 + b, ngroups, stride);
+        }
+    }
+}
+
+void AnaSample::LLHBlocks(const double* bin_factor, const double* bin_direct, const bool template_llh, const int lane)
+{
+    const int nbins = m_nbins;
+    const double* direct = bin_direct != nullptr ? bin_direct : m_pred_direct.data();
+    const double* indirect = lane >= 0 && !m_lanes[lane].pred_indirect.empty() ? m_lanes[lane].pred_indirect.data() : m_pred_indirect.data();
+    const double* err2 = lane >= 0 && !m_lanes[lane].pred_err2.empty() ? m_lanes[lane].pred_err2.data() : m_pred_err2.data();
+    const LLHDataCache& data_llh = lane >= 0 ? m_lanes[lane].data_llh : m_data_llh;
+    if (bin_factor != nullptr)
+    {
+#pragma omp for schedule(static)
+        for(int b = 0; b < nbins; ++b)
+            m_pred[b] = bin_factor[b] * direct[b] + indirect[b];
+    }
+    else
+    {
+#pragma omp for schedule(static)
+        for(int b = 0; b < nbins; ++b)
+            m_pred[b] = direct[b] + indirect[b];
+    }
+
+    // batch likelihood over fixed blocks of bins, after the barrier all bins are combined
+    const int nblocks = CalcLLHFunc::NumBlocks(data_llh);
+#pragma omp for schedule(static)
+    for(int n = 0; n < nblocks; ++n)
+        m_llh_part[n] = m_llh->Block(m_pred.data(), err2, data_llh, n);
+
+    // the template likelihood does not depend on the per-bin factors
+    if (template_llh && m_template)
+    {
+        const LLHDataCache& tdata_llh = lane >= 0 ? m_lanes[lane].tdata_llh : m_tdata_llh;
+        const int ntblocks = CalcLLHFunc::NumBlocks(tdata_llh);
+#pragma omp for schedule(static)
+        for(int n = 0; n < ntblocks; ++n)
+            m_tllh_part[n] = m_llh->Block(m_tpred.data(), m_tpred_w2.data(), tdata_llh, n);
+    }
+}
+
+double AnaSample::FinishLLH(const bool template_llh, const int lane)
+{
+    // The ROOT histograms are not touched in the fit loop, they are synced before writing
+    m_hist_stale = true;
+
+    const LLHDataCache& data_llh = lane >= 0 ? m_lanes[lane].data_llh : m_data_llh;
+    double chi2 = PairwiseSum(m_llh_part.data(), CalcLLHFunc::NumBlocks(data_llh));
+
+    if (m_template)
+    {
+        if (template_llh)
+        {
+            const LLHDataCache& tdata_llh = lane >= 0 ? m_lanes[lane].tdata_llh : m_tdata_llh;
+            m_chi2_template = PairwiseSum(m_tllh_part.data(), CalcLLHFunc::NumBlocks(tdata_llh));
+        }
+        if (m_template_only) chi2 = 0.0;
+        chi2 += m_chi2_template;
+    }
+
+    return chi2;
+}
+
+void AnaSample::SyncEventHist()
+{
+    // copy the flat bin arrays into the ROOT histograms for output
+    m_hpred->Reset();
+    m_hpred_err2->Reset();
+    for(int b = 0; b < m_nbins; ++b)
+    {
+        m_hpred->SetBinContent(b+1, m_pred[b]);
+        m_hpred_err2->SetBinContent(b+1, m_pred_err2[b]);
+    }
+
+    if (m_template)
+    {
+        m_htimetof_pred->Reset();
+        m_htimetof_pred_w2->Reset();
+        const int nx = m_htimetof_pred->GetNbinsX();
+        const int ny = m_htimetof_pred->GetNbinsY();
+        for(int x = 0; x < nx; ++x)
+        {
+            for(int y = 0; y < ny; ++y)
+            {
+                m_htimetof_pred->SetBinContent(x+1, y+1, m_tpred[x*ny+y]);
+                m_htimetof_pred_w2->SetBinContent(x+1, y+1, m_tpred_w2[x*ny+y]);
+            }
+        }
+    }
+
+    m_hist_stale = false;
 }
 
 void AnaSample::FillDataHist(bool stat_fluc)
@@ -403,10 +910,12 @@ void AnaSample::FillDataHist(bool stat_fluc)
     if(stat_fluc) 
         std::cout << TAG << "Applying statistical fluctuations..." << std::endl;
 
-    for(auto& e : m_pmts)
+    for(int k = 0; k < m_pmts.size(); ++k)
     {
+        AnaEvent& e = m_pmts[k];
         const int pmtID = e.GetPMTID();
-        double weight = m_hdata_pmt->GetBinContent(pmtID+1)*m_norm;
+        const double data_weight = m_data_weight.empty() ? 1. : m_data_weight[pmtID];
+        double weight = m_hdata_pmt->GetBinContent(pmtID+1)*m_norm*data_weight;
 
         if (stat_fluc)
         {
@@ -432,7 +941,7 @@ void AnaSample::FillDataHist(bool stat_fluc)
 
             if (m_hdata_pmt_control->GetBinContent(pmtID+1)>0)
             {
-                weight_control = m_hdata_pmt_control->GetBinContent(pmtID+1)*m_norm;
+                weight_control = m_hdata_pmt_control->GetBinContent(pmtID+1)*m_norm*data_weight;
                 if (stat_fluc)
                 {
                     weight_control = gRandom->Poisson(weight_control);
@@ -459,6 +968,7 @@ void AnaSample::FillDataHist(bool stat_fluc)
 
                 e.SetPEIndirect(indirect_pred);
                 e.SetPEIndirectErr(indirect_err2);
+                m_store.SetPEIndirect(k, indirect_pred, indirect_err2);
             }
 
             m_hdata_control->Fill(reco_bin + 0.5, weight_control);
@@ -470,19 +980,66 @@ void AnaSample::FillDataHist(bool stat_fluc)
             {
                 if (!m_template_combine) 
                 {
-                    m_htimetof_data->Fill(reco_bin + 0.5,i-0.5,m_htimetof_pmt_data->GetBinContent(pmtID+1,i));
+                    m_htimetof_data->Fill(reco_bin + 0.5,i-0.5,m_htimetof_pmt_data->GetBinContent(pmtID+1,i)*data_weight);
                 }
                 else
                 {
-                    m_htimetof_data->Fill(0.5,i-0.5,m_htimetof_pmt_data->GetBinContent(pmtID+1,i));
+                    m_htimetof_data->Fill(0.5,i-0.5,m_htimetof_pmt_data->GetBinContent(pmtID+1,i)*data_weight);
                 }
             }
         }
     }
 
+    for(int b = 0; b < m_nbins; ++b)
+        m_data[b] = m_hdata->GetBinContent(b+1);
+    m_data_llh.Build(m_data.data(), m_nbins);
+    m_llh_part.resize(std::max<std::size_t>(m_llh_part.size(), CalcLLHFunc::NumBlocks(m_data_llh)));
+
+    if (m_template)
+    {
+        const int nx = m_htimetof_data->GetNbinsX();
+        const int ny = m_htimetof_data->GetNbinsY();
+        for(int x = 0; x < nx; ++x)
+            for(int y = 0; y < ny; ++y)
+                m_tdata[x*ny+y] = m_htimetof_data->GetBinContent(x+1, y+1);
+        m_tdata_llh.Build(m_tdata.data(), m_tdata.size());
+        m_tllh_part.resize(std::max<std::size_t>(m_tllh_part.size(), CalcLLHFunc::NumBlocks(m_tdata_llh)));
+    }
+
     return;
 }
 
+void AnaSample::SaveLaneData(const int lane)
+{
+    if (lane >= m_lanes.size())
+        m_lanes.resize(lane + 1);
+    LaneData& ld = m_lanes[lane];
+    ld.data_llh = m_data_llh;
+    if (m_template)
+        ld.tdata_llh = m_tdata_llh;
+
+    // the indirect PE of every PMT is set from the data control region, keep its bin sums
+    if (m_scatter || m_scatter_map)
+    {
+        BeginAccumulate(PMT_CHUNK_SIZE);
+        for(int g = 0; g < m_acc_ngroups; ++g)
+            AccumulateGroup(g, nullptr, m_store.GetWeight());
+        ReduceGroups();
+        ld.pred_indirect = m_pred_indirect;
+        ld.pred_err2 = m_pred_err2;
+    }
+    else
+    {
+        ld.pred_indirect.clear();
+        ld.pred_err2.clear();
+    }
+}
+
+void AnaSample::ClearLaneData()
+{
+    m_lanes.clear();
+}
+
 void AnaSample::SetLLHFunction(const std::string& func_name)
 {
     if(m_llh != nullptr)
@@ -513,30 +1070,17 @@ void AnaSample::SetLLHFunction(const std::string& func_name)
         std::cout << TAG << "Likelihood function not defined. Setting to Poisson by default." << std::endl;
         m_llh = new PoissonLLH;
     }
+    m_llh->SetFastMath(m_fast_math);
 }
 
 double AnaSample::CalcLLH() const
 {
-    const unsigned int nbins = m_hpred->GetNbinsX();
-    double* exp_w  = m_hpred->GetArray();
-    //double* exp_w2 = m_hpred->GetSumw2()->GetArray();
-    double* exp_w2 = m_hpred_err2->GetArray();
-    double* data   = m_hdata->GetArray();
-
-    double chi2 = 0.0;
-    for(unsigned int i = 1; i <= nbins; ++i)
-        chi2 += (*m_llh)(exp_w[i], exp_w2[i], data[i]);
+    double chi2 = m_llh->Batch(m_pred.data(), m_pred_err2.data(), m_data_llh);
 
     if (m_template)
     {
         if (m_template_only) chi2 = 0.0;
-        for(unsigned int i=1;i<=m_htimetof_pred->GetNbinsX();i++)
-        {
-            for (int j=1;j<=m_htimetof_pred->GetNbinsY();j++)
-            {
-                chi2 += (*m_llh)(m_htimetof_pred->GetBinContent(i,j), m_htimetof_pred_w2->GetBinContent(i,j), m_htimetof_data->GetBinContent(i,j));
-            }
-        }
+        chi2 += m_llh->Batch(m_tpred.data(), m_tpred_w2.data(), m_tdata_llh);
     }
 
     return chi2;
@@ -544,6 +1088,9 @@ double AnaSample::CalcLLH() const
 
 void AnaSample::WriteEventHist(TDirectory* dirout, const std::string& bsname)
 {
+    if (m_hist_stale)
+        SyncEventHist();
+
     dirout->cd();
     if(m_hpred != nullptr)
         m_hpred->Write(Form("evhist_sam%d_pred%s", m_sample_id, bsname.c_str()));
@@ -619,12 +1166,14 @@ void AnaSample::SetPMTEff(const TH1D& hist)
 
 void AnaSample::InitToy()
 {
-    for(auto& e : m_pmts)
+    for(int k = 0; k < m_pmts.size(); ++k)
     {
+        AnaEvent& e = m_pmts[k];
         double eff = 1.0;
         if (m_use_eff) eff = m_pmt_eff->GetBinContent(e.GetPMTID()+1);
         if (m_eff_var) eff *= gRandom->Gaus(1,m_eff_sig);
         e.SetEff(eff);
+        m_store.SetEff(k, eff);
     }
 
     if ( m_time_offset || m_time_smear ) 
@@ -657,6 +1206,13 @@ void AnaSample::InitToy()
         if (m_template) m_htimetof_pmt_data->Reset();
         m_hdata_pmt->Reset();
         m_hdata_pmt_control->Reset();
+        if (m_group_vel)
+        {
+            std::fill(m_fine_pe.begin(), m_fine_pe.end(), 0.);
+            std::fill(m_fine_pe_all.begin(), m_fine_pe_all.end(), 0.);
+            std::fill(m_fine_below.begin(), m_fine_below.end(), 0.);
+            std::fill(m_fine_above.begin(), m_fine_above.end(), 0.);
+        }
         for (unsigned long i=0;i<nDataEntries;i++)
         {
             if (!selTree->GetDataEntry(i,timetof,nPE,pmtID)) continue;
@@ -664,6 +1220,12 @@ void AnaSample::InitToy()
             if (m_time_offset) timetof += timetof_shift[pmtID];
             if (m_time_smear) timetof += gRandom->Gaus(0,time_resolution[pmtID]);
 
+            if (m_group_vel)
+            {
+                FillFineTime(pmtID,timetof,nPE);
+                continue;
+            }
+
             bool skip = false;
 
             for (int j=0;j<m_cutvar.size();j++) {
@@ -696,5 +1258,7 @@ void AnaSample::InitToy()
             }
             else m_hdata_pmt->Fill(pmtID+0.5, nPE);
         }
+
+        if (m_group_vel) SetGroupVelocity(m_vg);
     }
 }
\ No newline at end of file
@@ -4,12 +4,18 @@
 #include <algorithm>
 #include <cmath>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <sstream>
 #include <string>
 #include <vector>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include <TDirectory.h>
 #include <TH1D.h>
 #include <TH2D.h>
@@ -20,10 +26,22 @@
 
 #include "AnaEvent.hh"
 #include "AnaTree.hh"
+#include "PMTStore.hh"
 #include "BinManager.hh"
 #include "Likelihoods.hh"
+#include "PairwiseSum.hh"
 #include "ColorOutput.hh"
 
+// Number of PMTs reweighted together by one thread, sized to keep the columns in cache.
+// Also the unit of the deterministic PMT sums, so it must not depend on the number of threads.
+const int PMT_CHUNK_SIZE = 1024;
+
+// Width (ns) of the per-PMT timetof histograms kept for the group velocity shift, see AnaSample::SetGroupVelocity
+const double FINE_TIME_WIDTH = 0.05;
+
+// Reweights PMTs [begin, end) of a sample for parameter point `point` of a batch
+typedef std::function<void(int point, int begin, int end)> ChunkReweight;
+
 class AnaSample
 {
 public:
@@ -37,6 +55,7 @@ public:
     inline void AddPMT(const AnaEvent& pmt_entry) { m_pmts.push_back(pmt_entry); }
 
     AnaEvent* GetPMT(const unsigned int evnum);
+    inline PMTStore* GetPMTStore() { return &m_store; }
 
     void LoadEventsFromFile(const std::string& file_name, const std::string& tree_name, const std::string& pmt_tree_name);
 
@@ -48,13 +67,41 @@ public:
     double CalcLLH() const;
 
     void FillEventHist(bool reset_weights = false);
+    // Fused reweight, binning and LLH pass, split in phases so that the Fitter can schedule the PMT groups
+    // of all samples in one parallel region.
+    // BeginAccumulate is called outside of the parallel region. Each group is accumulated by one thread,
+    // then ReduceGroups and LLHBlocks are called by all threads, they contain orphaned omp for loops.
+    // FinishLLH returns the chi2, outside of the parallel region or in an omp single.
+    // With npoints > 1 every chunk is reweighted and summed for each point of a parameter batch,
+    // ReduceGroups(p), LLHBlocks and FinishLLH are then repeated for each point p.
+    void BeginAccumulate(const int chunk_size, const int npoints = 1);
+    inline int GetNumGroups() const { return m_acc_ngroups; }
+    // Thread of an nthreads team that owns group g when the threads are pinned, contiguous groups per thread
+    inline int GetGroupOwner(const int g, const int nthreads) const { return (long)g * nthreads / m_acc_ngroups; }
+    // First touch the PMT columns of the groups owned by each thread, see PMTStore::Distribute
+    void DistributePMTs(const int nthreads);
+    void AccumulateGroup(const int g, const ChunkReweight* reweight, const pmt_real* wght);
+    void ReduceGroups(const int point = 0);
+    // lane >= 0 evaluates against the data saved with SaveLaneData instead of the current data
+    // bin_factor, if given, scales the direct PE of each sample bin after the PMT sums.
+    // bin_direct, if given, replaces the summed direct PE of each sample bin.
+    void LLHBlocks(const double* bin_factor, const double* bin_direct, const bool template_llh, const int lane = -1);
+    double FinishLLH(const bool template_llh, const int lane = -1);
     void FillDataHist(bool stat_fluc = false);
 
+    // Data of the toys fitted in lockstep, see Fitter::FitToyLanes.
+    // SaveLaneData keeps the current data (after InitToy and FillDataHist) as the data of a lane.
+    // Toys may only change the data: with thrown PMT efficiencies the predictions differ between lanes.
+    void SaveLaneData(const int lane);
+    void ClearLaneData();
+    inline bool ToyChangesPMTs() const { return m_eff_var; }
+
     void WriteEventHist(TDirectory* dirout, const std::string& bsname);
     void WriteDataHist(TDirectory* dirout, const std::string& bsname);
 
     inline double GetNorm() const { return m_norm; }
     inline int GetSampleID() const { return m_sample_id; }
+    inline int GetNBins() const { return m_nbins; }
     inline std::string GetName() const { return m_name; }
     inline int GetPMTType() const { return m_pmttype; }
 
@@ -92,6 +139,36 @@ public:
 
     inline void SetZ0(double val) { m_z0 = val; }
 
+    // timetof = time - R/vg is fixed by the group velocity vg_ref of the conversion (read from the file if vg_ref <= 0).
+    // With this option the hits are kept in fine per-PMT timetof histograms, so that the timetof cuts, scattering
+    // windows and template data can be rebuilt for any vg in [vg_min, vg_max] (m/ns) by shifting each PMT by R/vg_ref - R/vg.
+    inline void UseGroupVelocity(double vg, double vg_min, double vg_max, double vg_ref = -1)
+    {
+        m_group_vel = true; m_vg = vg; m_vg_min = vg_min; m_vg_max = vg_max; m_vg_ref = vg_ref;
+    }
+    // Rebuilds the per-PMT data histograms for group velocity vg, FillDataHist has to be called afterwards.
+    // Returns false if the sample does not use the group velocity option.
+    bool SetGroupVelocity(double vg);
+    inline bool UsesGroupVelocity() const { return m_group_vel; }
+    inline double GetGroupVelocity() const { return m_vg; }
+
+    // Per-PMT data weights applied at fit time instead of WCSIM_TreeConvert -w/-z, so the converted files stay profile-agnostic.
+    // SetDataLEDWeight: LEDProfile::GetLEDWeight(cosths, phis), with the spectra of fname if given.
+    // SetDataAttenuationZWeight: AttenuationZWeight::GetAttenuationZWeight(R, dz) with the source at z0.
+    inline void SetDataLEDWeight(const std::string& fname = "", const std::string& power = "", const std::string& variation = "")
+    {
+        m_data_led = true; m_data_led_file = fname; m_data_led_power = power; m_data_led_variation = variation;
+    }
+    inline void SetDataAttenuationZWeight(double slope, double wavelength, double abwff, double rayff)
+    {
+        m_data_attz = true; m_data_attz_slope = slope; m_data_attz_wl = wavelength; m_data_attz_abwff = abwff; m_data_attz_rayff = rayff;
+    }
+
+    inline void SetSortByBin(bool flag) { m_sort_by_bin = flag; }
+
+    // Approximate log/lgamma in the likelihood, see FastMath.hh
+    inline void SetFastMath(bool flag) { m_fast_math = flag; m_llh->SetFastMath(flag); }
+
     void InitToy();
 
 protected:
@@ -122,6 +199,30 @@ protected:
 
     double m_z0;
 
+    // source position and frame of the input, for the fit-time geometry parameters
+    bool m_has_source;
+    SourceFrame m_source;
+
+    // fine timetof histograms of the group velocity option, timetof at the conversion group velocity
+    bool m_group_vel;
+    double m_vg, m_vg_min, m_vg_max, m_vg_ref;
+    std::vector<double> m_fine_R;      // R of each PMT ID
+    std::vector<double> m_fine_start;  // low edge of the first fine bin of each PMT ID
+    std::vector<long> m_fine_offset;   // fine bins of PMT ID p are [m_fine_offset[p], m_fine_offset[p+1])
+    std::vector<double> m_fine_pe;     // nPE passing the nPE cuts
+    std::vector<double> m_fine_pe_all; // all nPE for the template data, only filled with an nPE cut
+    std::vector<double> m_fine_below;  // nPE passing the nPE cuts below the fine bins of each PMT ID
+    std::vector<double> m_fine_above;  // nPE passing the nPE cuts above the fine bins of each PMT ID
+    bool m_fine_window;                // a timetof cut or a scattering window bounds the direct PE, at least on one side
+    double m_fine_direct[2], m_fine_control[2];
+
+    // fit-time data weights
+    bool m_data_led;
+    std::string m_data_led_file, m_data_led_power, m_data_led_variation;
+    bool m_data_attz;
+    double m_data_attz_slope, m_data_attz_wl, m_data_attz_abwff, m_data_attz_rayff;
+    std::vector<double> m_data_weight; // weight of each PMT ID, empty if none
+
     bool m_use_eff;
     bool m_eff_var;
     double m_eff_sig;
@@ -137,6 +238,7 @@ protected:
     std::string m_name;
     std::string m_binning;
     std::vector<AnaEvent> m_pmts;  // Geometry info etc. for each PMT
+    PMTStore m_store;              // Columnar copy of m_pmts for the likelihood loop
 
     BinManager m_bm;
     CalcLLHFunc* m_llh;
@@ -159,6 +261,46 @@ protected:
     bool m_template, m_template_combine, m_template_only;
     double m_timetof_offset;
 
+    // Flat copies of the fit histograms used in the likelihood, bin b at index b.
+    // Template arrays are indexed as x*ny+y. The ROOT histograms are only synced for output.
+    std::vector<double> m_pred;
+    std::vector<double> m_pred_direct;   // direct PE summed over PMTs, before the per-bin factors
+    std::vector<double> m_pred_indirect; // indirect PE summed over PMTs
+    std::vector<double> m_pred_err2;
+    std::vector<double> m_data;
+    std::vector<double> m_tpred;
+    std::vector<double> m_tpred_w2;
+    std::vector<double> m_tdata;
+    LLHDataCache m_data_llh;  // data-only likelihood terms of m_data
+    LLHDataCache m_tdata_llh; // data-only likelihood terms of m_tdata
+    // Per-lane copy of the data terms, and of the indirect PE sums that come from the data control region
+    struct LaneData
+    {
+        LLHDataCache data_llh;
+        LLHDataCache tdata_llh;
+        std::vector<double> pred_indirect;
+        std::vector<double> pred_err2;
+    };
+    std::vector<LaneData> m_lanes;
+    std::vector<double> m_group_buf; // bin accumulators of the reduction groups of the fused pass
+    std::vector<double> m_llh_part;  // likelihood of each block of bins
+    std::vector<double> m_tllh_part; // likelihood of each block of template bins
+    int m_acc_chunk, m_acc_nchunks, m_acc_ngroups, m_acc_npoints, m_acc_off_tpred;
+    std::size_t m_acc_buf_size;
+    double m_chi2_template; // template likelihood of the last fused pass
+    bool m_hist_stale;
+    bool m_sort_by_bin;
+    bool m_fast_math;
+
+    // Sums the chunks of group g into its accumulators, calling reweight (if not null) on each chunk first
+    template <bool Scatter, bool Template>
+    void AccumulateGroupImpl(const int g, const ChunkReweight* reweight, const pmt_real* wght);
+    void ResizeFlatHist();
+    void InitFineTime(const int nPMTs);
+    void FillFineTime(const int pmtID, const double timetof, const double nPE);
+    void InitDataWeight(const int nPMTs);
+    void SyncEventHist();
+
     const std::string TAG = color::GREEN_STR + "[AnaSample]: " + color::RESET_STR;
     const std::string ERR = color::RED_STR + "[AnaSample ERROR]: " + color::RESET_STR;
     const std::string WAR = color::RED_STR + "[AnaSample WARNING]: " + color::RESET_STR;
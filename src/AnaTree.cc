@@ -17,6 +17,7 @@ AnaTree::AnaTree(const std::string& file_name, const std::string& tree_name, con
 
     m_maskpmt = false;
     m_maskmpmt = false;
+    m_raw_geom = false;
 
 }
 
@@ -137,6 +138,19 @@ void AnaTree::SetPMTBranches()
     t_pmt->SetBranchAddress("dz", &dz);
     t_pmt->SetBranchAddress("PMT_id", &PMT_id);
     t_pmt->SetBranchAddress("mPMT_id", &mPMT_id);
+
+    // raw geometry for the fit-time geometry parameters
+    m_raw_geom = t_pmt->GetBranch("PMTx") != nullptr && t_pmt->GetBranch("radius") != nullptr;
+    if (m_raw_geom)
+    {
+        t_pmt->SetBranchAddress("PMTx", &pmtpos[0]);
+        t_pmt->SetBranchAddress("PMTy", &pmtpos[1]);
+        t_pmt->SetBranchAddress("PMTz", &pmtpos[2]);
+        t_pmt->SetBranchAddress("PMTdirx", &pmtdir[0]);
+        t_pmt->SetBranchAddress("PMTdiry", &pmtdir[1]);
+        t_pmt->SetBranchAddress("PMTdirz", &pmtdir[2]);
+        t_pmt->SetBranchAddress("radius", &pmtradius);
+    }
     
 }
 
@@ -184,6 +198,12 @@ std::vector<AnaEvent> AnaTree::GetPMTs()
         ev.SetDz(dz); 
         ev.SetPMTID(PMT_id);
         ev.SetmPMTID(mPMT_id);
+        if (m_raw_geom)
+        {
+            ev.SetPMTPosition(pmtpos[0], pmtpos[1], pmtpos[2]);
+            ev.SetPMTOrientation(pmtdir[0], pmtdir[1], pmtdir[2]);
+            ev.SetPMTRadius(pmtradius);
+        }
         
         std::vector<double> reco_var;
         reco_var.emplace_back(costh); reco_var.emplace_back(R);
@@ -196,6 +216,32 @@ std::vector<AnaEvent> AnaTree::GetPMTs()
     return pmt_vec;
 }
 
+double AnaTree::GetGroupVelocity() const
+{
+    TParameter<double>* vg = (TParameter<double>*)f_pmt->Get("group_velocity");
+    if(vg == nullptr)
+        return -1;
+    return vg->GetVal();
+}
+
+bool AnaTree::GetSourceFrame(SourceFrame& src) const
+{
+    TVectorD* frame = (TVectorD*)f_pmt->Get("source_frame");
+    if(frame == nullptr || frame->GetNrows() != 12)
+        return false;
+
+    for(int j = 0; j < 3; ++j)
+    {
+        src.pos[j] = (*frame)[j];
+        src.dir[j] = (*frame)[3 + j];
+        src.xaxis[j] = (*frame)[6 + j];
+        src.yaxis[j] = (*frame)[9 + j];
+    }
+    TParameter<int>* exact = (TParameter<int>*)f_pmt->Get("exact_solid_angle");
+    src.exact_omega = exact != nullptr && exact->GetVal() != 0;
+    return true;
+}
+
 bool AnaTree::GetDataEntry(unsigned long entry, double& time, double& charge, int& pmtID)
 {
     fChain->GetEntry(entry);
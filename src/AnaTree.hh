@@ -14,8 +14,11 @@
 #include <TROOT.h>
 #include <TTree.h>
 #include <TLeaf.h>
+#include <TParameter.h>
+#include <TVectorT.h>
 
 #include "AnaEvent.hh"
+#include "PMTStore.hh"
 #include "ColorOutput.hh"
 
 class AnaTree
@@ -45,6 +48,11 @@ private:
     int PMT_id;
     int mPMT_id;
     double weight;
+    // raw PMT geometry, only in files converted with it
+    bool m_raw_geom;
+    double pmtpos[3];
+    double pmtdir[3];
+    double pmtradius;
 
     const std::string TAG = color::GREEN_STR + "[AnaTree]: " + color::RESET_STR;
     const std::string ERR = color::RED_STR + "[AnaTree ERROR]: " + color::RESET_STR;
@@ -64,6 +72,10 @@ public:
     bool GetDataEntry(unsigned long entry, double& time, double& charge, int& pmtID);
     unsigned long GetDataEntries() const { return fChain->GetEntries(); }
     int GetPMTEntries() const { return t_pmt->GetEntries(); }
+    // Group velocity (m/ns) used for timetof in the conversion, -1 if the file does not store it
+    double GetGroupVelocity() const;
+    // Source position and frame used for the PMT geometry, false if the file does not store them
+    bool GetSourceFrame(SourceFrame& src) const;
 
     double GetEventVar(const std::string& var) const
     {
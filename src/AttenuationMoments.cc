@@ -0,0 +1,112 @@
+#include "AttenuationMoments.hh"
+
+AttenuationMoments::AttenuationMoments()
+    : m_nbins(0)
+{
+}
+
+void AttenuationMoments::Clear()
+{
+    m_nbins = 0;
+    m_const.clear();
+    m_cell_bin.clear();
+    m_cell_par.clear();
+    m_cell_R.clear();
+    m_w0.clear();
+    m_w1.clear();
+    m_w2.clear();
+}
+
+double AttenuationMoments::CellWidth(const double tol, const double alpha_min)
+{
+    // solve x^3/6*exp(x) <= tol for x = half width / alpha
+    double x = std::cbrt(6.0 * tol);
+    while(x * x * x / 6.0 * std::exp(x) > tol)
+        x *= 0.9;
+    return 2.0 * alpha_min * x;
+}
+
+void AttenuationMoments::Build(const PMTStore& pmts, const int* parbin, const int nbins, const double width)
+{
+    Clear();
+    m_nbins = nbins;
+    m_const.assign(nbins, 0.0);
+
+    const int num_pmts = pmts.GetNPMTs();
+    const int* bins = pmts.GetSampleBin();
+    const pmt_real* R = pmts.GetR();
+    const pmt_real* omega = pmts.GetOmega();
+    const pmt_real* eff = pmts.GetEff();
+    const pmt_real* wghtMC = pmts.GetWeightMC();
+
+    // cells ordered by sample bin, parameter bin and R
+    std::map<std::tuple<int, int, long>, int> cell_index;
+    for(int k = 0; k < num_pmts; ++k)
+    {
+        const int b = bins[k];
+        if(b < 0)
+            continue;
+        if(parbin[k] < 0)
+        {
+            m_const[b] += wghtMC[k];
+            continue;
+        }
+
+        const long cell = std::floor(R[k] / width);
+        auto it = cell_index.find(std::make_tuple(b, parbin[k], cell));
+        int c;
+        if(it == cell_index.end())
+        {
+            c = m_cell_R.size();
+            cell_index[std::make_tuple(b, parbin[k], cell)] = c;
+            m_cell_bin.push_back(b);
+            m_cell_par.push_back(parbin[k]);
+            m_cell_R.push_back((cell + 0.5) * width);
+            m_w0.push_back(0.0);
+            m_w1.push_back(0.0);
+            m_w2.push_back(0.0);
+        }
+        else
+            c = it->second;
+
+        const double w = (double)wghtMC[k] * omega[k] * eff[k];
+        const double d = R[k] - m_cell_R[c];
+        m_w0[c] += w;
+        m_w1[c] += w * d;
+        m_w2[c] += w * d * d;
+    }
+}
+
+void AttenuationMoments::Eval(const double* par, double* direct) const
+{
+    std::copy(m_const.begin(), m_const.end(), direct);
+
+    const int ncells = m_cell_R.size();
+    for(int c = 0; c < ncells; ++c)
+    {
+        const double inv = 1.0 / par[m_cell_par[c]];
+        direct[m_cell_bin[c]] += std::exp(-m_cell_R[c] * inv) * (m_w0[c] - inv * (m_w1[c] - 0.5 * inv * m_w2[c]));
+    }
+}
+
+void AttenuationMoments::EvalExact(const PMTStore& pmts, const int* parbin, const int nbins, const double* par, double* direct)
+{
+    std::fill(direct, direct + nbins, 0.0);
+
+    const int num_pmts = pmts.GetNPMTs();
+    const int* bins = pmts.GetSampleBin();
+    const pmt_real* R = pmts.GetR();
+    const pmt_real* omega = pmts.GetOmega();
+    const pmt_real* eff = pmts.GetEff();
+    const pmt_real* wghtMC = pmts.GetWeightMC();
+    for(int k = 0; k < num_pmts; ++k)
+    {
+        const int b = bins[k];
+        if(b < 0)
+            continue;
+        if(parbin[k] < 0)
+            direct[b] += wghtMC[k];
+        else
+            direct[b] += (double)wghtMC[k] * std::exp(-R[k] / par[parbin[k]]) * omega[k] * eff[k];
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef __AttenuationMoments_hh__
+#define __AttenuationMoments_hh__
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "PMTStore.hh"
+#include "ColorOutput.hh"
+
+// Compressed form of the attenuation sum of every sample bin,
+//   direct[b] = sum_k wghtMC*omega*eff*exp(-R/alpha[parbin]) over PMTs k in bin b.
+// PMTs of the same sample bin and parameter bin are grouped into R cells of a fixed width.
+// Each cell keeps the zeroth to second moments of R-Rc around its center Rc, so that
+//   sum_k w*exp(-R/alpha) ~ exp(-Rc/alpha) * (W0 - W1/alpha + W2/(2*alpha^2)),
+// with a relative error below (d/alpha)^3/6*exp(d/alpha) for d the half cell width.
+class AttenuationMoments
+{
+public:
+    AttenuationMoments();
+
+    void Build(const PMTStore& pmts, const int* parbin, const int nbins, const double width);
+    void Clear();
+
+    // Compressed and exact sums into direct[0,nbins)
+    void Eval(const double* par, double* direct) const;
+    static void EvalExact(const PMTStore& pmts, const int* parbin, const int nbins, const double* par, double* direct);
+
+    // Cell width that keeps the relative error below tol for any alpha >= alpha_min
+    static double CellWidth(const double tol, const double alpha_min);
+
+    inline bool IsEmpty() const { return m_nbins == 0; }
+    inline int GetNCells() const { return m_cell_R.size(); }
+
+private:
+    int m_nbins;
+    std::vector<double> m_const; // PMTs without a parameter bin are not attenuated
+    std::vector<int> m_cell_bin;
+    std::vector<int> m_cell_par;
+    std::vector<double> m_cell_R;
+    std::vector<double> m_w0;
+    std::vector<double> m_w1;
+    std::vector<double> m_w2;
+};
+
+#endif
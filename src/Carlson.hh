@@ -0,0 +1,215 @@
+#ifndef __Carlson_hh__
+#define __Carlson_hh__
+
+#include <cmath>
+
+// Carlson's elliptic integrals RF, RD, RC and RJ, and the solid angle of a disk built on them.
+// Same duplication algorithm as the TOMS577 routines of utils/heuman_lambda.hh, but with a fixed number
+// of duplication steps instead of a convergence test, so the batch loops have no data-dependent branches
+// and vectorize like the reweight kernels.
+// Each step shrinks the spread of the arguments by 4, after CARLSON_STEPS steps the Taylor expansion is
+// exact to double precision: maximum relative difference to TOMS577 (errtol 1e-7) of 7e-16 for RF, RD, RC
+// and 9e-16 for RJ, down to arguments of 1e-14 relative to the largest one (4e-14 with one step less).
+// The solid angle agrees with a numerical integration over the disk to the 2e-6 accuracy of the latter.
+// The batch loops only vectorize when sqrt does not set errno (-fno-math-errno).
+namespace carlson
+{
+    const int CARLSON_STEPS = 9;
+
+    // RF(x,y,z) and RD(x,y,z) share their duplication steps, x,y >= 0 with at most one zero, z > 0
+    inline void RFRD(double x, double y, double z, double& rf, double& rd)
+    {
+        double sum = 0.0;
+        double fac = 1.0;
+        for(int n = 0; n < CARLSON_STEPS; ++n)
+        {
+            const double sx = std::sqrt(x);
+            const double sy = std::sqrt(y);
+            const double sz = std::sqrt(z);
+            const double lambda = sx * (sy + sz) + sy * sz;
+            sum += fac / (sz * (z + lambda));
+            fac *= 0.25;
+            x = 0.25 * (x + lambda);
+            y = 0.25 * (y + lambda);
+            z = 0.25 * (z + lambda);
+        }
+
+        const double af = (x + y + z) * (1.0 / 3.0);
+        const double fx = (af - x) / af;
+        const double fy = (af - y) / af;
+        const double fz = -(fx + fy);
+        const double e2 = fx * fy - fz * fz;
+        const double e3 = fx * fy * fz;
+        rf = (1.0 + (e2 * (1.0 / 24.0) - 0.1 - (3.0 / 44.0) * e3) * e2 + e3 * (1.0 / 14.0)) / std::sqrt(af);
+
+        const double ad = 0.2 * (x + y + 3.0 * z);
+        const double dx = (ad - x) / ad;
+        const double dy = (ad - y) / ad;
+        const double dz = (ad - z) / ad;
+        const double ea = dx * dy;
+        const double eb = dz * dz;
+        const double ec = ea - eb;
+        const double ed = ea - 6.0 * eb;
+        const double ee = ed + ec + ec;
+        const double c3 = 9.0 / 22.0;
+        const double c4 = 3.0 / 26.0;
+        rd = 3.0 * sum
+             + fac * (1.0 + ed * (-3.0 / 14.0 + 0.25 * c3 * ed - 1.5 * c4 * dz * ee)
+                      + dz * (ee / 6.0 + dz * (-c3 * ec + dz * c4 * ea))) / (ad * std::sqrt(ad));
+    }
+
+    inline double RF(const double x, const double y, const double z)
+    {
+        double rf, rd;
+        RFRD(x, y, z, rf, rd);
+        return rf;
+    }
+
+    inline double RD(const double x, const double y, const double z)
+    {
+        double rf, rd;
+        RFRD(x, y, z, rf, rd);
+        return rd;
+    }
+
+    // RC(x,y), x >= 0, y > 0
+    inline double RC(double x, double y)
+    {
+        for(int n = 0; n < CARLSON_STEPS; ++n)
+        {
+            const double lambda = 2.0 * std::sqrt(x) * std::sqrt(y) + y;
+            x = 0.25 * (x + lambda);
+            y = 0.25 * (y + lambda);
+        }
+        const double a = (x + y + y) * (1.0 / 3.0);
+        const double s = (y - a) / a;
+        return (1.0 + s * s * (0.3 + s * (1.0 / 7.0 + s * (0.375 + s * (9.0 / 22.0))))) / std::sqrt(a);
+    }
+
+    // RJ(x,y,z,p), x,y,z >= 0 with at most one zero, p > 0
+    inline double RJ(double x, double y, double z, double p)
+    {
+        double sum = 0.0;
+        double fac = 1.0;
+        for(int n = 0; n < CARLSON_STEPS; ++n)
+        {
+            const double sx = std::sqrt(x);
+            const double sy = std::sqrt(y);
+            const double sz = std::sqrt(z);
+            const double lambda = sx * (sy + sz) + sy * sz;
+            const double alpha = p * (sx + sy + sz) + sx * sy * sz;
+            const double beta = p * (p + lambda) * (p + lambda);
+            sum += fac * RC(alpha * alpha, beta);
+            fac *= 0.25;
+            x = 0.25 * (x + lambda);
+            y = 0.25 * (y + lambda);
+            z = 0.25 * (z + lambda);
+            p = 0.25 * (p + lambda);
+        }
+
+        const double a = 0.2 * (x + y + z + p + p);
+        const double dx = (a - x) / a;
+        const double dy = (a - y) / a;
+        const double dz = (a - z) / a;
+        const double dp = (a - p) / a;
+        const double ea = dx * (dy + dz) + dy * dz;
+        const double eb = dx * dy * dz;
+        const double ec = dp * dp;
+        const double ed = ea - 3.0 * ec;
+        const double ee = eb + 2.0 * dp * (ea - ec);
+        const double c2 = 1.0 / 3.0;
+        const double c3 = 3.0 / 22.0;
+        const double c4 = 3.0 / 26.0;
+        return 3.0 * sum
+               + fac * (1.0 + ed * (-3.0 / 14.0 + 0.75 * c3 * ed - 1.5 * c4 * ee) + eb * (0.5 * c2 + dp * (-2.0 * c3 + dp * c4))
+                        + dp * ea * (c2 - dp * c3) - c2 * dp * ec) / (a * std::sqrt(a));
+    }
+
+    // Batch versions, out[i] = f(x[i], ...) for i in [0,n)
+    inline void RFRDBatch(const int n, const double* x, const double* y, const double* z, double* rf, double* rd)
+    {
+#pragma omp simd
+        for(int i = 0; i < n; ++i)
+            RFRD(x[i], y[i], z[i], rf[i], rd[i]);
+    }
+
+    inline void RFBatch(const int n, const double* x, const double* y, const double* z, double* out)
+    {
+#pragma omp simd
+        for(int i = 0; i < n; ++i)
+            out[i] = RF(x[i], y[i], z[i]);
+    }
+
+    inline void RDBatch(const int n, const double* x, const double* y, const double* z, double* out)
+    {
+#pragma omp simd
+        for(int i = 0; i < n; ++i)
+            out[i] = RD(x[i], y[i], z[i]);
+    }
+
+    inline void RCBatch(const int n, const double* x, const double* y, double* out)
+    {
+#pragma omp simd
+        for(int i = 0; i < n; ++i)
+            out[i] = RC(x[i], y[i]);
+    }
+
+    inline void RJBatch(const int n, const double* x, const double* y, const double* z, const double* p, double* out)
+    {
+#pragma omp simd
+        for(int i = 0; i < n; ++i)
+            out[i] = RJ(x[i], y[i], z[i], p[i]);
+    }
+
+    // Solid angle of a disk of radius a seen from a point at axial distance L > 0 and radial offset r0 >= 0
+    // from its centre (Paxton 1959):
+    //   r0 < a : 2pi - 2L/Rmax K(k) - pi Lambda0(xi,k)
+    //   r0 = a : pi  - 2L/Rmax K(k)
+    //   r0 > a :     - 2L/Rmax K(k) + pi Lambda0(xi,k)
+    // with Rmax^2 = L^2 + (a+r0)^2, k^2 = 4 a r0 / Rmax^2, tan(xi) = L/|a-r0| and the Heuman Lambda function
+    //   Lambda0(xi,k) = 2/pi [E(k) F(xi,k') + K(k) E(xi,k') - K(k) F(xi,k')], written here with RF and RD.
+    // The three cases are merged with s = sign(a-r0), so the function is branch-free.
+    inline double DiskSolidAngle(const double a, const double L, const double r0)
+    {
+        const double d = a - r0;
+        const double rmax2 = L * L + (a + r0) * (a + r0);
+        const double kc2 = (L * L + d * d) / rmax2; // k'^2 = 1 - k^2
+        const double k2 = 4.0 * a * r0 / rmax2;
+        const double hyp = std::sqrt(L * L + d * d);
+        const double sn = L / hyp;              // sin(xi)
+        const double cs = std::fabs(d) / hyp;   // cos(xi)
+        const double delta2 = 1.0 - kc2 * sn * sn;
+        const double s = d > 0 ? 1.0 : (d < 0 ? -1.0 : 0.0);
+
+        // complete integrals of modulus k and incomplete ones of modulus k' at xi
+        double rf0, rd0, rf1, rd1;
+        RFRD(0.0, kc2, 1.0, rf0, rd0);
+        RFRD(cs * cs, delta2, 1.0, rf1, rd1);
+        const double K = rf0;
+        const double E = rf0 - k2 * (1.0 / 3.0) * rd0;
+        const double Fxi = sn * rf1;
+        const double Exi = Fxi - kc2 * sn * sn * sn * (1.0 / 3.0) * rd1;
+        const double lambda0 = 2.0 / M_PI * (E * Fxi + K * Exi - K * Fxi);
+
+        return M_PI * (1.0 + s) - 2.0 * L / std::sqrt(rmax2) * K - s * M_PI * lambda0;
+    }
+
+    // Disk of radius a at distance R from the point, costh = cosine between the disk axis and the direction
+    // to the point. Zero if the point is behind the disk plane.
+    inline double DiskSolidAngleR(const double a, const double R, const double costh)
+    {
+        const double c = costh > 1.0 ? 1.0 : costh;
+        const double L = R * c;
+        const double r0 = R * std::sqrt(1.0 - c * c);
+        return c > 0 ? DiskSolidAngle(a, L, r0) : 0.0;
+    }
+
+    inline void DiskSolidAngleBatch(const int n, const double* a, const double* R, const double* costh, double* out)
+    {
+#pragma omp simd
+        for(int i = 0; i < n; ++i)
+            out[i] = DiskSolidAngleR(a[i], R[i], costh[i]);
+    }
+}
+
+#endif
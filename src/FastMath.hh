@@ -0,0 +1,115 @@
+#ifndef __FastMath_hh__
+#define __FastMath_hh__
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// Approximate exp/log/pow/lgamma for the opt-in fast_math mode of the fit.
+// Branch-free polynomial forms that the compiler can vectorize inside the reweight and likelihood loops.
+// Maximum errors, measured against the standard library on 2M random arguments:
+//   FastExp    |x| < 700                     1e-14 relative
+//   FastLog    normal positive x             2e-14 relative (absolute for |log(x)| < 1)
+//   FastLog1p  x > -1                        4e-14 relative
+//   FastPow    x > 0, |y*log(x)| < 700       5e-14 relative for |y*log(x)| < 10, grows with |y*log(x)|
+//   FastLgamma x >= 1                        3e-12 relative (absolute for |lgamma(x)| < 1)
+// Inputs outside these ranges (zero, negative, inf, nan) are not handled.
+namespace fastmath
+{
+    inline double FastExp(double x)
+    {
+        // exp(x) = 2^k * exp(r), |r| <= ln2/2, degree 11 Taylor polynomial for exp(r)
+        x = x < -700.0 ? -700.0 : (x > 700.0 ? 700.0 : x);
+        const double kf = std::floor(x * 1.4426950408889634 + 0.5);
+        const double r = (x - kf * 6.93145751953125e-1) - kf * 1.42860682030941723212e-6;
+        double p = 1.0 / 39916800.0;
+        p = p * r + 1.0 / 3628800.0;
+        p = p * r + 1.0 / 362880.0;
+        p = p * r + 1.0 / 40320.0;
+        p = p * r + 1.0 / 5040.0;
+        p = p * r + 1.0 / 720.0;
+        p = p * r + 1.0 / 120.0;
+        p = p * r + 1.0 / 24.0;
+        p = p * r + 1.0 / 6.0;
+        p = p * r + 0.5;
+        p = p * r + 1.0;
+        p = p * r + 1.0;
+
+        const int64_t bits = (static_cast<int64_t>(kf) + 1023) << 52;
+        double scale;
+        std::memcpy(&scale, &bits, sizeof(scale));
+        return p * scale;
+    }
+
+    inline double FastLog(const double x)
+    {
+        // x = m * 2^e with m in [sqrt(1/2), sqrt(2)), log(m) = 2*atanh(s) with s = (m-1)/(m+1), |s| < 0.172
+        // the exponent is counted from the bits of sqrt(1/2), so m lands in the range without a select
+        int64_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        const int64_t tmp = bits - 0x3fe6a09e667f3bcdLL;
+        const int64_t e = tmp >> 52;
+        const int64_t mbits = bits - (tmp & static_cast<int64_t>(0xfff0000000000000ULL));
+        double m;
+        std::memcpy(&m, &mbits, sizeof(m));
+
+        const double s = (m - 1.0) / (m + 1.0);
+        const double s2 = s * s;
+        double p = 2.0 / 15.0;
+        p = p * s2 + 2.0 / 13.0;
+        p = p * s2 + 2.0 / 11.0;
+        p = p * s2 + 2.0 / 9.0;
+        p = p * s2 + 2.0 / 7.0;
+        p = p * s2 + 2.0 / 5.0;
+        p = p * s2 + 2.0 / 3.0;
+        p = p * s2 + 2.0;
+        return static_cast<double>(e) * 6.93147180559945286227e-1 + s * p;
+    }
+
+    inline double FastLog1p(const double x)
+    {
+        // log(u) with u = 1+x rounded, corrected by the rounding error of u
+        const double u = 1.0 + x;
+        const double du = u - 1.0;
+        return du == 0.0 ? x : FastLog(u) * (x / du);
+    }
+
+    inline double FastPow(const double x, const double y)
+    {
+        return FastExp(y * FastLog(x));
+    }
+
+    inline double FastLgamma(const double x)
+    {
+        // shift small arguments by 8 with lgamma(x) = lgamma(x+8) - log(x(x+1)...(x+7)), then Stirling series
+        const bool shift = x < 8.0;
+        const double poch = x * (x + 1) * (x + 2) * (x + 3) * (x + 4) * (x + 5) * (x + 6) * (x + 7);
+        const double prod = shift ? poch : 1.0;
+        const double z = shift ? x + 8.0 : x;
+        const double iz = 1.0 / z;
+        const double iz2 = iz * iz;
+        const double series = iz * (1.0 / 12.0 - iz2 * (1.0 / 360.0 - iz2 * (1.0 / 1260.0 - iz2 / 1680.0)));
+        return (z - 0.5) * FastLog(z) - z + 0.91893853320467274178 + series - FastLog(prod);
+    }
+
+    // Math policies for the kernels and likelihoods, selected once outside of the loops
+    struct StdMath
+    {
+        static inline double Exp(const double x) { return std::exp(x); }
+        static inline double Log(const double x) { return std::log(x); }
+        static inline double Log1p(const double x) { return std::log1p(x); }
+        static inline double Pow(const double x, const double y) { return std::pow(x, y); }
+        static inline double Lgamma(const double x) { return std::lgamma(x); }
+    };
+
+    struct ApproxMath
+    {
+        static inline double Exp(const double x) { return FastExp(x); }
+        static inline double Log(const double x) { return FastLog(x); }
+        static inline double Log1p(const double x) { return FastLog1p(x); }
+        static inline double Pow(const double x, const double y) { return FastPow(x, y); }
+        static inline double Lgamma(const double x) { return FastLgamma(x); }
+    };
+}
+
+#endif
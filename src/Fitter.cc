@@ -7,7 +7,11 @@ Fitter::Fitter(TDirectory* dirout, const int seed, const int num_threads)
     , m_dir(dirout)
     , m_save(false)
     , m_save_events(true)
+    , m_stat_fluc(false)
     , m_zerosyst(false)
+    , m_fast_math(false)
+    , m_affinity(kAffinityNone)
+    , m_pinned(false)
     , m_freq(10000)
     , m_threads(num_threads)
     , m_npar(0)
@@ -59,6 +63,9 @@ void Fitter::FixParameter(const std::string& par_name, const double& value)
         const int i = std::distance(par_names.begin(), iter);
         m_fitter->SetVariable(i, par_names.at(i).c_str(), value, 0);
         m_fitter->FixVariable(i);
+        par_prefit[i] = value;
+        par_step[i] = 0;
+        par_var_fixed[i] = true;
         std::cout << TAG << "Fixing parameter " << par_names.at(i) << " to value " << value
                   << std::endl;
     }
@@ -82,10 +89,24 @@ void Fitter::SetMinSettings(const MinSettings& ms)
     }
 }
 
-void Fitter::InitFitter(std::vector<AnaFitParameters*>& fitpara)
+void Fitter::InitFitter(std::vector<AnaFitParameters*>& fitpara, const std::vector<AnaSample*>& samples)
 {
     m_fitpara = fitpara;
-    std::vector<double> par_step, par_low, par_high;
+    if(m_fast_math)
+        std::cout << TAG << "Using approximate exp/log/pow/lgamma in the reweight and likelihood." << std::endl;
+    for(auto& par : m_fitpara)
+        par->SetFastMath(m_fast_math);
+    for(auto& sample : samples)
+        sample->SetFastMath(m_fast_math);
+    BuildPipeline(samples);
+
+    m_pinned = m_affinity != kAffinityNone && ThreadAffinity::PinThreads(m_threads, m_affinity);
+    if(m_pinned)
+    {
+        for(auto& sample : samples)
+            sample->DistributePMTs(m_threads);
+    }
+    std::vector<double> par_low, par_high;
     std::vector<bool> par_fixed;
 
     //TRandom3 rng(0);
@@ -158,6 +179,8 @@ void Fitter::InitFitter(std::vector<AnaFitParameters*>& fitpara)
             m_fitter->FixVariable(i);
     }
     par_var_fixed = par_fixed;
+    par_var_low = par_low;
+    par_var_high = par_high;
 
     std::cout << TAG << "Number of defined parameters: " << m_fitter->NDim() << std::endl
               << TAG << "Number of free parameters   : " << m_fitter->NFree() << std::endl
@@ -198,7 +221,8 @@ void Fitter::InitFitter(std::vector<AnaFitParameters*>& fitpara)
 bool Fitter::Fit(const std::vector<AnaSample*>& samples, bool stat_fluc)
 {
     std::cout << TAG << "Starting to fit." << std::endl;
-    m_samples = samples;
+    if(samples != m_samples)
+        BuildPipeline(samples);
 
     if(m_fitter == nullptr)
     {
@@ -213,6 +237,8 @@ bool Fitter::Fit(const std::vector<AnaSample*>& samples, bool stat_fluc)
         s->FillDataHist(stat_fluc);
         s->SetLLHFunction(min_settings.likelihood);
     }
+    m_stat_fluc = stat_fluc;
+    InvalidateCache();
 
     SaveEventHist();
 
@@ -250,12 +276,245 @@ bool Fitter::Fit(const std::vector<AnaSample*>& samples, bool stat_fluc)
     if(m_dir)
         SaveChi2();
 
-    const int ndim        = m_fitter->NDim();
-    const int nfree       = m_fitter->NFree();
-    const double* par_val = m_fitter->X();
-    const double* par_err = m_fitter->Errors();
+    std::vector<std::vector<double>> res_pars;
+    if(!SaveFitResult(m_fitter, res_pars))
+        return false;
+
+    par_postfit.clear();
+    for(const auto& pars : res_pars)
+        par_postfit.insert(par_postfit.end(), pars.begin(), pars.end());
+    SaveEventHist(true);
+
+    if(m_save_events)
+        SaveEventTree(res_pars);
+
+    if(!did_converge)
+        std::cout << TAG  << "Not valid fit result." << std::endl;
+    std::cout << TAG << "Fit routine finished. Results saved." << std::endl;
+
+    return did_converge;
+}
+
+
+bool Fitter::FitToyLanes(const std::vector<AnaSample*>& samples, const int ntoys, const int nlanes, bool stat_fluc,
+                         const std::function<std::string(int)>& toy_file)
+{
+    if(samples != m_samples)
+        BuildPipeline(samples);
+
+    if(m_fitter == nullptr)
+    {
+        std::cerr  << ERR << "In FitToyLanes()\n"
+                   << "Fitter has not been initialized." << std::endl;
+        return false;
+    }
+
+    // the lanes share the PMT weights, only the data may differ between toys
+    for(const auto& s : m_samples)
+    {
+        if(s->ToyChangesPMTs())
+        {
+            std::cout << WAR << "Sample " << s->GetName() << " throws the PMT efficiencies of every toy, "
+                      << "toys cannot be fitted in lanes." << std::endl;
+            return false;
+        }
+    }
+
+    const int num_lanes = std::max(1, std::min(nlanes, ntoys));
+    std::cout << TAG << "Fitting " << ntoys << " toys in " << num_lanes << " lanes." << std::endl;
+
+    // the minimizers run in their own threads
+    ROOT::EnableThreadSafety();
+    for(const auto& s : m_samples)
+        s->SetLLHFunction(min_settings.likelihood);
+
+    std::vector<ToyLane> lanes(num_lanes);
+    for(auto& lane : lanes)
+    {
+        lane.toy = -1;
+        lane.minimizer = nullptr;
+        lane.waiting = false;
+        lane.done = false;
+        lane.converged = false;
+        ToyLane* l = &lane;
+        lane.fcn = new ROOT::Math::Functor([this, l](const double* par)
+        {
+            std::unique_lock<std::mutex> lock(m_lane_mutex);
+            l->x.assign(par, par + m_npar);
+            l->waiting = true;
+            m_lane_ready.notify_one();
+            m_lane_eval.wait(lock, [l] { return !l->waiting; });
+            return l->fval;
+        }, m_npar);
+    }
+
+    std::unique_lock<std::mutex> lock(m_lane_mutex);
+    int next_toy = 0;
+    int num_active = 0;
+    for(int l = 0; l < num_lanes; ++l, ++num_active)
+        StartToyLane(lanes[l], l, next_toy++, stat_fluc);
+    InvalidateCache();
+
+    std::vector<double> points, chi2;
+    std::vector<int> point_lane;
+    while(num_active > 0)
+    {
+        // wait until every running lane asks for a point or has finished
+        m_lane_ready.wait(lock, [&lanes]
+        {
+            for(const auto& lane : lanes)
+                if(lane.toy >= 0 && !lane.waiting && !lane.done)
+                    return false;
+            return true;
+        });
+
+        // replace the finished toys, the new lanes join the next batch
+        bool started = false;
+        for(int l = 0; l < num_lanes; ++l)
+        {
+            ToyLane& lane = lanes[l];
+            if(lane.toy < 0 || !lane.done)
+                continue;
+            lane.thread.join();
+            SaveToyLane(lane, toy_file);
+            if(next_toy < ntoys)
+            {
+                StartToyLane(lane, l, next_toy++, stat_fluc);
+                started = true;
+            }
+            else
+            {
+                lane.toy = -1;
+                num_active--;
+            }
+        }
+        if(started)
+        {
+            InvalidateCache();
+            continue;
+        }
+
+        points.clear();
+        point_lane.clear();
+        for(int l = 0; l < num_lanes; ++l)
+        {
+            if(lanes[l].toy >= 0 && lanes[l].waiting)
+            {
+                points.insert(points.end(), lanes[l].x.begin(), lanes[l].x.end());
+                point_lane.push_back(l);
+            }
+        }
+        if(point_lane.empty())
+            continue;
+
+        chi2.resize(point_lane.size());
+        CalcLikelihoodBatch(points.data(), point_lane.size(), chi2.data(), point_lane.data());
+        for(std::size_t n = 0; n < point_lane.size(); ++n)
+        {
+            lanes[point_lane[n]].fval = chi2[n];
+            lanes[point_lane[n]].waiting = false;
+        }
+        m_lane_eval.notify_all();
+    }
+    lock.unlock();
+
+    for(auto& lane : lanes)
+        delete lane.fcn;
+    for(const auto& s : m_samples)
+        s->ClearLaneData();
+    InvalidateCache();
+
+    std::cout << TAG << "Toy fits finished." << std::endl;
+    return true;
+}
+
+void Fitter::StartToyLane(ToyLane& lane, const int index, const int toy, bool stat_fluc)
+{
+    // toys are generated in order on the main thread, the same data as fitting them one by one
+    std::cout << TAG << "Processing Toy Fit " << toy << " in lane " << index << std::endl;
+    for(const auto& s : m_samples)
+    {
+        s->InitToy();
+        s->FillDataHist(stat_fluc);
+        s->SaveLaneData(index);
+    }
+
+    // every toy starts from the prefit values, the output of the lanes would interleave
+    lane.minimizer = ROOT::Math::Factory::CreateMinimizer(min_settings.minimizer.c_str(), min_settings.algorithm.c_str());
+    lane.minimizer->SetFunction(*lane.fcn);
+    lane.minimizer->SetStrategy(min_settings.strategy);
+    lane.minimizer->SetPrintLevel(0);
+    lane.minimizer->SetTolerance(min_settings.tolerance);
+    lane.minimizer->SetMaxIterations(min_settings.max_iter);
+    lane.minimizer->SetMaxFunctionCalls(min_settings.max_fcn);
+    for(int i = 0; i < m_npar; ++i)
+    {
+        lane.minimizer->SetVariable(i, par_names[i], par_prefit[i], par_step[i]);
+        lane.minimizer->SetVariableLimits(i, par_var_low[i], par_var_high[i]);
+        if(par_var_fixed[i])
+            lane.minimizer->FixVariable(i);
+    }
+
+    lane.toy = toy;
+    lane.waiting = false;
+    lane.done = false;
+    lane.converged = false;
+    ToyLane* l = &lane;
+    lane.thread = std::thread([this, l]
+    {
+        // the main thread is pinned to the CPU of OpenMP thread 0, the minimizers of the lanes may run anywhere
+        if(m_affinity != kAffinityNone)
+            ThreadAffinity::UnpinThread();
+        bool did_converge = l->minimizer->Minimize();
+        if(did_converge)
+            did_converge = l->minimizer->Hesse();
+
+        std::lock_guard<std::mutex> lock(m_lane_mutex);
+        l->converged = did_converge;
+        l->done = true;
+        m_lane_ready.notify_one();
+    });
+}
+
+void Fitter::SaveToyLane(ToyLane& lane, const std::function<std::string(int)>& toy_file)
+{
+    if(!lane.converged)
+        std::cout << TAG << "Toy Fit " << lane.toy << " did not coverge." << std::endl;
+
+    TDirectory* dir = m_dir;
+    TFile* fout_toy = TFile::Open(toy_file(lane.toy).c_str(), "RECREATE");
+    m_dir = fout_toy;
+
+    std::vector<std::vector<double>> res_pars;
+    SaveFitResult(lane.minimizer, res_pars);
+
+    // the minimum split into its stat and syst parts, the penalty terms are evaluated in the fit basis
+    std::vector<std::vector<double>> fit_pars;
+    SplitParameters(lane.minimizer->X(), fit_pars);
+    double chi2_sys = 0.0;
+    for(int i = 0; i < m_fitpara.size(); ++i)
+        chi2_sys += m_fitpara[i]->GetChi2(fit_pars[i]);
+    const double chi2_tot = lane.minimizer->MinValue();
+    std::vector<double> v_chi2_pstfit = {chi2_tot - chi2_sys, chi2_sys, 0.0, chi2_tot};
+    TVectorD chi2_pstfit(v_chi2_pstfit.size(), v_chi2_pstfit.data());
+    m_dir->cd();
+    chi2_pstfit.Write("chi2_tuple_postfit");
+
+    fout_toy->Close();
+    m_dir = dir;
+
+    delete lane.minimizer;
+    lane.minimizer = nullptr;
+}
+
+bool Fitter::SaveFitResult(ROOT::Math::Minimizer* minimizer, std::vector<std::vector<double>>& res_pars)
+{
+    const int ndim        = minimizer->NDim();
+    const int nfree       = minimizer->NFree();
+    const double* par_val = minimizer->X();
+    const double* par_err = minimizer->Errors();
     double cov_array[ndim * ndim];
-    m_fitter->GetCovMatrix(cov_array);
+    minimizer->GetCovMatrix(cov_array);
 
     std::vector<double> par_val_vec(par_val, par_val + ndim);
     std::vector<double> par_err_vec(par_err, par_err + ndim);
@@ -272,8 +531,6 @@ bool Fitter::Fit(const std::vector<AnaSample*>& samples, bool stat_fluc)
         par_offset += fit_param->GetNpar();
     }
 
-    par_postfit = par_val_vec;
-
     TMatrixDSym cor_matrix(ndim);
     for(int r = 0; r < ndim; ++r)
     {
@@ -287,10 +544,10 @@ bool Fitter::Fit(const std::vector<AnaSample*>& samples, bool stat_fluc)
 
     TVectorD postfit_globalcc(ndim);
     for(int i = 0; i < ndim; ++i)
-        postfit_globalcc[i] = m_fitter->GlobalCC(i);
+        postfit_globalcc[i] = minimizer->GlobalCC(i);
 
     TVectorD postfit_param(ndim, &par_val_vec[0]);
-    std::vector<std::vector<double>> res_pars;
+    res_pars.clear();
     std::vector<std::vector<double>> err_pars;
     int k = 0;
     for(int i = 0; i < m_fitpara.size(); i++)
@@ -323,68 +580,382 @@ bool Fitter::Fit(const std::vector<AnaSample*>& samples, bool stat_fluc)
     postfit_globalcc.Write("res_globalcc");
 
     SaveResults(res_pars, err_pars);
-    SaveEventHist(true);
 
-    if(m_save_events)
-        SaveEventTree(res_pars);
+    return true;
+}
 
-    if(!did_converge)
-        std::cout << TAG  << "Not valid fit result." << std::endl;
-    std::cout << TAG << "Fit routine finished. Results saved." << std::endl;
+void Fitter::BuildPipeline(const std::vector<AnaSample*>& samples)
+{
+    // Resolve once which parameter classes act on which sample,
+    // so the reweight loop does not check the PMT type of every class.
+    m_samples = samples;
+    m_pipeline.assign(m_samples.size(), std::vector<int>());
+    m_spline_pipeline.assign(m_samples.size(), std::vector<int>());
+    m_pmt_pipeline.assign(m_samples.size(), std::vector<int>());
+    m_bin_pipeline.assign(m_samples.size(), std::vector<int>());
+    m_geo_pipeline.assign(m_samples.size(), std::vector<int>());
+    m_smear_pipeline.assign(m_samples.size(), std::vector<int>());
+    m_bin_map.assign(m_samples.size(), std::vector<std::vector<int>>());
+    m_bin_factor.assign(m_samples.size(), std::vector<double>());
+    m_compressed.assign(m_samples.size(), -1);
+    m_bin_direct.assign(m_samples.size(), std::vector<double>());
+    m_par_changed.assign(m_fitpara.size(), true);
+    m_sample_llh.assign(m_samples.size(), 0.0);
+
+    for(std::size_t s = 0; s < m_samples.size(); ++s)
+    {
+        const int pmttype = m_samples[s]->GetPMTType();
+        for(std::size_t j = 0; j < m_fitpara.size(); ++j)
+        {
+            if(m_fitpara[j]->GetPMTType() >= 0 && m_fitpara[j]->GetPMTType() != pmttype)
+                continue;
 
-    return did_converge;
+            // geometry classes recompute the PMT columns the other classes read, they do not reweight
+            if(m_fitpara[j]->IsGeometry())
+            {
+                if(m_samples[s]->GetPMTStore()->CanMoveGeometry())
+                    m_geo_pipeline[s].push_back(j);
+                else
+                    std::cout << WAR << "Sample " << m_samples[s]->GetName() << " has no raw PMT geometry or source frame, "
+                              << m_fitpara[j]->GetName() << " is ignored. Convert it again with WCSIM_TreeConvert." << std::endl;
+                continue;
+            }
+            // time resolution classes only smear the template, samples without one were reported in InitEventMap
+            if(m_fitpara[j]->IsTimeSmear())
+            {
+                if(m_fitpara[j]->HasTimeSmear(s))
+                    m_smear_pipeline[s].push_back(j);
+                continue;
+            }
+            m_pipeline[s].push_back(j);
+            if(m_fitpara[j]->UseSpline())
+                m_spline_pipeline[s].push_back(j);
+
+            // A class whose factor is constant over every sample bin is applied per bin after the PMT sums
+            std::vector<int> bin_map;
+            if(m_fitpara[j]->FactorizeBins(m_samples[s]->GetPMTStore(), s, m_samples[s]->GetNBins(), bin_map))
+            {
+                m_bin_pipeline[s].push_back(j);
+                m_bin_map[s].emplace_back(bin_map);
+            }
+            else
+                m_pmt_pipeline[s].push_back(j);
+        }
+        if(!m_bin_pipeline[s].empty())
+            m_bin_factor[s].assign(m_samples[s]->GetNBins(), 1.0);
+
+        // The compressed attenuation replaces the PMT sums, so no other class may need the per-PMT weights,
+        // and its R moments are only built for the nominal geometry
+        if(m_pmt_pipeline[s].size() == 1 && m_fitpara[m_pmt_pipeline[s][0]]->UseCompression() && m_geo_pipeline[s].empty())
+        {
+            m_compressed[s] = m_pmt_pipeline[s][0];
+            m_pmt_pipeline[s].clear();
+            m_bin_direct[s].assign(m_samples[s]->GetNBins(), 0.0);
+            std::cout << TAG << "Using compressed " << m_fitpara[m_compressed[s]]->GetName()
+                      << " for sample " << m_samples[s]->GetName() << std::endl;
+        }
+        else
+        {
+            for(const int j : m_pmt_pipeline[s])
+                if(m_fitpara[j]->UseCompression())
+                    std::cout << WAR << "Cannot compress " << m_fitpara[j]->GetName() << " for sample "
+                              << m_samples[s]->GetName() << ", other classes are reweighted per PMT or the geometry moves" << std::endl;
+        }
+
+        std::cout << TAG << "Reweight pipeline for sample " << m_samples[s]->GetName()
+                  << " has " << m_pipeline[s].size() << " parameter classes, "
+                  << m_bin_pipeline[s].size() << " factorized per bin"
+                  << (m_geo_pipeline[s].empty() ? "" : ", moving geometry")
+                  << (m_smear_pipeline[s].empty() ? "." : ", smearing the template.") << std::endl;
+    }
+
+    // a geometry class moving no sample, or a time resolution class smearing no template, leaves the likelihood
+    // flat in its parameters, which Migrad and Hesse cannot handle
+    for(std::size_t j = 0; j < m_fitpara.size(); ++j)
+    {
+        if(!m_fitpara[j]->IsGeometry() && !m_fitpara[j]->IsTimeSmear())
+            continue;
+        bool used = false;
+        for(std::size_t s = 0; s < m_samples.size(); ++s)
+        {
+            const std::vector<int>& pipeline = m_fitpara[j]->IsGeometry() ? m_geo_pipeline[s] : m_smear_pipeline[s];
+            used = used || std::find(pipeline.begin(), pipeline.end(), j) != pipeline.end();
+        }
+        if(!used)
+        {
+            std::cout << WAR << m_fitpara[j]->GetName() << " acts on no sample, fixing its parameters." << std::endl;
+            std::vector<bool> fixed(m_fitpara[j]->GetNpar(), true);
+            m_fitpara[j]->SetParFixed(fixed);
+        }
+    }
+
+    InvalidateCache();
 }
 
+void Fitter::InvalidateCache()
+{
+    // Force the next call to recompute every factor and sample likelihood,
+    // needed whenever the data or the PMT inputs change outside of the parameters.
+    m_sample_cached.assign(m_samples.size(), false);
+    for(auto& fitpara : m_fitpara)
+        fitpara->InvalidateCache();
+
+    // the R moments include the PMT efficiencies which change between toys
+    for(std::size_t s = 0; s < m_samples.size(); ++s)
+        if(m_compressed[s] >= 0)
+            m_fitpara[m_compressed[s]]->BuildCompressed(m_samples[s]->GetPMTStore(), s, m_samples[s]->GetNBins());
+}
 
-double Fitter::FillSamples(std::vector<std::vector<double>>& new_pars)
+void Fitter::FillSamples(std::vector<std::vector<std::vector<double>>>& new_pars, double* chi2_stat, const int* lanes)
 {
-    // loop over all PMTs to update the predicted PE and get stat chi2
-    double chi2      = 0.0;
+    // loop over all PMTs to update the predicted PE and get stat chi2 of every point
+    const int npoints = new_pars.size();
+    const int nclass = m_fitpara.size();
     bool output_chi2 = false;
     if((m_calls < 1001 && (m_calls % 100 == 0 || m_calls < 20))
        || (m_calls > 1001 && m_calls % 1000 == 0))
         output_chi2 = true;
 
-    //unsigned int par_offset = 0;
-    for(int i = 0; i < m_fitpara.size(); ++i)
+    // The geometry columns are shared by all points, so a batch moving the geometry between its points
+    // is evaluated one point at a time
+    if(npoints > 1)
     {
-        if(m_fitpara[i]->IsDecomposed())
+        bool geo_varies = false;
+        for(int i = 0; i < nclass; ++i)
+            if(m_fitpara[i]->IsGeometry())
+                for(int p = 1; p < npoints; ++p)
+                    geo_varies = geo_varies || new_pars[p][i] != new_pars[0][i];
+        if(geo_varies)
         {
-            new_pars[i] = m_fitpara[i]->GetOriginalParameters(new_pars[i]);
+            for(int p = 0; p < npoints; ++p)
+            {
+                std::vector<std::vector<std::vector<double>>> point(1, new_pars[p]);
+                FillSamples(point, chi2_stat + p, lanes != nullptr ? lanes + p : nullptr);
+            }
+            return;
         }
-        //par_offset += m_fitpara[i]->GetNpar();
+    }
+
+    // A class changed if any point differs from the cached parameters or from the point before,
+    // it varies if it has to be recomputed for every point of the batch.
+    // The cache ends up at the last point, as if the points had been evaluated one by one.
+    std::vector<bool> par_varies(nclass, false);
+    for(int i = 0; i < nclass; ++i)
+    {
+        m_par_changed[i] = false;
+        for(int p = 0; p < npoints; ++p)
+        {
+            if(m_fitpara[i]->IsDecomposed())
+                new_pars[p][i] = m_fitpara[i]->GetOriginalParameters(new_pars[p][i]);
 
-        m_fitpara[i]->ApplyParameters(new_pars[i]);
+            if(m_fitpara[i]->ParametersChanged(new_pars[p][i]))
+            {
+                m_par_changed[i] = true;
+                par_varies[i] = par_varies[i] || p > 0;
+            }
+        }
+        if(m_par_changed[i])
+            m_fitpara[i]->ApplyParameters(new_pars[npoints - 1][i]);
     }
 
-    for(int s = 0; s < m_samples.size(); ++s)
+    // Decide per sample whether its PMT sums, only its per-bin inputs or nothing has to be recomputed
+    const int nsamples = m_samples.size();
+    std::vector<int> mode(nsamples, kSampleCached);
+    std::vector<ChunkReweight> reweight(nsamples);
+    std::vector<std::vector<const double*>> bin_factor(nsamples, std::vector<const double*>(npoints, nullptr));
+    std::vector<std::vector<const double*>> bin_direct(nsamples, std::vector<const double*>(npoints, nullptr));
+    for(int s = 0; s < nsamples; ++s)
     {
-        const unsigned int num_pmts = m_samples[s]->GetNPMTs();
-        const int pmttype = m_samples[s]->GetPMTType();
-#pragma omp parallel for num_threads(m_threads)
-        for(unsigned int i = 0; i < num_pmts; ++i)
+        // Only the classes with changed parameters recompute their per-PMT factor.
+        // A sample with no changed class keeps its histograms and likelihood from the last call.
+        const std::vector<int>& pipeline = m_pmt_pipeline[s];
+        AnaSample* sample = m_samples[s];
+        PMTStore* pmts = sample->GetPMTStore();
+
+        // moved geometry: every per-PMT factor reads the recomputed columns
+        bool geo_changed = false;
+        for(const int j : m_geo_pipeline[s])
+            geo_changed = geo_changed || m_par_changed[j];
+        if(geo_changed)
         {
-            AnaEvent* ev = m_samples[s]->GetPMT(i);
-            ev->ResetEvWght();
-            for(int j = 0; j < m_fitpara.size(); ++j)
+            double src_shift[3] = {0., 0., 0.};
+            double pmt_shift[3] = {0., 0., 0.};
+            for(const int j : m_geo_pipeline[s])
+                m_fitpara[j]->AddGeometryShift(new_pars[npoints - 1][j], src_shift, pmt_shift);
+            pmts->SetGeometryShift(src_shift, pmt_shift);
+        }
+
+        // changed time resolution: kernel spectra of every point the template is smeared for
+        bool smear_changed = false;
+        for(const int j : m_smear_pipeline[s])
+        {
+            if(!m_par_changed[j])
+                continue;
+            smear_changed = true;
+            for(int p = 0; p < (par_varies[j] ? npoints : 1); ++p)
+                m_fitpara[j]->SetSmearKernels(s, p, new_pars[p][j]);
+        }
+
+        std::vector<int> changed;
+        for(const int j : pipeline)
+            if(m_par_changed[j] || geo_changed)
+                changed.push_back(j);
+
+        bool bin_changed = false;
+        for(const int j : m_bin_pipeline[s])
+            bin_changed = bin_changed || m_par_changed[j];
+        if(m_compressed[s] >= 0)
+            bin_changed = bin_changed || m_par_changed[m_compressed[s]];
+
+        // with toy lanes every point has its own data, so no likelihood can be reused
+        if(changed.empty() && !bin_changed && !geo_changed && !smear_changed && m_sample_cached[s] && lanes == nullptr)
+            continue;
+        mode[s] = changed.empty() && !geo_changed && !smear_changed && m_sample_cached[s] ? kSampleFactor : kSampleFused;
+
+        const bool use_template = sample->UseTemplate();
+        reweight[s] = [this, s, pmts, changed, par_varies, geo_changed, use_template, &new_pars](const int p, const int begin, const int end)
+        {
+            // the geometry is the same for all points of the batch
+            if(geo_changed && p == 0)
+            {
+                pmts->UpdateGeometry(begin, end);
+                for(const int j : m_pmt_pipeline[s])
+                    m_fitpara[j]->UpdateBasis(pmts, s, begin, end);
+            }
+            // the factor of a class that is the same for all points is only computed for the first one
+            for(const int j : changed)
+                if(p == 0 || par_varies[j])
+                    m_fitpara[j]->UpdateFactor(pmts, s, begin, end, new_pars[p][j]);
+            pmts->ResetWeights(begin, end);
+            for(const int j : m_pmt_pipeline[s])
+                m_fitpara[j]->ReWeight(pmts, s, begin, end);
+
+            if(use_template)
+            {
+                // the smeared template of a class that is the same for all points is kept from the first one
+                for(const int j : m_smear_pipeline[s])
+                    if(m_par_changed[j] && (p == 0 || par_varies[j]))
+                        m_fitpara[j]->SmearTemplate(pmts, s, par_varies[j] ? p : 0, begin, end);
+                pmts->ResetTemplatePred(begin, end);
+                for(const int j : m_spline_pipeline[s])
+                    m_fitpara[j]->ReWeightSpline(pmts, s, begin, end, new_pars[p][j]);
+            }
+        };
+
+        // factorized classes only scale the PMT sums of each bin
+        const int nbins = sample->GetNBins();
+        if(!m_bin_pipeline[s].empty())
+        {
+            m_bin_factor[s].assign(npoints * nbins, 1.0);
+            for(int p = 0; p < npoints; ++p)
+            {
+                for(std::size_t n = 0; n < m_bin_pipeline[s].size(); ++n)
+                {
+                    const int j = m_bin_pipeline[s][n];
+                    m_fitpara[j]->MultiplyBinFactor(new_pars[p][j], m_bin_map[s][n], m_bin_factor[s].data() + p * nbins);
+                }
+                bin_factor[s][p] = m_bin_factor[s].data() + p * nbins;
+            }
+        }
+
+        if(m_compressed[s] >= 0)
+        {
+            const int j = m_compressed[s];
+            m_bin_direct[s].resize(npoints * nbins);
+            for(int p = 0; p < npoints; ++p)
+            {
+                m_fitpara[j]->EvalCompressed(s, new_pars[p][j], m_bin_direct[s].data() + p * nbins);
+                bin_direct[s][p] = m_bin_direct[s].data() + p * nbins;
+            }
+        }
+
+        if(mode[s] == kSampleFused)
+            sample->BeginAccumulate(PMT_CHUNK_SIZE, npoints);
+    }
+
+    // (sample, PMT group) tasks of all samples, largest groups first so that the small samples fill the gaps at the end
+    std::vector<std::pair<int, int>> tasks;
+    for(int s = 0; s < nsamples; ++s)
+        if(mode[s] == kSampleFused)
+            for(int g = 0; g < m_samples[s]->GetNumGroups(); ++g)
+                tasks.push_back(std::make_pair(s, g));
+    std::stable_sort(tasks.begin(), tasks.end(), [this](const std::pair<int, int>& a, const std::pair<int, int>& b)
+    {
+        return m_samples[a.first]->GetNPMTs() / m_samples[a.first]->GetNumGroups()
+               > m_samples[b.first]->GetNPMTs() / m_samples[b.first]->GetNumGroups();
+    });
+    const int ntasks = tasks.size();
+
+    // likelihood of every sample at every point, cached samples keep their last value
+    std::vector<double> sample_llh(nsamples * npoints);
+    for(int s = 0; s < nsamples; ++s)
+        std::fill(sample_llh.begin() + s * npoints, sample_llh.begin() + (s + 1) * npoints, m_sample_llh[s]);
+
+    // One parallel region per likelihood call: reweight and bin the PMT groups of every sample for all points,
+    // then reduce the groups and evaluate the likelihood blocks point by point and sample by sample
+#pragma omp parallel num_threads(m_threads)
+    {
+        if(m_pinned)
+        {
+            // every thread takes the groups whose PMT columns it first touched
+            int tid = 0, nteam = 1;
+#ifdef _OPENMP
+            tid = omp_get_thread_num();
+            nteam = omp_get_num_threads();
+#endif
+            for(int t = 0; t < ntasks; ++t)
+            {
+                const int s = tasks[t].first;
+                if(m_samples[s]->GetGroupOwner(tasks[t].second, nteam) == tid)
+                    m_samples[s]->AccumulateGroup(tasks[t].second, &reweight[s], m_samples[s]->GetPMTStore()->GetWeight());
+            }
+#pragma omp barrier
+        }
+        else
+        {
+#pragma omp for schedule(dynamic, 1)
+            for(int t = 0; t < ntasks; ++t)
+            {
+                const int s = tasks[t].first;
+                m_samples[s]->AccumulateGroup(tasks[t].second, &reweight[s], m_samples[s]->GetPMTStore()->GetWeight());
+            }
+        }
+
+        for(int p = 0; p < npoints; ++p)
+        {
+            for(int s = 0; s < nsamples; ++s)
             {
-                if (m_fitpara[j]->GetPMTType()>=0 && m_fitpara[j]->GetPMTType() != pmttype) continue;
-                m_fitpara[j]->ReWeight(ev, pmttype, s, i, new_pars[j]);
+                if(mode[s] == kSampleCached)
+                    continue;
+                const int lane = lanes != nullptr ? lanes[p] : -1;
+                const bool template_llh = mode[s] == kSampleFused || lanes != nullptr;
+                if(mode[s] == kSampleFused)
+                    m_samples[s]->ReduceGroups(p);
+                m_samples[s]->LLHBlocks(bin_factor[s][p], bin_direct[s][p], template_llh, lane);
+#pragma omp single
+                sample_llh[s * npoints + p] = m_samples[s]->FinishLLH(template_llh, lane);
             }
         }
+    }
 
-        m_samples[s]->FillEventHist();
-        double sample_chi2 = m_samples[s]->CalcLLH();
-        chi2 += sample_chi2;
+    for(int p = 0; p < npoints; ++p)
+    {
+        chi2_stat[p] = 0.0;
+        for(int s = 0; s < nsamples; ++s)
+            chi2_stat[p] += sample_llh[s * npoints + p];
+    }
+
+    for(int s = 0; s < nsamples; ++s)
+    {
+        m_sample_llh[s] = sample_llh[s * npoints + npoints - 1];
+        m_sample_cached[s] = true;
 
         if(output_chi2)
         {
             std::cout << TAG << "Chi2 for sample " << m_samples[s]->GetName() << " is "
-                      << sample_chi2 << std::endl;
+                      << m_sample_llh[s] << (mode[s] == kSampleCached ? " (cached)" : "") << std::endl;
         }
     }
-
-    return chi2;
 }
 
 double Fitter::CalcLikelihood(const double* par)
@@ -396,40 +967,30 @@ double Fitter::CalcLikelihood(const double* par)
        || (m_calls > 1001 && m_calls % 1000 == 0))
         output_chi2 = true;
 
-    int k           = 0;
     double chi2_sys = 0.0;
     double chi2_reg = 0.0;
-    std::vector<std::vector<double>> new_pars;
+    std::vector<std::vector<std::vector<double>>> new_pars(1);
+    SplitParameters(par, new_pars[0]);
     for(int i = 0; i < m_fitpara.size(); ++i)
     {
-        const unsigned int npar = m_fitpara[i]->GetNpar();
-        std::vector<double> vec;
-        for(int j = 0; j < npar; ++j)
-        {
-            vec.push_back(par[k++]);
-        }
-
-        chi2_sys += m_fitpara[i]->GetChi2(vec);
-
-        new_pars.push_back(vec);
+        chi2_sys += m_fitpara[i]->GetChi2(new_pars[0][i]);
 
         if(output_chi2)
         {
             std::cout << TAG << "Chi2 contribution from " << m_fitpara[i]->GetName() << " is "
-                      << m_fitpara[i]->GetChi2(vec) << std::endl;
+                      << m_fitpara[i]->GetChi2(new_pars[0][i]) << std::endl;
         }
-
     }
 
-
-    double chi2_stat = FillSamples(new_pars);
+    double chi2_stat = 0.0;
+    FillSamples(new_pars, &chi2_stat);
     vec_chi2_stat.push_back(chi2_stat);
     vec_chi2_sys.push_back(chi2_sys);
     vec_chi2_reg.push_back(chi2_reg);
 
     if(m_calls % m_freq == 0 && m_save)
     {
-        SaveParams(new_pars);
+        SaveParams(new_pars[0]);
         SaveEventHist();
     }
 
@@ -445,6 +1006,41 @@ double Fitter::CalcLikelihood(const double* par)
     return chi2_stat + chi2_sys + chi2_reg;
 }
 
+void Fitter::CalcLikelihoodBatch(const double* points, const int npoints, double* out, const int* lanes)
+{
+    if(npoints <= 0)
+        return;
+
+    std::vector<std::vector<std::vector<double>>> new_pars(npoints);
+    for(int p = 0; p < npoints; ++p)
+        SplitParameters(points + (std::size_t)p * m_npar, new_pars[p]);
+
+    // the systematic chi2 of the eigen-decomposed classes is computed before FillSamples transforms them back
+    for(int p = 0; p < npoints; ++p)
+    {
+        out[p] = 0.0;
+        for(int i = 0; i < m_fitpara.size(); ++i)
+            out[p] += m_fitpara[i]->GetChi2(new_pars[p][i]);
+    }
+
+    std::vector<double> chi2_stat(npoints);
+    FillSamples(new_pars, chi2_stat.data(), lanes);
+    for(int p = 0; p < npoints; ++p)
+        out[p] += chi2_stat[p];
+}
+
+void Fitter::SplitParameters(const double* par, std::vector<std::vector<double>>& new_pars) const
+{
+    int k = 0;
+    new_pars.resize(m_fitpara.size());
+    for(int i = 0; i < m_fitpara.size(); ++i)
+    {
+        const unsigned int npar = m_fitpara[i]->GetNpar();
+        new_pars[i].assign(par + k, par + k + npar);
+        k += npar;
+    }
+}
+
 void Fitter::SaveEventHist(bool is_final)
 {
     for(auto& sample : m_samples)
@@ -586,29 +1182,121 @@ void Fitter::ParameterScans(const std::vector<int>& param_list, unsigned int nst
 {
     std::cout << TAG << "Performing parameter scans..." << std::endl;
 
-    //Internally Scan performs steps-1, so add one to actually get the number of steps
-    //we ask for.
-    unsigned int adj_steps = nsteps+1;
-    double* x = new double[adj_steps] {};
-    double* y = new double[adj_steps] {};
+    // Scan range as in Minuit2: best fit +- 2 sigma, clipped to the parameter limits.
+    // All steps of a parameter are evaluated in one batch, sharing the per-PMT factors of the other classes.
+    const double* best = m_fitter->X();
+    const double* errors = m_fitter->Errors();
+    std::vector<double> points(nsteps * m_npar);
+    std::vector<double> x(nsteps), y(nsteps);
 
     for(const auto& p : param_list)
     {
+        if(p < 0 || p >= m_npar)
+        {
+            std::cout << WAR << "Parameter " << p << " does not exist, skipping scan." << std::endl;
+            continue;
+        }
         std::cout << TAG << "Scanning parameter " << p
                   << " (" << m_fitter->VariableName(p) << ")." << std::endl;
 
-        bool success = m_fitter->Scan(p, adj_steps, x, y);
+        const double low = std::max(best[p] - 2.0 * errors[p], par_var_low[p]);
+        const double high = std::min(best[p] + 2.0 * errors[p], par_var_high[p]);
+        for(unsigned int i = 0; i < nsteps; ++i)
+        {
+            x[i] = nsteps > 1 ? low + (high - low) * i / (nsteps - 1) : best[p];
+            std::copy(best, best + m_npar, points.begin() + i * m_npar);
+            points[i * m_npar + p] = x[i];
+        }
+        CalcLikelihoodBatch(points.data(), nsteps, y.data());
 
-        TGraph scan_graph(nsteps, x, y);
+        TGraph scan_graph(nsteps, x.data(), y.data());
         m_dir->cd();
 
         std::stringstream ss;
         ss << "par_scan_" << std::to_string(p);
         scan_graph.Write(ss.str().c_str());
     }
+}
+
+void Fitter::GroupVelocityScan(double low, double high, unsigned int nsteps)
+{
+    std::vector<AnaSample*> vg_samples;
+    for(const auto& s : m_samples)
+        if(s->UsesGroupVelocity())
+            vg_samples.push_back(s);
+    if(vg_samples.empty() || nsteps == 0)
+    {
+        std::cout << WAR << "No sample uses the group velocity option, skipping the group velocity scan." << std::endl;
+        return;
+    }
+    // the fluctuations are drawn from the data at one vg, the data rebuilt at another vg would have new ones
+    if(m_stat_fluc)
+    {
+        std::cout << WAR << "The fit used stat_fluc, skipping the group velocity scan." << std::endl;
+        return;
+    }
+
+    std::cout << TAG << "Scanning group velocity in [" << low << ", " << high << "] m/ns for " << nsteps << " steps..." << std::endl;
+
+    // every step starts from the best fit, which is restored at the end
+    const std::vector<double> best(m_fitter->X(), m_fitter->X() + m_npar);
+    std::vector<double> vg_nominal;
+    for(const auto& s : vg_samples)
+        vg_nominal.push_back(s->GetGroupVelocity());
+    const bool save = m_save;
+    m_save = false;
+
+    std::vector<double> x(nsteps), y(nsteps);
+    for(unsigned int i = 0; i < nsteps; ++i)
+    {
+        x[i] = nsteps > 1 ? low + (high - low) * i / (nsteps - 1) : low;
+        for(const auto& s : vg_samples)
+        {
+            s->SetGroupVelocity(x[i]);
+            s->FillDataHist();
+        }
+        InvalidateCache();
+
+        m_fitter->SetVariableValues(best.data());
+        if(!m_fitter->Minimize())
+            std::cout << WAR << "Fit did not converge for group velocity " << x[i] << " m/ns." << std::endl;
+        y[i] = m_fitter->MinValue();
+        std::cout << TAG << "Group velocity " << x[i] << " m/ns, chi2 = " << y[i] << std::endl;
+    }
+
+    // best group velocity and error from the parabola through the lowest step and its neighbours
+    const int imin = std::min_element(y.begin(), y.end()) - y.begin();
+    const int i0 = std::max(0, std::min<int>(imin - 1, nsteps - 3));
+    double vg_best = x[imin], vg_err = -1;
+    if(nsteps >= 3)
+    {
+        const double d1 = (y[i0 + 1] - y[i0]) / (x[i0 + 1] - x[i0]);
+        const double d2 = (y[i0 + 2] - y[i0 + 1]) / (x[i0 + 2] - x[i0 + 1]);
+        const double a = (d2 - d1) / (x[i0 + 2] - x[i0]);
+        if(a > 0)
+        {
+            vg_best = 0.5 * (x[i0] + x[i0 + 1]) - d1 / (2 * a);
+            vg_err = 1.0 / std::sqrt(a);
+        }
+    }
+    std::cout << TAG << "Best group velocity = " << vg_best << " +- " << vg_err << " m/ns" << std::endl;
 
-    delete[] x;
-    delete[] y;
+    m_dir->cd();
+    TGraph scan_graph(nsteps, x.data(), y.data());
+    scan_graph.Write("vg_scan");
+    TVectorD vg_result(2);
+    vg_result[0] = vg_best;
+    vg_result[1] = vg_err;
+    vg_result.Write("vg_result");
+
+    for(std::size_t s = 0; s < vg_samples.size(); ++s)
+    {
+        vg_samples[s]->SetGroupVelocity(vg_nominal[s]);
+        vg_samples[s]->FillDataHist();
+    }
+    InvalidateCache();
+    m_fitter->SetVariableValues(best.data());
+    m_save = save;
 }
 
 void Fitter::SaveEventTree(std::vector<std::vector<double>>& res_params)
@@ -621,18 +1309,26 @@ void Fitter::SaveEventTree(std::vector<std::vector<double>>& res_params)
     {
         sampleId = s;
         const unsigned int num_pmts = m_samples[s]->GetNPMTs();
-        const int pmttype = m_samples[s]->GetPMTType();
+        const PMTStore* pmts = m_samples[s]->GetPMTStore();
+
+        // per-class weights of all PMTs in this sample, classes not in the pipeline stay at 1
+        std::vector<std::vector<double>> par_weights(m_fitpara.size(), std::vector<double>(num_pmts, 1.));
+        for(const int j : m_pipeline[s])
+            m_fitpara[j]->GetWeights(pmts, s, res_params[j], par_weights[j]);
+
         for(int i = 0; i < num_pmts; i++)
         {
             AnaEvent* ev = m_samples[s]->GetPMT(i);
             for(size_t j = 0; j < m_fitpara.size(); j++)
-            {
-                if (m_fitpara[j]->GetPMTType()>=0 && m_fitpara[j]->GetPMTType() != pmttype) weight[j] = 1.;
-                else weight[j] = m_fitpara[j]->GetWeight(ev, pmttype, s, i, res_params[j]);
-            }
+                weight[j] = par_weights[j][i];
 
+            // the store weights do not include the classes factorized per bin or compressed
             nPE_data= ev->GetPE();
-            nPE_pred= ev->GetEvWght();
+            nPE_pred= pmts->GetWeight()[i];
+            for(const int j : m_bin_pipeline[s])
+                nPE_pred *= par_weights[j][i];
+            if(m_compressed[s] >= 0)
+                nPE_pred *= par_weights[m_compressed[s]][i];
             R       = ev->GetR();
             costh   = ev->GetCosth();
             cosths  = ev->GetCosths();
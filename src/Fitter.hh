@@ -3,12 +3,15 @@
 
 #include <algorithm>
 #include <cmath>
+#include <condition_variable>
 #include <functional>
 #include <iostream>
 #include <iterator>
+#include <mutex>
 #include <numeric>
 #include <sstream>
 #include <string>
+#include <thread>
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -20,6 +23,7 @@
 #include <TMatrixTSym.h>
 #include <TMatrixDSym.h>
 #include <TRandom3.h>
+#include <TROOT.h>
 #include <TVectorT.h>
 #include <TMath.h>
 
@@ -30,8 +34,17 @@
 #include "AnaSample.hh"
 #include "AnaFitParameters.hh"
 #include "ToyThrower.hh"
+#include "ThreadAffinity.hh"
 #include "ColorOutput.hh"
 
+// What FillSamples recomputes for a sample: nothing, the per-bin inputs only, or the PMT sums and the likelihood
+enum SampleUpdate
+{
+    kSampleCached = 0,
+    kSampleFactor = 1,
+    kSampleFused = 2,
+};
+
 struct MinSettings
 {
     std::string minimizer;
@@ -53,11 +66,24 @@ public:
     ~Fitter();
     void SetDirectory(TDirectory* dirout) { m_dir = dirout; }
     double CalcLikelihood(const double* par);
-    void InitFitter(std::vector<AnaFitParameters*>& fitpara);
+    // chi2 of npoints parameter vectors stored one after the other in points, into out[npoints].
+    // Does not count as minimizer calls and leaves the saved history untouched.
+    // lanes, if given, is the toy lane whose data each point is compared to, see FitToyLanes.
+    void CalcLikelihoodBatch(const double* points, const int npoints, double* out, const int* lanes = nullptr);
+    void InitFitter(std::vector<AnaFitParameters*>& fitpara, const std::vector<AnaSample*>& samples);
 
     void FixParameter(const std::string& par_name, const double& value);
     bool Fit(const std::vector<AnaSample*>& samples, bool stat_fluc=false);
+    // Fits ntoys toys with nlanes minimizations in lockstep. The points requested by all lanes are
+    // evaluated in one pass over the PMTs, a finished lane writes its result to toy_file(toy) and
+    // starts the next toy. Returns false without fitting if the toys change the PMT inputs.
+    bool FitToyLanes(const std::vector<AnaSample*>& samples, const int ntoys, const int nlanes, bool stat_fluc,
+                     const std::function<std::string(int)>& toy_file);
     void ParameterScans(const std::vector<int>& param_list, unsigned int nsteps);
+    // Profile scan of the group velocity of the samples using the group velocity option (see AnaSample::SetGroupVelocity):
+    // the data are rebuilt and the parameters refitted at each of nsteps group velocities in [low, high] (m/ns).
+    // Writes the minimum chi2 as vg_scan and the best group velocity with its error as vg_result.
+    void GroupVelocityScan(double low, double high, unsigned int nsteps);
 
     void SetMinSettings(const MinSettings& ms);
     void SetSeed(int seed);
@@ -69,6 +95,9 @@ public:
         m_save = flag;
     }
     void SetSaveEvents(bool flag = true) { m_save_events = flag; };
+    void SetFastMath(bool flag) { m_fast_math = flag; }
+    // Pin the threads and first touch the PMT columns of each thread in InitFitter
+    void SetAffinity(AffinityPolicy policy) { m_affinity = policy; }
 
     // Declaration of leaf types
     int sampleId;
@@ -109,27 +138,58 @@ public:
     void RunMCMCScan(int step, double stepsize, bool do_force_posdef = true, double force_padd = 1.0E-9, bool do_incompl_chol = false, double dropout_tol = 1.0E-3);
 
 private:
-    double FillSamples(std::vector<std::vector<double>>& new_pars);
+    // new_pars[point][class][par], stat chi2 of every point into chi2_stat
+    void FillSamples(std::vector<std::vector<std::vector<double>>>& new_pars, double* chi2_stat, const int* lanes = nullptr);
+    void SplitParameters(const double* par, std::vector<std::vector<double>>& new_pars) const;
+    void BuildPipeline(const std::vector<AnaSample*>& samples);
+    void InvalidateCache();
     void SaveParams(const std::vector<std::vector<double>>& new_pars);
     void SaveEventHist(bool is_final = false);
     void SaveEventTree(std::vector<std::vector<double>>& par_results);
     void SaveChi2();
+    // Writes the result of a minimization to m_dir, res_pars are the fitted parameters of every class
+    bool SaveFitResult(ROOT::Math::Minimizer* minimizer, std::vector<std::vector<double>>& res_pars);
     void SaveResults(const std::vector<std::vector<double>>& parresults,
                      const std::vector<std::vector<double>>& parerrors);
 
     ROOT::Math::Minimizer* m_fitter;
     ROOT::Math::Functor* m_fcn;
 
+    // Toy minimization of FitToyLanes, runs in its own thread and blocks in its function until
+    // the main thread has evaluated the points of all lanes
+    struct ToyLane
+    {
+        int toy;
+        ROOT::Math::Minimizer* minimizer;
+        ROOT::Math::Functor* fcn;
+        std::thread thread;
+        std::vector<double> x; // point waiting for its chi2
+        double fval;
+        bool waiting;
+        bool done;
+        bool converged;
+    };
+    void StartToyLane(ToyLane& lane, const int index, const int toy, bool stat_fluc);
+    void SaveToyLane(ToyLane& lane, const std::function<std::string(int)>& toy_file);
+    std::mutex m_lane_mutex;
+    std::condition_variable m_lane_ready; // a lane asks for a point or has finished
+    std::condition_variable m_lane_eval;  // the points of the waiting lanes are evaluated
+
     TTree* m_outtree;
     TRandom3* rng;
     TDirectory* m_dir;
     bool m_save;
     bool m_save_events;
+    bool m_stat_fluc; // the data of the last Fit were fluctuated
     bool m_zerosyst;
+    bool m_fast_math;
+    AffinityPolicy m_affinity;
+    bool m_pinned; // threads pinned, each PMT group is reweighted by the thread that owns its memory
     int m_threads;
     int m_npar, m_calls, m_freq;
     std::vector<std::string> par_names;
     std::vector<double> par_prefit;
+    std::vector<double> par_step;
     std::vector<double> par_postfit;
     std::vector<int> par_type;
     std::vector<int> par_pmttype;
@@ -142,6 +202,26 @@ private:
     std::vector<double> vec_chi2_reg;
     std::vector<AnaFitParameters*> m_fitpara;
     std::vector<AnaSample*> m_samples;
+    // indices of the parameter classes applied to each sample, in reweight order
+    std::vector<std::vector<int>> m_pipeline;
+    std::vector<std::vector<int>> m_spline_pipeline;
+    // m_pipeline split into classes reweighted per PMT and classes factorized out of the PMT sums,
+    // the latter with the parameter bin of each sample bin
+    std::vector<std::vector<int>> m_pmt_pipeline;
+    std::vector<std::vector<int>> m_bin_pipeline;
+    std::vector<std::vector<std::vector<int>>> m_bin_map;
+    std::vector<std::vector<double>> m_bin_factor;
+    // geometry classes moving the source and PMTs of each sample, see AnaFitParameters::IsGeometry
+    std::vector<std::vector<int>> m_geo_pipeline;
+    // time resolution classes smearing the template of each sample, see AnaFitParameters::IsTimeSmear
+    std::vector<std::vector<int>> m_smear_pipeline;
+    // attenuation class evaluated from compressed R moments in each sample, -1 if none
+    std::vector<int> m_compressed;
+    std::vector<std::vector<double>> m_bin_direct;
+    // dirty tracking between successive likelihood calls
+    std::vector<bool> m_par_changed;
+    std::vector<bool> m_sample_cached;
+    std::vector<double> m_sample_llh;
 
     MinSettings min_settings;
 
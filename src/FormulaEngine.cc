@@ -0,0 +1,592 @@
+#include "FormulaEngine.hh"
+
+namespace
+{
+    // Operand accessors of the block loops, the instruction kinds are resolved once per block
+    struct ColArg
+    {
+        const pmt_real* p;
+        inline double operator[](const int i) const { return p[i]; }
+    };
+
+    struct RegArg
+    {
+        const double* p;
+        inline double operator[](const int i) const { return p[i]; }
+    };
+
+    struct ScalarArg
+    {
+        double v;
+        inline double operator[](const int i) const { return v; }
+    };
+
+    struct BlockContext
+    {
+        const pmt_real* cols[FormulaEngine::kNumColumns];
+        const double* regs;
+        const double* scalars;
+    };
+
+    template <typename M, typename A, typename B>
+    void BinaryLoop(const int op, const A a, const B b, double* out, const int n)
+    {
+        switch(op)
+        {
+            case FormulaEngine::kAdd:
+                for(int i = 0; i < n; ++i) out[i] = a[i] + b[i];
+                break;
+            case FormulaEngine::kSub:
+                for(int i = 0; i < n; ++i) out[i] = a[i] - b[i];
+                break;
+            case FormulaEngine::kMul:
+                for(int i = 0; i < n; ++i) out[i] = a[i] * b[i];
+                break;
+            case FormulaEngine::kDiv:
+                for(int i = 0; i < n; ++i) out[i] = a[i] / b[i];
+                break;
+            case FormulaEngine::kPow:
+                for(int i = 0; i < n; ++i) out[i] = M::Pow(a[i], b[i]);
+                break;
+            case FormulaEngine::kMin:
+                for(int i = 0; i < n; ++i) out[i] = std::min(a[i], b[i]);
+                break;
+            case FormulaEngine::kMax:
+                for(int i = 0; i < n; ++i) out[i] = std::max(a[i], b[i]);
+                break;
+        }
+    }
+
+    template <typename M, typename A>
+    void UnaryLoop(const int op, const A a, double* out, const int n)
+    {
+        switch(op)
+        {
+            case FormulaEngine::kNeg:
+                for(int i = 0; i < n; ++i) out[i] = -a[i];
+                break;
+            case FormulaEngine::kExp:
+                for(int i = 0; i < n; ++i) out[i] = M::Exp(a[i]);
+                break;
+            case FormulaEngine::kLog:
+                for(int i = 0; i < n; ++i) out[i] = M::Log(a[i]);
+                break;
+            case FormulaEngine::kSqrt:
+                for(int i = 0; i < n; ++i) out[i] = std::sqrt(a[i]);
+                break;
+            case FormulaEngine::kAbs:
+                for(int i = 0; i < n; ++i) out[i] = std::fabs(a[i]);
+                break;
+            case FormulaEngine::kCos:
+                for(int i = 0; i < n; ++i) out[i] = std::cos(a[i]);
+                break;
+            case FormulaEngine::kSin:
+                for(int i = 0; i < n; ++i) out[i] = std::sin(a[i]);
+                break;
+            case FormulaEngine::kTan:
+                for(int i = 0; i < n; ++i) out[i] = std::tan(a[i]);
+                break;
+            case FormulaEngine::kAcos:
+                for(int i = 0; i < n; ++i) out[i] = std::acos(a[i]);
+                break;
+            case FormulaEngine::kAsin:
+                for(int i = 0; i < n; ++i) out[i] = std::asin(a[i]);
+                break;
+            case FormulaEngine::kAtan:
+                for(int i = 0; i < n; ++i) out[i] = std::atan(a[i]);
+                break;
+        }
+    }
+
+    template <typename M, typename A>
+    void BinaryB(const int op, const A a, const int kind, const int idx, const BlockContext& c, double* out, const int n)
+    {
+        switch(kind)
+        {
+            case FormulaEngine::kColumnArg:
+                BinaryLoop<M>(op, a, ColArg{c.cols[idx]}, out, n);
+                break;
+            case FormulaEngine::kRegArg:
+                BinaryLoop<M>(op, a, RegArg{c.regs + idx * FORMULA_BLOCK}, out, n);
+                break;
+            case FormulaEngine::kScalarArg:
+                BinaryLoop<M>(op, a, ScalarArg{c.scalars[idx]}, out, n);
+                break;
+        }
+    }
+
+    template <typename M>
+    void Binary(const int op, const int kind_a, const int idx_a, const int kind_b, const int idx_b,
+                const BlockContext& c, double* out, const int n)
+    {
+        switch(kind_a)
+        {
+            case FormulaEngine::kColumnArg:
+                BinaryB<M>(op, ColArg{c.cols[idx_a]}, kind_b, idx_b, c, out, n);
+                break;
+            case FormulaEngine::kRegArg:
+                BinaryB<M>(op, RegArg{c.regs + idx_a * FORMULA_BLOCK}, kind_b, idx_b, c, out, n);
+                break;
+            case FormulaEngine::kScalarArg:
+                BinaryB<M>(op, ScalarArg{c.scalars[idx_a]}, kind_b, idx_b, c, out, n);
+                break;
+        }
+    }
+
+    template <typename M>
+    void Unary(const int op, const int kind, const int idx, const BlockContext& c, double* out, const int n)
+    {
+        switch(kind)
+        {
+            case FormulaEngine::kColumnArg:
+                UnaryLoop<M>(op, ColArg{c.cols[idx]}, out, n);
+                break;
+            case FormulaEngine::kRegArg:
+                UnaryLoop<M>(op, RegArg{c.regs + idx * FORMULA_BLOCK}, out, n);
+                break;
+            case FormulaEngine::kScalarArg:
+                UnaryLoop<M>(op, ScalarArg{c.scalars[idx]}, out, n);
+                break;
+        }
+    }
+}
+
+FormulaEngine::FormulaEngine()
+{
+    Clear();
+}
+
+void FormulaEngine::Clear()
+{
+    m_expr.clear();
+    m_pos = 0;
+    m_error.clear();
+    m_nodes.clear();
+    m_scalar_prog.clear();
+    m_prog.clear();
+    m_nscalars = 0;
+    m_nregs = 0;
+    m_result.kind = kNone;
+    m_result.idx = 0;
+    m_max_par = -1;
+    m_use_parbin = false;
+}
+
+bool FormulaEngine::Compile(const std::string& expr, std::string& error)
+{
+    Clear();
+    m_expr = expr;
+
+    const int root = ParseExpr();
+    SkipSpace();
+    if(root >= 0 && m_pos < m_expr.size())
+        Fail("unexpected '" + m_expr.substr(m_pos, 1) + "'");
+    if(!m_error.empty())
+    {
+        error = m_error;
+        const std::string expression = m_expr;
+        Clear();
+        m_expr = expression;
+        return false;
+    }
+
+    m_result = Emit(root);
+    m_nodes.clear();
+
+    std::cout << TAG << "Compiled \"" << m_expr << "\" into " << m_scalar_prog.size() << " scalar and "
+              << m_prog.size() << " block instructions." << std::endl;
+    return true;
+}
+
+void FormulaEngine::Fail(const std::string& msg)
+{
+    if(m_error.empty())
+        m_error = msg + " at position " + std::to_string(m_pos) + " of \"" + m_expr + "\"";
+}
+
+void FormulaEngine::SkipSpace()
+{
+    while(m_pos < m_expr.size() && std::isspace(m_expr[m_pos]))
+        m_pos++;
+}
+
+int FormulaEngine::AddNode(const int op, const double value, const int index, const int a, const int b)
+{
+    if((a >= 0 && m_nodes[a].op == kConst) && (b < 0 || m_nodes[b].op == kConst) && op >= kAdd)
+    {
+        // fold constant subexpressions
+        const double v = ScalarOp<fastmath::StdMath>(op, m_nodes[a].value, b >= 0 ? m_nodes[b].value : 0.0);
+        return AddNode(kConst, v, 0, -1, -1);
+    }
+
+    // drop the identities x+0, x-0, x*1, x/1, 0+x, 1*x
+    const bool const_a = a >= 0 && m_nodes[a].op == kConst;
+    const bool const_b = b >= 0 && m_nodes[b].op == kConst;
+    if(const_b && ((m_nodes[b].value == 0.0 && (op == kAdd || op == kSub)) || (m_nodes[b].value == 1.0 && (op == kMul || op == kDiv))))
+        return a;
+    if(const_a && ((m_nodes[a].value == 0.0 && op == kAdd) || (m_nodes[a].value == 1.0 && op == kMul)))
+        return b;
+
+    Node node;
+    node.op = op;
+    node.value = value;
+    node.index = index;
+    node.arg[0] = a;
+    node.arg[1] = b;
+    if(op == kConst || op == kPar || op == kZ0)
+        node.uniform = true;
+    else if(op == kColumn || op == kParBin)
+        node.uniform = false;
+    else
+        node.uniform = m_nodes[a].uniform && (b < 0 || m_nodes[b].uniform);
+
+    m_nodes.push_back(node);
+    return m_nodes.size() - 1;
+}
+
+int FormulaEngine::ParseExpr()
+{
+    int lhs = ParseTerm();
+    while(lhs >= 0)
+    {
+        SkipSpace();
+        if(m_pos >= m_expr.size() || (m_expr[m_pos] != '+' && m_expr[m_pos] != '-'))
+            break;
+        const int op = m_expr[m_pos++] == '+' ? kAdd : kSub;
+        const int rhs = ParseTerm();
+        if(rhs < 0)
+            return -1;
+        lhs = AddNode(op, 0, 0, lhs, rhs);
+    }
+    return lhs;
+}
+
+int FormulaEngine::ParseTerm()
+{
+    int lhs = ParseUnary();
+    while(lhs >= 0)
+    {
+        SkipSpace();
+        if(m_pos >= m_expr.size() || (m_expr[m_pos] != '*' && m_expr[m_pos] != '/'))
+            break;
+        const int op = m_expr[m_pos++] == '*' ? kMul : kDiv;
+        const int rhs = ParseUnary();
+        if(rhs < 0)
+            return -1;
+        lhs = AddNode(op, 0, 0, lhs, rhs);
+    }
+    return lhs;
+}
+
+int FormulaEngine::ParseUnary()
+{
+    SkipSpace();
+    if(m_pos < m_expr.size() && (m_expr[m_pos] == '-' || m_expr[m_pos] == '+'))
+    {
+        const bool neg = m_expr[m_pos++] == '-';
+        const int arg = ParseUnary();
+        if(arg < 0)
+            return -1;
+        return neg ? AddNode(kNeg, 0, 0, arg, -1) : arg;
+    }
+    return ParsePower();
+}
+
+int FormulaEngine::ParsePower()
+{
+    // right associative, binds tighter than unary minus: -x^2 = -(x^2)
+    const int base = ParsePrimary();
+    if(base < 0)
+        return -1;
+    SkipSpace();
+    if(m_pos < m_expr.size() && m_expr[m_pos] == '^')
+    {
+        m_pos++;
+        const int exponent = ParseUnary();
+        if(exponent < 0)
+            return -1;
+        return AddNode(kPow, 0, 0, base, exponent);
+    }
+    return base;
+}
+
+int FormulaEngine::ParsePrimary()
+{
+    SkipSpace();
+    if(m_pos >= m_expr.size())
+    {
+        Fail("unexpected end of expression");
+        return -1;
+    }
+
+    const char c = m_expr[m_pos];
+    if(std::isdigit(c) || c == '.')
+    {
+        const char* begin = m_expr.c_str() + m_pos;
+        char* end = nullptr;
+        const double value = std::strtod(begin, &end);
+        if(end == begin)
+        {
+            Fail("invalid number");
+            return -1;
+        }
+        m_pos += end - begin;
+        return AddNode(kConst, value, 0, -1, -1);
+    }
+
+    if(c == '(')
+    {
+        m_pos++;
+        const int n = ParseExpr();
+        SkipSpace();
+        if(n < 0)
+            return -1;
+        if(m_pos >= m_expr.size() || m_expr[m_pos] != ')')
+        {
+            Fail("missing ')'");
+            return -1;
+        }
+        m_pos++;
+        return n;
+    }
+
+    if(c == '[')
+    {
+        m_pos++;
+        SkipSpace();
+        std::size_t len = 0;
+        while(m_pos + len < m_expr.size() && std::isdigit(m_expr[m_pos + len]))
+            len++;
+        if(len == 0)
+        {
+            Fail("expected a parameter index");
+            return -1;
+        }
+        const int index = std::stoi(m_expr.substr(m_pos, len));
+        m_pos += len;
+        SkipSpace();
+        if(m_pos >= m_expr.size() || m_expr[m_pos] != ']')
+        {
+            Fail("missing ']'");
+            return -1;
+        }
+        m_pos++;
+        m_max_par = std::max(m_max_par, index);
+        return AddNode(kPar, 0, index, -1, -1);
+    }
+
+    if(std::isalpha(c) || c == '_')
+    {
+        std::size_t len = 0;
+        while(m_pos + len < m_expr.size() && (std::isalnum(m_expr[m_pos + len]) || m_expr[m_pos + len] == '_'))
+            len++;
+        const std::string name = m_expr.substr(m_pos, len);
+        m_pos += len;
+        SkipSpace();
+
+        if(m_pos < m_expr.size() && m_expr[m_pos] == '(')
+        {
+            static const std::vector<std::pair<std::string, int>> unary = {
+                {"exp", kExp}, {"log", kLog}, {"sqrt", kSqrt}, {"abs", kAbs}, {"fabs", kAbs}, {"cos", kCos},
+                {"sin", kSin}, {"tan", kTan}, {"acos", kAcos}, {"asin", kAsin}, {"atan", kAtan}};
+            static const std::vector<std::pair<std::string, int>> binary = {
+                {"pow", kPow}, {"min", kMin}, {"max", kMax}};
+
+            int op = -1;
+            int nargs = 0;
+            for(const auto& f : unary)
+                if(f.first == name) { op = f.second; nargs = 1; }
+            for(const auto& f : binary)
+                if(f.first == name) { op = f.second; nargs = 2; }
+            if(op < 0)
+            {
+                Fail("unknown function " + name);
+                return -1;
+            }
+
+            m_pos++;
+            int args[2] = {-1, -1};
+            for(int k = 0; k < nargs; ++k)
+            {
+                args[k] = ParseExpr();
+                if(args[k] < 0)
+                    return -1;
+                SkipSpace();
+                const char sep = k + 1 < nargs ? ',' : ')';
+                if(m_pos >= m_expr.size() || m_expr[m_pos] != sep)
+                {
+                    Fail(std::string("expected '") + sep + "' in " + name + "()");
+                    return -1;
+                }
+                m_pos++;
+            }
+            return AddNode(op, 0, 0, args[0], args[1]);
+        }
+
+        static const std::vector<std::pair<std::string, int>> columns = {
+            {"R", kColR}, {"omega", kColOmega}, {"eff", kColEff}, {"dz", kColDz},
+            {"costh", kColCosth}, {"cosths", kColCosths}, {"phis", kColPhis}};
+        for(const auto& col : columns)
+            if(col.first == name)
+                return AddNode(kColumn, 0, col.second, -1, -1);
+        if(name == "z0")
+            return AddNode(kZ0, 0, 0, -1, -1);
+        if(name == "pi")
+            return AddNode(kConst, M_PI, 0, -1, -1);
+        if(name == "par")
+        {
+            m_use_parbin = true;
+            return AddNode(kParBin, 0, 0, -1, -1);
+        }
+
+        Fail("unknown variable " + name);
+        return -1;
+    }
+
+    Fail(std::string("unexpected '") + c + "'");
+    return -1;
+}
+
+FormulaEngine::Operand FormulaEngine::Emit(const int n)
+{
+    const Node node = m_nodes[n];
+    Operand res;
+
+    if(node.op == kColumn)
+    {
+        res.kind = kColumnArg;
+        res.idx = node.index;
+        return res;
+    }
+
+    Instr ins;
+    ins.op = node.op;
+    ins.value = node.value;
+    ins.index = node.index;
+    ins.a.kind = kNone;
+    ins.a.idx = 0;
+    ins.b = ins.a;
+    if(node.arg[0] >= 0)
+        ins.a = Emit(node.arg[0]);
+    if(node.arg[1] >= 0)
+        ins.b = Emit(node.arg[1]);
+
+    if(node.uniform)
+    {
+        res.kind = kScalarArg;
+        res.idx = m_nscalars++;
+        ins.dst = res.idx;
+        m_scalar_prog.push_back(ins);
+    }
+    else
+    {
+        res.kind = kRegArg;
+        res.idx = m_nregs++;
+        ins.dst = res.idx;
+        m_prog.push_back(ins);
+    }
+    return res;
+}
+
+template <typename M>
+double FormulaEngine::ScalarOp(const int op, const double a, const double b)
+{
+    switch(op)
+    {
+        case kAdd:  return a + b;
+        case kSub:  return a - b;
+        case kMul:  return a * b;
+        case kDiv:  return a / b;
+        case kPow:  return M::Pow(a, b);
+        case kMin:  return std::min(a, b);
+        case kMax:  return std::max(a, b);
+        case kNeg:  return -a;
+        case kExp:  return M::Exp(a);
+        case kLog:  return M::Log(a);
+        case kSqrt: return std::sqrt(a);
+        case kAbs:  return std::fabs(a);
+        case kCos:  return std::cos(a);
+        case kSin:  return std::sin(a);
+        case kTan:  return std::tan(a);
+        case kAcos: return std::acos(a);
+        case kAsin: return std::asin(a);
+        case kAtan: return std::atan(a);
+    }
+    return 0.0;
+}
+
+void FormulaEngine::EvalBlock(const double* par, const PMTStore& pmts, const int* bins, const int begin, const int n,
+                              double* out, const bool fast_math) const
+{
+    if(fast_math)
+        Run<fastmath::ApproxMath>(par, pmts, bins, begin, n, out);
+    else
+        Run<fastmath::StdMath>(par, pmts, bins, begin, n, out);
+}
+
+template <typename M>
+void FormulaEngine::Run(const double* par, const PMTStore& pmts, const int* bins, const int begin, const int n,
+                        double* out) const
+{
+    // registers of the calling thread, the engine itself is shared by all threads
+    static thread_local std::vector<double> regs;
+    static thread_local std::vector<double> scalars;
+    if(regs.size() < (std::size_t)m_nregs * FORMULA_BLOCK)
+        regs.resize((std::size_t)m_nregs * FORMULA_BLOCK);
+    if(scalars.size() < (std::size_t)m_nscalars)
+        scalars.resize(m_nscalars);
+
+    for(const Instr& ins : m_scalar_prog)
+    {
+        if(ins.op == kConst)
+            scalars[ins.dst] = ins.value;
+        else if(ins.op == kPar)
+            scalars[ins.dst] = par[ins.index];
+        else if(ins.op == kZ0)
+            scalars[ins.dst] = pmts.GetZ0();
+        else
+            scalars[ins.dst] = ScalarOp<M>(ins.op, scalars[ins.a.idx], ins.b.kind == kNone ? 0.0 : scalars[ins.b.idx]);
+    }
+
+    BlockContext c;
+    c.cols[kColR] = pmts.GetR() + begin;
+    c.cols[kColOmega] = pmts.GetOmega() + begin;
+    c.cols[kColEff] = pmts.GetEff() + begin;
+    c.cols[kColDz] = pmts.GetDz() + begin;
+    c.cols[kColCosth] = pmts.GetCosth() + begin;
+    c.cols[kColCosths] = pmts.GetCosths() + begin;
+    c.cols[kColPhis] = pmts.GetPhis() + begin;
+    c.regs = regs.data();
+    c.scalars = scalars.data();
+
+    for(const Instr& ins : m_prog)
+    {
+        double* dst = regs.data() + ins.dst * FORMULA_BLOCK;
+        if(ins.op == kParBin)
+        {
+            const int* b = bins + begin;
+            for(int i = 0; i < n; ++i)
+                dst[i] = b[i] >= 0 ? par[b[i]] : 0.0;
+        }
+        else if(ins.b.kind != kNone)
+            Binary<M>(ins.op, ins.a.kind, ins.a.idx, ins.b.kind, ins.b.idx, c, dst, n);
+        else
+            Unary<M>(ins.op, ins.a.kind, ins.a.idx, c, dst, n);
+    }
+
+    switch(m_result.kind)
+    {
+        case kColumnArg:
+            for(int i = 0; i < n; ++i) out[i] = c.cols[m_result.idx][i];
+            break;
+        case kRegArg:
+            std::copy(c.regs + m_result.idx * FORMULA_BLOCK, c.regs + m_result.idx * FORMULA_BLOCK + n, out);
+            break;
+        case kScalarArg:
+            std::fill(out, out + n, scalars[m_result.idx]);
+            break;
+        default:
+            std::fill(out, out + n, 1.0);
+            break;
+    }
+}
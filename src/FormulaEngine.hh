@@ -0,0 +1,140 @@
+#ifndef __FormulaEngine_hh__
+#define __FormulaEngine_hh__
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "FastMath.hh"
+#include "PMTStore.hh"
+#include "ColorOutput.hh"
+
+// PMTs evaluated per pass of the formula program, small enough for the registers to stay in L1
+const int FORMULA_BLOCK = 256;
+
+// Per-PMT factor given as a formula in the config, compiled once into a register program.
+//   Variables : R, omega, eff, dz, costh, cosths, phis (PMTStore columns), z0 (source z)
+//   Parameters: par = parameter of the PMT's bin, [k] = parameter k of the class
+//   Operators : + - * / ^ and unary -, constant pi
+//   Functions : exp log sqrt abs cos sin tan acos asin atan pow(x,y) min(x,y) max(x,y)
+// Constant subexpressions are folded, the ones depending only on constants, [k] and z0 are evaluated
+// once per block as scalars. Every other instruction runs as a plain loop over a block of PMTs,
+// so the interpreter dispatch is paid once per block and the loops vectorize like a hand-written kernel.
+class FormulaEngine
+{
+public:
+    FormulaEngine();
+
+    // Returns false and fills error if expr cannot be parsed
+    bool Compile(const std::string& expr, std::string& error);
+    void Clear();
+
+    // out[i] = formula of PMT begin+i for i in [0,n), n <= FORMULA_BLOCK
+    void EvalBlock(const double* par, const PMTStore& pmts, const int* bins, const int begin, const int n,
+                   double* out, const bool fast_math) const;
+
+    // Multiplies wght[i] by the formula of PMT i for i in [begin,end) with bins[i] >= 0
+    template <typename T>
+    void Apply(const double* par, const PMTStore& pmts, const int* bins, T* wght, const int begin, const int end,
+               const bool fast_math) const
+    {
+        double out[FORMULA_BLOCK];
+        for(int b0 = begin; b0 < end; b0 += FORMULA_BLOCK)
+        {
+            const int n = std::min(FORMULA_BLOCK, end - b0);
+            EvalBlock(par, pmts, bins, b0, n, out, fast_math);
+            for(int i = 0; i < n; ++i)
+            {
+                if(bins[b0 + i] < 0) continue;
+                wght[b0 + i] *= out[i];
+            }
+        }
+    }
+
+    inline bool IsEmpty() const { return m_result.kind == kNone; }
+    inline const std::string& GetExpression() const { return m_expr; }
+    // Largest [k] index in the formula, -1 if none
+    inline int GetMaxParIndex() const { return m_max_par; }
+    inline bool UsesBinParameter() const { return m_use_parbin; }
+    inline int GetNInstructions() const { return m_prog.size(); }
+
+    enum Op
+    {
+        kConst, kPar, kParBin, kColumn, kZ0,
+        kAdd, kSub, kMul, kDiv, kPow, kMin, kMax,
+        kNeg, kExp, kLog, kSqrt, kAbs, kCos, kSin, kTan, kAcos, kAsin, kAtan
+    };
+
+    enum Column
+    {
+        kColR, kColOmega, kColEff, kColDz, kColCosth, kColCosths, kColPhis, kNumColumns
+    };
+
+    // Operand of an instruction: a PMTStore column, a block register or a scalar slot
+    enum OperandKind { kNone, kColumnArg, kRegArg, kScalarArg };
+
+private:
+    // Syntax tree built by the parser, children refer to other nodes by index
+    struct Node
+    {
+        int op;
+        double value; // kConst
+        int index;    // kPar parameter, kColumn column
+        int arg[2];
+        bool uniform; // same value for every PMT
+    };
+
+    struct Operand
+    {
+        int kind;
+        int idx;
+    };
+
+    struct Instr
+    {
+        int op;
+        int dst;
+        Operand a, b;
+        double value; // kConst
+        int index;    // kPar
+    };
+
+    // recursive descent parser
+    int ParseExpr();
+    int ParseTerm();
+    int ParseUnary();
+    int ParsePower();
+    int ParsePrimary();
+    int AddNode(const int op, const double value, const int index, const int a, const int b);
+    void SkipSpace();
+    void Fail(const std::string& msg);
+
+    Operand Emit(const int n);
+
+    template <typename M>
+    static double ScalarOp(const int op, const double a, const double b);
+    template <typename M>
+    void Run(const double* par, const PMTStore& pmts, const int* bins, const int begin, const int n, double* out) const;
+
+    std::string m_expr;
+    std::size_t m_pos;
+    std::string m_error;
+    std::vector<Node> m_nodes;
+
+    std::vector<Instr> m_scalar_prog; // scalar slots, run once per block
+    std::vector<Instr> m_prog;        // block registers
+    int m_nscalars;
+    int m_nregs;
+    Operand m_result;
+    int m_max_par;
+    bool m_use_parbin;
+
+    const std::string TAG = color::GREEN_STR + "[FormulaEngine]: " + color::RESET_STR;
+    const std::string ERR = color::RED_STR + "[FormulaEngine ERROR]: " + color::RESET_STR;
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include "GridEngine.hh"
+
+namespace
+{
+    // rows summed per block, the partial sums stay in registers and L1
+    const int GRID_BLOCK = 256;
+}
+
+GridEngine::GridEngine()
+    : m_mode(SplineEngine::kLinear)
+    , m_nrows(0)
+    , m_npoints(0)
+{
+}
+
+void GridEngine::Clear()
+{
+    m_nrows = 0;
+    m_npoints = 0;
+    m_cardinal.clear();
+    m_stride.clear();
+    m_value.clear();
+}
+
+void GridEngine::Init(const std::vector<std::vector<double>>& knots, const int nrows, const int mode)
+{
+    Clear();
+
+    if(knots.empty())
+    {
+        std::cerr << ERR << "In Init()\n"
+                  << "Need at least one dimension" << std::endl;
+        return;
+    }
+    for(std::size_t d = 0; d < knots.size(); ++d)
+    {
+        if(knots[d].size() < 2)
+        {
+            std::cerr << ERR << "In Init()\n"
+                      << "Need at least two knots in dimension " << d << ", got " << knots[d].size() << std::endl;
+            return;
+        }
+    }
+
+    m_mode = mode;
+    const int ndim = knots.size();
+    m_cardinal.resize(ndim);
+    m_stride.assign(ndim, 1);
+    m_npoints = 1;
+    for(int d = ndim - 1; d >= 0; --d)
+    {
+        const int nknots = knots[d].size();
+        m_stride[d] = m_npoints;
+        m_npoints *= nknots;
+
+        m_cardinal[d].Init(knots[d], nknots, m_mode);
+        std::vector<double> unit(nknots, 0.0);
+        for(int k = 0; k < nknots; ++k)
+        {
+            unit[k] = 1.0;
+            m_cardinal[d].SetSpline(k, unit.data());
+            unit[k] = 0.0;
+        }
+    }
+
+    // flat grids until SetRow is called
+    m_nrows = nrows;
+    m_value.assign((std::size_t)m_npoints * m_nrows, 1.0);
+
+    const double mem_kb = sizeof(pmt_real) * m_value.size() / 1000.0;
+    std::cout << TAG << "Allocated " << m_nrows << " grids of " << m_npoints << " points in " << ndim << " dimensions, "
+              << mem_kb << " kB." << std::endl;
+}
+
+void GridEngine::SetRow(const int idx, const double* y)
+{
+    for(int k = 0; k < m_npoints; ++k)
+        m_value[(std::size_t)k * m_nrows + idx] = y[k];
+}
+
+void GridEngine::Basis(const double* x, std::vector<int>& point, std::vector<double>& weight) const
+{
+    point.assign(1, 0);
+    weight.assign(1, 1.0);
+
+    std::vector<double> c;
+    std::vector<int> next_point;
+    std::vector<double> next_weight;
+    for(std::size_t d = 0; d < m_cardinal.size(); ++d)
+    {
+        // weights of the knots of dimension d, zero away from the segment for linear interpolation
+        const int nknots = m_cardinal[d].GetNKnots();
+        c.assign(nknots, 1.0);
+        m_cardinal[d].Scale(x[d], c.data(), 0, nknots);
+
+        next_point.clear();
+        next_weight.clear();
+        for(std::size_t t = 0; t < point.size(); ++t)
+        {
+            for(int k = 0; k < nknots; ++k)
+            {
+                if(c[k] == 0.0)
+                    continue;
+                next_point.push_back(point[t] + k * m_stride[d]);
+                next_weight.push_back(weight[t] * c[k]);
+            }
+        }
+        point.swap(next_point);
+        weight.swap(next_weight);
+    }
+}
+
+void GridEngine::Scale(const double* x, double* out, const int begin, const int end) const
+{
+    std::vector<int> point;
+    std::vector<double> weight;
+    Basis(x, point, weight);
+    const int nterm = point.size();
+
+    double acc[GRID_BLOCK];
+    for(int b0 = begin; b0 < end; b0 += GRID_BLOCK)
+    {
+        const int n = std::min(GRID_BLOCK, end - b0);
+        std::fill(acc, acc + n, 0.0);
+        for(int t = 0; t < nterm; ++t)
+        {
+            const pmt_real* v = m_value.data() + (std::size_t)point[t] * m_nrows + b0;
+            const double w = weight[t];
+#pragma omp simd
+            for(int i = 0; i < n; ++i)
+                acc[i] += w * v[i];
+        }
+#pragma omp simd
+        for(int i = 0; i < n; ++i)
+            out[b0 + i] *= acc[i];
+    }
+}
+
+double GridEngine::Eval(const int idx, const double* x) const
+{
+    std::vector<int> point;
+    std::vector<double> weight;
+    Basis(x, point, weight);
+
+    double val = 0.0;
+    for(std::size_t t = 0; t < point.size(); ++t)
+        val += weight[t] * m_value[(std::size_t)point[t] * m_nrows + idx];
+    return val;
+}
@@ -0,0 +1,60 @@
+#ifndef __GridEngine_hh__
+#define __GridEngine_hh__
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "AlignedAllocator.hh"
+#include "PMTStore.hh"
+#include "SplineEngine.hh"
+#include "ColorOutput.hh"
+
+// Evaluates many N-dimensional response grids that share the same knots in every dimension,
+// with the tensor product of the 1D interpolation of SplineEngine (linear or natural cubic, linear extrapolation).
+// The 1D interpolation is linear in the values at the knots, y(x) = sum_k c_k(x) y_k, so the weights c_k(x)
+// of each dimension are computed once per call from the cardinal splines of its knots, and every grid is
+//   f(x) = sum_{k_1..k_N} c_{k_1}(x_1)...c_{k_N}(x_N) y_{k_1..k_N}.
+// The values are packed grid point by grid point, so a call streams one contiguous block per non-zero weight:
+// 2^N blocks for linear interpolation, all grid points for cubic.
+class GridEngine
+{
+public:
+    GridEngine();
+
+    // knots[d] are the knots of dimension d, mode is SplineEngine::kLinear or kCubic
+    void Init(const std::vector<std::vector<double>>& knots, const int nrows, const int mode = SplineEngine::kLinear);
+    void Clear();
+
+    // y are the values of grid idx at the grid points, last dimension fastest
+    void SetRow(const int idx, const double* y);
+
+    // Multiplies out[i] by the value of grid i at x[0..N), for i in [begin,end)
+    void Scale(const double* x, double* out, const int begin, const int end) const;
+    double Eval(const int idx, const double* x) const;
+
+    inline bool IsEmpty() const { return m_nrows == 0; }
+    inline int GetNRows() const { return m_nrows; }
+    inline int GetNDim() const { return m_cardinal.size(); }
+    inline int GetNPoints() const { return m_npoints; }
+    inline int GetMode() const { return m_mode; }
+
+private:
+    // grid points with a non-zero weight at x, and their weights
+    void Basis(const double* x, std::vector<int>& point, std::vector<double>& weight) const;
+
+    int m_mode;
+    int m_nrows;
+    int m_npoints;
+
+    std::vector<SplineEngine> m_cardinal; // spline k of dimension d is 1 at knot k and 0 at the others
+    std::vector<int> m_stride;
+    AlignedVector<pmt_real> m_value; // [grid point][row]
+
+    const std::string TAG = color::GREEN_STR + "[GridEngine]: " + color::RESET_STR;
+    const std::string ERR = color::RED_STR + "[GridEngine ERROR]: " + color::RESET_STR;
+};
+
+#endif
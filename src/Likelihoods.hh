@@ -1,6 +1,7 @@
 #ifndef LIKELIHOODS_HH
 #define LIKELIHOODS_HH
 
+#include <algorithm>
 #include <cmath>
 #include <fstream>
 #include <iomanip>
@@ -9,14 +10,98 @@
 #include <string>
 #include <vector>
 
+#include "FastMath.hh"
+#include "PairwiseSum.hh"
+
+// Per-bin terms of the likelihood that only depend on the data.
+// Built once per data fill, the bins with zero data are kept in a separate list
+// since their likelihood reduces to a much cheaper expression.
+struct LLHDataCache
+{
+    std::vector<double> data;
+    std::vector<double> dlogd;     // data*log(data)
+    std::vector<double> lgamma_k1; // lgamma(data+1)
+    std::vector<int> nonzero;      // bins with data > 0
+    std::vector<int> zero;         // bins with data <= 0
+
+    void Build(const double* val, const int nbins)
+    {
+        data.assign(val, val + nbins);
+        dlogd.assign(nbins, 0.0);
+        lgamma_k1.assign(nbins, 0.0);
+        nonzero.clear();
+        zero.clear();
+        for(int i = 0; i < nbins; ++i)
+        {
+            if(data[i] > 0.0)
+            {
+                dlogd[i] = data[i] * std::log(data[i]);
+                lgamma_k1[i] = std::lgamma(data[i] + 1);
+                nonzero.push_back(i);
+            }
+            else
+                zero.push_back(i);
+        }
+    }
+};
+
+// Bins per call of the batch interface, used to split the bins among threads
+const int LLH_BLOCK_SIZE = 256;
+
 class CalcLLHFunc
 {
 public:
+    CalcLLHFunc() : m_fast_math(false) {};
     virtual ~CalcLLHFunc() {};
     virtual double operator()(double mc, double w2, double data)
     {
         return 0.0;
     }
+
+    // Batch interface over contiguous bin arrays.
+    // SumNonZero runs over cache.nonzero[begin,end), SumZero over cache.zero[begin,end).
+    // The loops are written without calls to virtual functions, so the compiler can vectorize them.
+    virtual double SumNonZero(const double* mc, const double* w2, const LLHDataCache& cache, int begin, int end) const
+    {
+        return 0.0;
+    }
+    virtual double SumZero(const double* mc, const double* w2, const LLHDataCache& cache, int begin, int end) const
+    {
+        return 0.0;
+    }
+
+    // Fixed blocks of LLH_BLOCK_SIZE bins, the nonzero bins first, then the zero bins.
+    // The block sums are combined with PairwiseSum, so the result does not depend on how the blocks are shared among threads.
+    static int NumBlocks(const LLHDataCache& cache)
+    {
+        return (cache.nonzero.size() + LLH_BLOCK_SIZE - 1) / LLH_BLOCK_SIZE
+               + (cache.zero.size() + LLH_BLOCK_SIZE - 1) / LLH_BLOCK_SIZE;
+    }
+
+    double Block(const double* mc, const double* w2, const LLHDataCache& cache, const int blk) const
+    {
+        const int nnz = cache.nonzero.size();
+        const int nblk_nz = (nnz + LLH_BLOCK_SIZE - 1) / LLH_BLOCK_SIZE;
+        if(blk < nblk_nz)
+            return SumNonZero(mc, w2, cache, blk * LLH_BLOCK_SIZE, std::min((blk + 1) * LLH_BLOCK_SIZE, nnz));
+        const int nz = cache.zero.size();
+        const int n = (blk - nblk_nz) * LLH_BLOCK_SIZE;
+        return SumZero(mc, w2, cache, n, std::min(n + LLH_BLOCK_SIZE, nz));
+    }
+
+    double Batch(const double* mc, const double* w2, const LLHDataCache& cache) const
+    {
+        std::vector<double> part(NumBlocks(cache));
+        for(std::size_t blk = 0; blk < part.size(); ++blk)
+            part[blk] = Block(mc, w2, cache, blk);
+        return PairwiseSum(part.data(), part.size());
+    }
+
+    // Use the approximations of FastMath.hh in the batch interface
+    void SetFastMath(bool flag) { m_fast_math = flag; }
+
+protected:
+    bool m_fast_math;
 };
 
 class PoissonLLH : public CalcLLHFunc
@@ -35,6 +120,46 @@ public:
 
         return (chi2 >= 0.0) ? chi2 : 0.0;
     }
+
+    double SumNonZero(const double* mc, const double* w2, const LLHDataCache& cache, int begin, int end) const
+    {
+        return m_fast_math ? SumNonZeroImpl<fastmath::ApproxMath>(mc, w2, cache, begin, end)
+                           : SumNonZeroImpl<fastmath::StdMath>(mc, w2, cache, begin, end);
+    }
+
+    double SumZero(const double* mc, const double* w2, const LLHDataCache& cache, int begin, int end) const
+    {
+        // chi2 = 2*mc without data
+        const int* idx = cache.zero.data();
+        double sum = 0.0;
+#pragma omp simd reduction(+:sum)
+        for(int n = begin; n < end; ++n)
+        {
+            const double m = mc[idx[n]];
+            sum += m > 0.0 ? 2 * m : 0.0;
+        }
+        return sum;
+    }
+
+private:
+    template <typename M>
+    double SumNonZeroImpl(const double* mc, const double* w2, const LLHDataCache& cache, int begin, int end) const
+    {
+        const int* idx = cache.nonzero.data();
+        const double* data = cache.data.data();
+        const double* dlogd = cache.dlogd.data();
+        double sum = 0.0;
+#pragma omp simd reduction(+:sum)
+        for(int n = begin; n < end; ++n)
+        {
+            const int i = idx[n];
+            const double m = mc[i] > 0.0 ? mc[i] : 1.0;
+            double chi2 = 2 * (m - data[i]) + 2 * (dlogd[i] - data[i] * M::Log(m));
+            chi2 = chi2 >= 0.0 ? chi2 : 0.0;
+            sum += mc[i] > 0.0 ? chi2 : 0.0;
+        }
+        return sum;
+    }
 };
 
 class EffLLH : public CalcLLHFunc
@@ -53,6 +178,60 @@ public:
         return -2 * (a * std::log(b) + std::lgamma(k + a) - std::lgamma(k + 1)
                - ((k + a) * std::log1p(b)) - std::lgamma(a));
     }
+
+    double SumNonZero(const double* mc, const double* w2, const LLHDataCache& cache, int begin, int end) const
+    {
+        return m_fast_math ? SumNonZeroImpl<fastmath::ApproxMath>(mc, w2, cache, begin, end)
+                           : SumNonZeroImpl<fastmath::StdMath>(mc, w2, cache, begin, end);
+    }
+
+    double SumZero(const double* mc, const double* w2, const LLHDataCache& cache, int begin, int end) const
+    {
+        return m_fast_math ? SumZeroImpl<fastmath::ApproxMath>(mc, w2, cache, begin, end)
+                           : SumZeroImpl<fastmath::StdMath>(mc, w2, cache, begin, end);
+    }
+
+private:
+    template <typename M>
+    double SumNonZeroImpl(const double* mc, const double* w2, const LLHDataCache& cache, int begin, int end) const
+    {
+        const int* idx = cache.nonzero.data();
+        const double* data = cache.data.data();
+        const double* lgamma_k1 = cache.lgamma_k1.data();
+        double sum = 0.0;
+#pragma omp simd reduction(+:sum)
+        for(int n = begin; n < end; ++n)
+        {
+            const int i = idx[n];
+            if(mc[i] <= 0.0)
+                continue;
+            const double b = mc[i] / w2[i];
+            const double a = (mc[i] * b) + 1.0;
+            const double k = data[i];
+            sum += -2 * (a * M::Log(b) + M::Lgamma(k + a) - lgamma_k1[i]
+                   - ((k + a) * M::Log1p(b)) - M::Lgamma(a));
+        }
+        return sum;
+    }
+
+    template <typename M>
+    double SumZeroImpl(const double* mc, const double* w2, const LLHDataCache& cache, int begin, int end) const
+    {
+        // with k = 0 the lgamma terms cancel
+        const int* idx = cache.zero.data();
+        double sum = 0.0;
+#pragma omp simd reduction(+:sum)
+        for(int n = begin; n < end; ++n)
+        {
+            const int i = idx[n];
+            if(mc[i] <= 0.0)
+                continue;
+            const double b = mc[i] / w2[i];
+            const double a = (mc[i] * b) + 1.0;
+            sum += -2 * a * (M::Log(b) - M::Log1p(b));
+        }
+        return sum;
+    }
 };
 
 class BarlowLLH : public CalcLLHFunc
@@ -90,6 +269,64 @@ public:
 
         return (chi2 >= 0.0) ? chi2 : 0.0;
     }
+
+    double SumNonZero(const double* mc, const double* w2, const LLHDataCache& cache, int begin, int end) const
+    {
+        return m_fast_math ? SumNonZeroImpl<fastmath::ApproxMath>(mc, w2, cache, begin, end)
+                           : SumNonZeroImpl<fastmath::StdMath>(mc, w2, cache, begin, end);
+    }
+
+    double SumZero(const double* mc, const double* w2, const LLHDataCache& cache, int begin, int end) const
+    {
+        // without data the quadratic gives beta = max(1 - mc*rel_var, 0), no sqrt or log needed
+        const int* idx = cache.zero.data();
+        double sum = 0.0;
+#pragma omp simd reduction(+:sum)
+        for(int n = begin; n < end; ++n)
+        {
+            const int i = idx[n];
+            const double rel_var = w2[i] / (mc[i] * mc[i]);
+            const double b       = (mc[i] * rel_var) - 1;
+            const double beta    = b < 0.0 ? -b : 0.0;
+            const double mc_hat  = mc[i] * beta;
+            if(!(mc_hat > 0.0))
+                continue;
+
+            double chi2 = 2 * mc_hat;
+            if(rel_var > 0.0)
+                chi2 += (beta - 1) * (beta - 1) / rel_var;
+            sum += chi2 >= 0.0 ? chi2 : 0.0;
+        }
+        return sum;
+    }
+
+private:
+    template <typename M>
+    double SumNonZeroImpl(const double* mc, const double* w2, const LLHDataCache& cache, int begin, int end) const
+    {
+        const int* idx = cache.nonzero.data();
+        const double* data = cache.data.data();
+        const double* dlogd = cache.dlogd.data();
+        double sum = 0.0;
+#pragma omp simd reduction(+:sum)
+        for(int n = begin; n < end; ++n)
+        {
+            const int i = idx[n];
+            const double rel_var = w2[i] / (mc[i] * mc[i]);
+            const double b       = (mc[i] * rel_var) - 1;
+            const double c       = 4 * data[i] * rel_var;
+            const double beta    = (-b + std::sqrt(b * b + c)) / 2.0;
+            const double mc_hat  = mc[i] * beta;
+            if(!(mc_hat > 0.0))
+                continue;
+
+            double chi2 = 2 * (mc_hat - data[i]) + 2 * (dlogd[i] - data[i] * M::Log(mc_hat));
+            if(rel_var > 0.0)
+                chi2 += (beta - 1) * (beta - 1) / rel_var;
+            sum += chi2 >= 0.0 ? chi2 : 0.0;
+        }
+        return sum;
+    }
 };
 
 #endif
@@ -0,0 +1,347 @@
+#include "PMTStore.hh"
+#include "Carlson.hh"
+
+PMTStore::PMTStore()
+    : m_npmts(0)
+    , m_z0(0.)
+    , m_z0_nom(0.)
+    , m_raw_geom(false)
+    , m_has_source(false)
+    , m_ntbins(0)
+{
+    for(int j = 0; j < 3; ++j)
+        m_src_shift[j] = m_pmt_shift[j] = 0.;
+}
+
+void PMTStore::Clear()
+{
+    m_npmts = 0;
+    m_R.clear();
+    m_omega.clear();
+    m_eff.clear();
+    m_dz.clear();
+    m_costh.clear();
+    m_cosths.clear();
+    m_phis.clear();
+    m_bin.clear();
+    m_raw_geom = false;
+    m_has_source = false;
+    for(int j = 0; j < 3; ++j)
+    {
+        m_pos[j].clear();
+        m_dir[j].clear();
+    }
+    m_radius.clear();
+    m_wght.clear();
+    m_wghtMC.clear();
+    m_pe_indirect.clear();
+    m_pe_indirect_err.clear();
+    m_ntbins = 0;
+    m_tnom.clear();
+    m_tnom_sig2.clear();
+    m_tpred.clear();
+    m_tsmear.clear();
+    m_parbin_name.clear();
+    m_parbin.clear();
+    m_factor.clear();
+    m_parbasis_width.clear();
+    m_parbasis.clear();
+    m_parbasis_len.clear();
+}
+
+void PMTStore::Build(const std::vector<AnaEvent>& pmts)
+{
+    m_npmts = pmts.size();
+    m_z0 = m_npmts > 0 ? pmts[0].GetZ0() : 0.;
+    m_z0_nom = m_z0;
+
+    m_R.resize(m_npmts);
+    m_omega.resize(m_npmts);
+    m_eff.resize(m_npmts);
+    m_dz.resize(m_npmts);
+    m_costh.resize(m_npmts);
+    m_cosths.resize(m_npmts);
+    m_phis.resize(m_npmts);
+    m_bin.resize(m_npmts);
+    m_wght.resize(m_npmts);
+    m_wghtMC.resize(m_npmts);
+    m_pe_indirect.resize(m_npmts);
+    m_pe_indirect_err.resize(m_npmts);
+
+    for(int i = 0; i < m_npmts; ++i)
+    {
+        const AnaEvent& e = pmts[i];
+        m_R[i]      = e.GetR();
+        m_omega[i]  = e.GetOmega();
+        m_eff[i]    = e.GetEff();
+        m_dz[i]     = e.GetDz();
+        m_costh[i]  = e.GetCosth();
+        m_cosths[i] = e.GetCosths();
+        m_phis[i]   = e.GetPhis();
+        m_bin[i]    = e.GetSampleBin();
+        m_wghtMC[i] = e.GetEvWghtMC();
+        m_wght[i]   = e.GetEvWght();
+        m_pe_indirect[i]     = e.GetPEIndirect();
+        m_pe_indirect_err[i] = e.GetPEIndirectErr();
+    }
+
+    m_raw_geom = m_npmts > 0;
+    for(int i = 0; i < m_npmts; ++i)
+        m_raw_geom = m_raw_geom && pmts[i].GetPMTRadius() > 0;
+    for(int j = 0; j < 3; ++j)
+    {
+        m_pos[j].resize(m_raw_geom ? m_npmts : 0);
+        m_dir[j].resize(m_raw_geom ? m_npmts : 0);
+        m_src_shift[j] = m_pmt_shift[j] = 0.;
+    }
+    m_radius.resize(m_raw_geom ? m_npmts : 0);
+    for(int i = 0; i < m_npmts && m_raw_geom; ++i)
+    {
+        for(int j = 0; j < 3; ++j)
+        {
+            m_pos[j][i] = pmts[i].GetPMTPosition(j);
+            m_dir[j][i] = pmts[i].GetPMTOrientation(j);
+        }
+        m_radius[i] = pmts[i].GetPMTRadius();
+    }
+
+    // template and parameter bin index arrays refer to the old PMT list
+    m_ntbins = 0;
+    m_tnom.clear();
+    m_tnom_sig2.clear();
+    m_tpred.clear();
+    m_tsmear.clear();
+    m_parbin_name.clear();
+    m_parbin.clear();
+    m_factor.clear();
+    m_parbasis_width.clear();
+    m_parbasis.clear();
+    m_parbasis_len.clear();
+
+    const double mem_kb = ((m_raw_geom ? 18 : 11) * sizeof(pmt_real) + sizeof(int)) * m_npmts / 1000.0;
+    std::cout << TAG << "Built columnar PMT store of " << m_npmts << " PMTs, " << mem_kb << " kB"
+              << (sizeof(pmt_real) == sizeof(float) ? " in mixed precision." : ".") << std::endl;
+}
+
+template <typename T>
+void PMTStore::FirstTouchCopy(AlignedVector<T>& col, const std::vector<int>& part_begin, const int width)
+{
+    if(col.empty())
+        return;
+
+    // resize(n) of the aligned allocator leaves the new pages untouched
+    AlignedVector<T> fresh;
+    fresh.resize(col.size());
+    const int nparts = part_begin.size() - 1;
+#pragma omp parallel num_threads(nparts)
+    {
+        int tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        // if fewer threads are granted, the first threads also copy the remaining ranges
+        int nteam = 1;
+#ifdef _OPENMP
+        nteam = omp_get_num_threads();
+#endif
+        for(int t = tid; t < nparts; t += nteam)
+        {
+            const std::size_t begin = (std::size_t)part_begin[t] * width;
+            const std::size_t end = (std::size_t)part_begin[t + 1] * width;
+            std::copy(col.begin() + begin, col.begin() + end, fresh.begin() + begin);
+        }
+    }
+    col.swap(fresh);
+}
+
+void PMTStore::Distribute(const std::vector<int>& part_begin)
+{
+    if(part_begin.size() < 2 || part_begin.front() != 0 || part_begin.back() != m_npmts)
+    {
+        std::cerr << ERR << "In Distribute()\n"
+                  << "Partition does not cover the " << m_npmts << " PMTs." << std::endl;
+        return;
+    }
+
+    FirstTouchCopy(m_R, part_begin, 1);
+    FirstTouchCopy(m_omega, part_begin, 1);
+    FirstTouchCopy(m_eff, part_begin, 1);
+    FirstTouchCopy(m_dz, part_begin, 1);
+    FirstTouchCopy(m_costh, part_begin, 1);
+    FirstTouchCopy(m_cosths, part_begin, 1);
+    FirstTouchCopy(m_phis, part_begin, 1);
+    FirstTouchCopy(m_bin, part_begin, 1);
+    for(int j = 0; j < 3; ++j)
+    {
+        FirstTouchCopy(m_pos[j], part_begin, 1);
+        FirstTouchCopy(m_dir[j], part_begin, 1);
+    }
+    FirstTouchCopy(m_radius, part_begin, 1);
+    FirstTouchCopy(m_wght, part_begin, 1);
+    FirstTouchCopy(m_wghtMC, part_begin, 1);
+    FirstTouchCopy(m_pe_indirect, part_begin, 1);
+    FirstTouchCopy(m_pe_indirect_err, part_begin, 1);
+
+    FirstTouchCopy(m_tnom, part_begin, m_ntbins);
+    FirstTouchCopy(m_tnom_sig2, part_begin, m_ntbins);
+    FirstTouchCopy(m_tpred, part_begin, m_ntbins);
+    if(!m_tsmear.empty())
+        FirstTouchCopy(m_tsmear, part_begin, m_ntbins);
+
+    for(std::size_t k = 0; k < m_parbin.size(); ++k)
+    {
+        FirstTouchCopy(m_parbin[k], part_begin, 1);
+        FirstTouchCopy(m_factor[k], part_begin, 1);
+        FirstTouchCopy(m_parbasis[k], part_begin, m_parbasis_width[k]);
+        FirstTouchCopy(m_parbasis_len[k], part_begin, 1);
+    }
+}
+
+void PMTStore::SetGeometryShift(const double* src_shift, const double* pmt_shift)
+{
+    for(int j = 0; j < 3; ++j)
+    {
+        m_src_shift[j] = src_shift[j];
+        m_pmt_shift[j] = pmt_shift[j];
+    }
+    m_z0 = m_z0_nom + src_shift[2];
+}
+
+void PMTStore::UpdateGeometry(const int begin, const int end)
+{
+    if(!CanMoveGeometry())
+        return;
+
+    // PMT position relative to the source is (pos + pmt_shift) - (source + src_shift)
+    double off[3], dir[3], xaxis[3], yaxis[3];
+    for(int j = 0; j < 3; ++j)
+    {
+        off[j] = m_pmt_shift[j] - m_source.pos[j] - m_src_shift[j];
+        dir[j] = m_source.dir[j];
+        xaxis[j] = m_source.xaxis[j];
+        yaxis[j] = m_source.yaxis[j];
+    }
+    const bool exact = m_source.exact_omega;
+
+    const pmt_real* px = m_pos[0].data();
+    const pmt_real* py = m_pos[1].data();
+    const pmt_real* pz = m_pos[2].data();
+    const pmt_real* ox = m_dir[0].data();
+    const pmt_real* oy = m_dir[1].data();
+    const pmt_real* oz = m_dir[2].data();
+    const pmt_real* radius = m_radius.data();
+    pmt_real* R = m_R.data();
+    pmt_real* costh = m_costh.data();
+    pmt_real* cosths = m_cosths.data();
+    pmt_real* phis = m_phis.data();
+    pmt_real* omega = m_omega.data();
+    pmt_real* dz = m_dz.data();
+
+    // same formulas as WCSIM_TreeConvert, computed in double
+#pragma omp simd
+    for(int i = begin; i < end; ++i)
+    {
+        const double rx = px[i] + off[0];
+        const double ry = py[i] + off[1];
+        const double rz = pz[i] + off[2];
+        const double dist = std::sqrt(rx * rx + ry * ry + rz * rz);
+        const double ux = rx / dist;
+        const double uy = ry / dist;
+        const double uz = rz / dist;
+        const double c = -(ux * ox[i] + uy * oy[i] + uz * oz[i]);
+        const double a = radius[i];
+
+        R[i] = dist;
+        costh[i] = c;
+        cosths[i] = ux * dir[0] + uy * dir[1] + uz * dir[2];
+        phis[i] = std::atan2(ux * yaxis[0] + uy * yaxis[1] + uz * yaxis[2], ux * xaxis[0] + uy * xaxis[1] + uz * xaxis[2]);
+        omega[i] = exact ? carlson::DiskSolidAngleR(a, dist, c) : 2 * M_PI * (1 - dist / std::sqrt(dist * dist + a * a));
+        dz[i] = rz;
+    }
+}
+
+void PMTStore::ResetWeights(const int begin, const int end)
+{
+    for(int i = begin; i < end; ++i)
+        m_wght[i] = m_wghtMC[i];
+}
+
+void PMTStore::InitTemplate(const int ntbins)
+{
+    m_ntbins = ntbins;
+    m_tnom.assign(m_npmts * m_ntbins, 0.0);
+    m_tnom_sig2.assign(m_npmts * m_ntbins, 0.0);
+    m_tpred.assign(m_npmts * m_ntbins, 0.0);
+
+    const double mem_kb = 3 * sizeof(double) * m_npmts * m_ntbins / 1000.0;
+    std::cout << TAG << "Allocated timetof template of " << m_ntbins << " bins per PMT, " << mem_kb << " kB." << std::endl;
+}
+
+void PMTStore::InitTemplateSmear()
+{
+    m_tsmear.assign(m_tnom.begin(), m_tnom.end());
+
+    const double mem_kb = sizeof(double) * m_tsmear.size() / 1000.0;
+    std::cout << TAG << "Allocated smeared timetof template, " << mem_kb << " kB." << std::endl;
+}
+
+void PMTStore::ResetTemplatePred(const int begin, const int end)
+{
+    const AlignedVector<double>& src = m_tsmear.empty() ? m_tnom : m_tsmear;
+    std::copy(src.begin() + begin * m_ntbins, src.begin() + end * m_ntbins, m_tpred.begin() + begin * m_ntbins);
+}
+
+int PMTStore::SetParBinIndex(const std::string& name, const std::vector<int>& bins)
+{
+    if(bins.size() != m_npmts)
+    {
+        std::cerr << ERR << "In SetParBinIndex()\n"
+                  << "Size of bin index for " << name << " does not match number of PMTs." << std::endl;
+    }
+
+    for(std::size_t k = 0; k < m_parbin_name.size(); ++k)
+    {
+        if(m_parbin_name[k] == name)
+        {
+            m_parbin[k].assign(bins.begin(), bins.end());
+            m_factor[k].assign(bins.size(), 1.0);
+            m_parbasis_width[k] = 0;
+            m_parbasis[k].clear();
+            m_parbasis_len[k].clear();
+            return k;
+        }
+    }
+
+    m_parbin_name.push_back(name);
+    m_parbin.emplace_back(bins.begin(), bins.end());
+    m_factor.emplace_back(bins.size(), 1.0);
+    m_parbasis_width.push_back(0);
+    m_parbasis.emplace_back();
+    m_parbasis_len.emplace_back();
+
+    return m_parbin.size() - 1;
+}
+
+void PMTStore::SetParBasis(const int slot, const int width, const std::vector<double>& rows, const std::vector<int>& len)
+{
+    if(rows.size() != (std::size_t)m_npmts * width || len.size() != m_npmts)
+    {
+        std::cerr << ERR << "In SetParBasis()\n"
+                  << "Size of basis for " << m_parbin_name[slot] << " does not match number of PMTs." << std::endl;
+        return;
+    }
+
+    m_parbasis_width[slot] = width;
+    m_parbasis[slot].assign(rows.begin(), rows.end());
+    m_parbasis_len[slot].assign(len.begin(), len.end());
+
+    const double mem_kb = (sizeof(pmt_real) * width + sizeof(int)) * m_npmts / 1000.0;
+    std::cout << TAG << "Stored basis of " << m_parbin_name[slot] << " with " << width << " parameters per PMT, " << mem_kb << " kB." << std::endl;
+}
+
+void PMTStore::MultiplyFactor(const int slot, const int begin, const int end)
+{
+    const pmt_real* factor = m_factor[slot].data();
+    for(int i = begin; i < end; ++i)
+        m_wght[i] *= factor[i];
+}
@@ -0,0 +1,171 @@
+#ifndef __PMTStore_hh__
+#define __PMTStore_hh__
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "AlignedAllocator.hh"
+#include "AnaEvent.hh"
+#include "ColorOutput.hh"
+
+// Storage type of the PMT columns, float when built with -DMIXED_PRECISION=1 to halve the memory traffic.
+// Sums over PMTs and the likelihood are always accumulated in double.
+#ifdef MIXED_PRECISION
+typedef float pmt_real;
+#else
+typedef double pmt_real;
+#endif
+
+// Light source position and local frame, written by WCSIM_TreeConvert as the TVectorD source_frame
+struct SourceFrame
+{
+    double pos[3];    // source position (cm)
+    double dir[3];    // source direction, cosths is measured from it
+    double xaxis[3];  // phis = atan2(u.yaxis, u.xaxis) for the unit vector u from the source to the PMT
+    double yaxis[3];
+    bool exact_omega; // omega is the exact off-axis solid angle (WCSIM_TreeConvert -a), else the on-axis one
+};
+
+// Columnar copy of the PMT variables used in the likelihood loop.
+// Each variable lives in its own contiguous, cache-line aligned array,
+// so the reweight loop only streams the columns it actually needs.
+class PMTStore
+{
+public:
+    PMTStore();
+
+    void Build(const std::vector<AnaEvent>& pmts);
+    void Clear();
+
+    inline int GetNPMTs() const { return m_npmts; }
+
+    // Reallocate every column so that PMTs [part_begin[t], part_begin[t+1]) are first written by thread t.
+    // With pinned threads the pages of each range then live on the memory node of the thread that reads them.
+    void Distribute(const std::vector<int>& part_begin);
+
+    // Geometry columns
+    inline const pmt_real* GetR() const { return m_R.data(); }
+    inline const pmt_real* GetOmega() const { return m_omega.data(); }
+    inline const pmt_real* GetEff() const { return m_eff.data(); }
+    inline const pmt_real* GetDz() const { return m_dz.data(); }
+    inline const pmt_real* GetCosth() const { return m_costh.data(); }
+    inline const pmt_real* GetCosths() const { return m_cosths.data(); }
+    inline const pmt_real* GetPhis() const { return m_phis.data(); }
+    inline double GetZ0() const { return m_z0; }
+    inline const int* GetSampleBin() const { return m_bin.data(); }
+
+    inline void SetEff(const int i, const double val) { m_eff[i] = val; }
+
+    // Raw PMT positions and orientations, kept when the input stores them, so that the geometry columns
+    // above can be recomputed at fit time for a moved source or shifted PMTs. The bins stay the nominal ones.
+    inline bool HasRawGeometry() const { return m_raw_geom; }
+    inline bool CanMoveGeometry() const { return m_raw_geom && m_has_source; }
+    inline void SetSource(const SourceFrame& src) { m_source = src; m_has_source = true; }
+    // Source moved by src_shift and all PMTs by pmt_shift (cm) from their nominal positions, also moves z0
+    void SetGeometryShift(const double* src_shift, const double* pmt_shift);
+    // Recomputes R, costh, cosths, phis, omega and dz of PMTs [begin, end) for the current shifts
+    void UpdateGeometry(const int begin, const int end);
+
+    // Weight columns
+    inline pmt_real* GetWeight() { return m_wght.data(); }
+    inline const pmt_real* GetWeight() const { return m_wght.data(); }
+    inline const pmt_real* GetWeightMC() const { return m_wghtMC.data(); }
+    void ResetWeights(const int begin, const int end);
+
+    // Indirect PE prediction from the scattering control region
+    inline const pmt_real* GetPEIndirect() const { return m_pe_indirect.data(); }
+    inline const pmt_real* GetPEIndirectErr() const { return m_pe_indirect_err.data(); }
+    inline void SetPEIndirect(const int i, const double pe, const double err2)
+    {
+        m_pe_indirect[i] = pe;
+        m_pe_indirect_err[i] = err2;
+    }
+
+    // Timetof template of every PMT, flat nPMT x nTimeBins buffers with PMT i at offset i*nTimeBins
+    void InitTemplate(const int ntbins);
+    void ResetTemplatePred(const int begin, const int end);
+    // Optional smeared nominal template, ResetTemplatePred starts from it instead of the nominal one once allocated
+    void InitTemplateSmear();
+    inline bool HasTemplateSmear() const { return !m_tsmear.empty(); }
+    inline double* GetTemplateSmear() { return m_tsmear.data(); }
+    inline int GetNTimeBins() const { return m_ntbins; }
+    inline double* GetTemplateNom() { return m_tnom.data(); }
+    inline double* GetTemplateNomSig2() { return m_tnom_sig2.data(); }
+    inline double* GetTemplatePred() { return m_tpred.data(); }
+    inline const double* GetTemplateNomSig2() const { return m_tnom_sig2.data(); }
+    inline const double* GetTemplatePred() const { return m_tpred.data(); }
+
+    // Parameter bin index of each PMT for every parameter class, replaces the per-class event map
+    int SetParBinIndex(const std::string& name, const std::vector<int>& bins);
+    inline const int* GetParBinIndex(const int slot) const { return m_parbin[slot].data(); }
+
+    // Cached per-PMT factor of every parameter class, same slot as the bin index
+    inline pmt_real* GetFactor(const int slot) { return m_factor[slot].data(); }
+    inline const pmt_real* GetFactor(const int slot) const { return m_factor[slot].data(); }
+    void MultiplyFactor(const int slot, const int begin, const int end);
+
+    // Optional linear basis of a parameter class, same slot as the bin index.
+    // The factor of PMT i is the dot product of row i (width doubles) with the parameters,
+    // only the first GetParBasisLen(slot)[i] entries of the row are non-zero.
+    void SetParBasis(const int slot, const int width, const std::vector<double>& rows, const std::vector<int>& len);
+    inline int GetParBasisWidth(const int slot) const { return m_parbasis_width[slot]; }
+    inline const pmt_real* GetParBasis(const int slot) const { return m_parbasis[slot].data(); }
+    inline const int* GetParBasisLen(const int slot) const { return m_parbasis_len[slot].data(); }
+    inline pmt_real* GetParBasis(const int slot) { return m_parbasis[slot].data(); }
+    inline int* GetParBasisLen(const int slot) { return m_parbasis_len[slot].data(); }
+
+private:
+    template <typename T>
+    static void FirstTouchCopy(AlignedVector<T>& col, const std::vector<int>& part_begin, const int width);
+
+    int m_npmts;
+    double m_z0;
+    double m_z0_nom;
+
+    AlignedVector<pmt_real> m_R;
+    AlignedVector<pmt_real> m_omega;
+    AlignedVector<pmt_real> m_eff;
+    AlignedVector<pmt_real> m_dz;
+    AlignedVector<pmt_real> m_costh;
+    AlignedVector<pmt_real> m_cosths;
+    AlignedVector<pmt_real> m_phis;
+    AlignedVector<int> m_bin;
+
+    bool m_raw_geom;
+    bool m_has_source;
+    SourceFrame m_source;
+    double m_src_shift[3];
+    double m_pmt_shift[3];
+    AlignedVector<pmt_real> m_pos[3];
+    AlignedVector<pmt_real> m_dir[3];
+    AlignedVector<pmt_real> m_radius;
+
+    AlignedVector<pmt_real> m_wght;
+    AlignedVector<pmt_real> m_wghtMC;
+    AlignedVector<pmt_real> m_pe_indirect;
+    AlignedVector<pmt_real> m_pe_indirect_err;
+
+    int m_ntbins;
+    AlignedVector<double> m_tnom;
+    AlignedVector<double> m_tnom_sig2;
+    AlignedVector<double> m_tpred;
+    AlignedVector<double> m_tsmear;
+
+    std::vector<std::string> m_parbin_name;
+    std::vector<AlignedVector<int>> m_parbin;
+    std::vector<AlignedVector<pmt_real>> m_factor;
+    std::vector<int> m_parbasis_width;
+    std::vector<AlignedVector<pmt_real>> m_parbasis;
+    std::vector<AlignedVector<int>> m_parbasis_len;
+
+    const std::string TAG = color::GREEN_STR + "[PMTStore]: " + color::RESET_STR;
+    const std::string ERR = color::RED_STR + "[PMTStore ERROR]: " + color::RESET_STR;
+};
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __PairwiseSum_hh__
+#define __PairwiseSum_hh__
+
+#include <algorithm>
+#include <cstddef>
+
+// Deterministic reductions of the fit loop.
+// Work is split into fixed-size pieces (PMT chunks, likelihood blocks) whose partial sums are combined
+// with a pairwise tree that only depends on the number of pieces, so the chi2 is bitwise identical
+// for any number of threads.
+
+// Upper bound on the number of reduction groups of the PMT sums, and on their total accumulator size in doubles
+const int REDUCE_GROUPS = 64;
+const std::size_t REDUCE_BUFFER_MAX = 1 << 22;
+
+// Number of groups for num_chunks PMT chunks with buf_size accumulators each, independent of the thread count
+inline int NumReduceGroups(const int num_chunks, const std::size_t buf_size)
+{
+    int ngroups = std::min(REDUCE_GROUPS, num_chunks);
+    if(buf_size > 0)
+        ngroups = std::min<std::size_t>(ngroups, std::max<std::size_t>(1, REDUCE_BUFFER_MAX / buf_size));
+    return std::max(ngroups, 1);
+}
+
+// Sum of x[0], x[stride], ..., x[(n-1)*stride] with a fixed pairwise tree, sequential below 8 terms
+inline double PairwiseSum(const double* x, const int n, const std::size_t stride = 1)
+{
+    if(n <= 8)
+    {
+        double sum = 0.0;
+        for(int i = 0; i < n; ++i)
+            sum += x[i * stride];
+        return sum;
+    }
+    const int half = n / 2;
+    return PairwiseSum(x, half, stride) + PairwiseSum(x + half * stride, n - half, stride);
+}
+
+#endif
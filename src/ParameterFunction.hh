@@ -11,7 +11,11 @@
 
 #include <TMath.h>
 
-#include "AnaEvent.hh"
+#include "Carlson.hh"
+#include "FastMath.hh"
+#include "FormulaEngine.hh"
+#include "PMTStore.hh"
+#include "utils/LEDProfile.hh"
 
 enum FunctionType
 {
@@ -22,115 +26,52 @@ enum FunctionType
     kAttenuationZ = 4,
     kSourcePhiVar = 5,
     kSpline = 6, 
+    kFormula = 7,
+    kLEDProfile = 8,
+    kSolidAngle = 9,
+    kGeometry = 10,
+    kTimeSmear = 11,
 };
 
 
+// Parameter functions only hold the state of the functional form.
+// The per-PMT evaluation is done by the ReWeightKernel specializations below,
+// which run over a range of PMTs in the columnar PMTStore.
 class ParameterFunction
 {
 public:
+    ParameterFunction() : fast_math(false) {}
     virtual ~ParameterFunction() {};
-    virtual double operator()(double par, AnaEvent ev)
-    {
-        return 0.0;
-    }
+
+    bool fast_math; // evaluate exp/pow with the approximations of FastMath.hh
 };
 
 class Identity : public ParameterFunction
 {
-public:
-    double operator()(double par, AnaEvent ev)
-    {
-        return par;
-    }
 };
 
 class Attenuation : public ParameterFunction
 {
-public:
-    double operator()(double par, AnaEvent ev)
-    {
-        double R = ev.GetR();
-        double omega = ev.GetOmega();
-        double eff = ev.GetEff();
-        double val = TMath::Exp(-R/par)*omega*eff;
-
-        return val;
-    }
 };
 
+// par[0] = attenuation length at z = 0, par[1] = its slope in z
 class AttenuationZ : public ParameterFunction
 {
-public:
-    double operator()(double par, AnaEvent ev)
-    {
-        double R = ev.GetR();
-        double omega = ev.GetOmega();
-        double dz = ev.GetDz();
-        double z0 = ev.GetZ0();
-        double alpha_z0 = alpha0 + slopeA*z0;
-        double eff = ev.GetEff();
-        double val;
-        double da = slopeA*dz;
-        if (fabs(da)>1.e-9)
-        {
-            val = TMath::Power(1+da/alpha_z0,-R/da)*omega*eff;
-        }
-        else
-        {
-            val = TMath::Exp(-R/alpha_z0)*omega*eff;
-        }
-
-        return val;
-    }
-    double alpha0;
-    double slopeA;
 };
 
 class Scatter : public ParameterFunction
 {
-public:
-    double operator()(double par, AnaEvent ev)
-    {
-        return 1.;
-    }
 };
 
 class SourcePhiVar : public ParameterFunction
 {
-public:
-    double operator()(double par, AnaEvent ev)
-    {
-        return 1+par*cos(ev.GetPhis());
-    }
 };
 
 class PolynomialCosth : public ParameterFunction
 {
 public:
-    double operator()(double par, AnaEvent ev)
-    {
-        double costh = ev.GetCosth();
-        double val = 0;
-        for (int i=0;i<pol_orders.size();i++)
-        {
-            if (costh>=pol_range[i] && costh<pol_range[i+1])
-            {
-                //std::cout<<"Using pol"<<i<<std::endl;
-                // for (int j=0;j<=pol_orders[i];j++)
-                // {
-                //     val += pol_coeff[i][j]*TMath::Power(costh-pol_range[i],j);
-                // }
-                double x = costh-pol_range[i];
-                for (int j=pol_orders[i];j>=0;j--)
-                {
-                    val = val*x + pol_coeff[i][j];
-                }
-                break;
-            }
-        }
-        //std::cout<<"CalcPol:: costh = "<<costh<<", val = "<<val<<std::endl;
-        return val;
-    }
+    PolynomialCosth() : pol_npar(0) {}
+
     std::vector<int> pol_orders; // order of polynomial in each piece 
     std::vector<double> pol_range; // applicable range for each polynomial
     // Coefficients and boundary conditions for each polynomial
@@ -148,39 +89,107 @@ public:
             std::cout<<pol_range[i]<<" ";
         std::cout<<std::endl;
     }
-    void SetPolynomial(std::vector<double>& params)
+
+    // The response is linear in the free parameters once continuity is imposed.
+    // pol_basis[k][j*pol_npar+p] is the contribution of parameter p to coefficient j of segment k,
+    // segment k only depends on the first pol_ncol[k] parameters.
+    int pol_npar;
+    std::vector<std::vector<double>> pol_basis;
+    std::vector<int> pol_ncol;
+
+    void BuildBasis()
     {
-        pol_coeff.clear(); pol_p0.clear(); pol_p1.clear(); 
+        pol_basis.clear(); pol_ncol.clear();
+        pol_npar = 0;
+        for (int i=0;i<pol_orders.size();i++)
+            pol_npar += i==0 ? pol_orders[i]+1 : pol_orders[i]-1;
+
+        std::vector<double> p0(pol_npar, 0.0), p1(pol_npar, 0.0);
         int par_index = 0;
         for (int i=0;i<pol_orders.size();i++)
         {
-            std::vector<double> coeff;
-            if (i==0) // for the first polynomial, the coefficients are unconstrained
+            const int ncoeff = pol_orders[i]+1;
+            std::vector<double> basis(ncoeff*pol_npar, 0.0);
+            int j0 = 0;
+            if (i>0) // match the 0-th and 1-st order derivatives of the previous polynomial
             {
-                for (int j=0;j<=pol_orders[i];j++)
-                {
-                    coeff.push_back(params[j]);
-                    par_index++;
-                } 
+                std::copy(p0.begin(), p0.end(), basis.begin());
+                std::copy(p1.begin(), p1.end(), basis.begin()+pol_npar);
+                j0 = 2;
             }
-            else // for others, we need to match the 0-th and 1-st order derivatives 
+            for (int j=j0;j<ncoeff;j++)
+                basis[j*pol_npar + par_index++] = 1.0;
+
+            // 0-th and 1-st order derivatives at the end-point as boundary conditions of the next polynomial
+            const double L = pol_range[i+1]-pol_range[i];
+            std::fill(p0.begin(), p0.end(), 0.0);
+            std::fill(p1.begin(), p1.end(), 0.0);
+            double Lj = 1.0;
+            for (int j=0;j<ncoeff;j++)
             {
-                coeff.push_back(pol_p0[i-1]);
-                coeff.push_back(pol_p1[i-1]);
-                for (int j=2;j<=pol_orders[i];j++)
+                for (int p=0;p<par_index;p++)
                 {
-                    coeff.push_back(params[par_index]);
-                    par_index++;
-                } 
+                    p0[p] += basis[j*pol_npar+p]*Lj;
+                    if (j+1<ncoeff) p1[p] += basis[(j+1)*pol_npar+p]*(j+1)*Lj;
+                }
+                Lj *= L;
             }
+
+            pol_basis.emplace_back(basis);
+            pol_ncol.push_back(par_index);
+        }
+    }
+
+    // Segment of costh, -1 if outside all ranges
+    int FindSegment(const double costh) const
+    {
+        for (int k=0;k<pol_orders.size();k++)
+            if (costh>=pol_range[k] && costh<pol_range[k+1])
+                return k;
+        return -1;
+    }
+
+    // Basis row of a PMT, the response is the dot product of row[0,len) with the parameters
+    void BasisRow(const double costh, double* row, int& len) const
+    {
+        std::fill(row, row+pol_npar, 0.0);
+        const int k = FindSegment(costh);
+        len = k<0 ? 0 : pol_ncol[k];
+        if (k<0) return;
+
+        const double x = costh-pol_range[k];
+        const std::vector<double>& basis = pol_basis[k];
+        double xj = 1.0;
+        for (int j=0;j<=pol_orders[k];j++)
+        {
+            for (int p=0;p<len;p++)
+                row[p] += basis[j*pol_npar+p]*xj;
+            xj *= x;
+        }
+    }
+
+    void SetPolynomial(std::vector<double>& params)
+    {
+        if (pol_basis.size() != pol_orders.size())
+            BuildBasis();
+
+        pol_coeff.clear(); pol_p0.clear(); pol_p1.clear();
+        for (int i=0;i<pol_orders.size();i++)
+        {
+            std::vector<double> coeff(pol_orders[i]+1, 0.0);
+            for (int j=0;j<=pol_orders[i];j++)
+                for (int p=0;p<pol_ncol[i];p++)
+                    coeff[j] += pol_basis[i][j*pol_npar+p]*params[p];
             pol_coeff.emplace_back(coeff);
+
             double p0 = 0;
             double p1 = 0;
-            for (int j=0;j<=pol_orders[i];j++) // store the 0-th and 1-st order derivatives at end-point as boundary conditions
+            const double L = pol_range[i+1]-pol_range[i];
+            for (int j=pol_orders[i];j>=0;j--)
             {
-                p0 += coeff[j]*TMath::Power(pol_range[i+1]-pol_range[i],j);
-                p1 += coeff[j]*j*TMath::Power(pol_range[i+1]-pol_range[i],j-1);
-            } 
+                p0 = p0*L + coeff[j];
+                if (j>0) p1 = p1*L + j*coeff[j];
+            }
             pol_p0.push_back(p0);
             pol_p1.push_back(p1);
         }
@@ -189,10 +198,249 @@ public:
 
 class Spline : public ParameterFunction
 {
+};
+
+// Diffuser profile of utils/LEDProfile.hh with floating shape, par[0] scales the power spectrum P(cosths)
+// and par[1] the phis variation V(cosths): par[0]*P + par[1]*P*V/100*cos(phis), GetLEDWeight at par = {1,1}.
+// The two terms are fixed per PMT and stored as basis rows at InitEventMap.
+class LEDProfileFunction : public ParameterFunction
+{
 public:
-    double operator()(double par, AnaEvent ev)
+    LEDProfile profile;
+
+    void BasisRow(const double cosths, const double phis, double* row) const
     {
-        return 1.;
+        row[0] = profile.GetPower(cosths);
+        row[1] = row[0]*profile.GetVariation(cosths)/100.*std::cos(phis);
+    }
+};
+
+// Exact solid angle of the PMT as a disk of effective radius par (cm), see carlson::DiskSolidAngle,
+// divided by the omega of the input so that it replaces it in the other functions
+class SolidAngle : public ParameterFunction
+{
+};
+
+// Shift of the source and optionally of all PMTs (cm), parameters [src_x, src_y, src_z, (pmt_x, pmt_y, pmt_z)].
+// Does not reweight: the Fitter recomputes the geometry columns of the PMTStore, see PMTStore::UpdateGeometry
+class SourceGeometry : public ParameterFunction
+{
+};
+
+// Time resolution width (ns) convolved with the timetof template of the PMTs in each bin.
+// Does not reweight: the Fitter smears the nominal template, see TimeSmearEngine
+class TimeSmear : public ParameterFunction
+{
+};
+
+// Functional form given as an expression in the config, see FormulaEngine.hh
+class Formula : public ParameterFunction
+{
+public:
+    FormulaEngine engine;
+};
+
+// Batch reweight kernel, multiplies wght[i] by the factor of PMT i for i in [begin,end).
+// wght is either a PMTStore column or a double array, the factor itself is computed in double.
+// slot is the parameter bin slot of the class in the PMTStore, its bin index of PMT i
+// is the parameter index, negative if the PMT is not affected.
+// The default is a no-op, used by functions that do not touch the direct PE weight.
+template <int FType>
+struct ReWeightKernel
+{
+    template <typename T>
+    static void Apply(const ParameterFunction* func, const double* par, const PMTStore& pmts,
+                      const int slot, T* wght, const int begin, const int end)
+    {
+    }
+};
+
+template <>
+struct ReWeightKernel<kIdentity>
+{
+    template <typename T>
+    static void Apply(const ParameterFunction* func, const double* par, const PMTStore& pmts,
+                      const int slot, T* wght, const int begin, const int end)
+    {
+        const int* bins = pmts.GetParBinIndex(slot);
+        for(int i = begin; i < end; ++i)
+        {
+            if(bins[i] < 0) continue;
+            wght[i] *= par[bins[i]];
+        }
+    }
+};
+
+template <>
+struct ReWeightKernel<kAttenuation>
+{
+    template <typename T>
+    static void Apply(const ParameterFunction* func, const double* par, const PMTStore& pmts,
+                      const int slot, T* wght, const int begin, const int end)
+    {
+        if(func->fast_math)
+            Loop<fastmath::ApproxMath>(par, pmts, slot, wght, begin, end);
+        else
+            Loop<fastmath::StdMath>(par, pmts, slot, wght, begin, end);
+    }
+
+    template <typename M, typename T>
+    static void Loop(const double* par, const PMTStore& pmts, const int slot, T* wght, const int begin, const int end)
+    {
+        const int* bins = pmts.GetParBinIndex(slot);
+        const pmt_real* R = pmts.GetR();
+        const pmt_real* omega = pmts.GetOmega();
+        const pmt_real* eff = pmts.GetEff();
+        for(int i = begin; i < end; ++i)
+        {
+            if(bins[i] < 0) continue;
+            wght[i] *= M::Exp(-R[i]/par[bins[i]])*omega[i]*eff[i];
+        }
+    }
+};
+
+template <>
+struct ReWeightKernel<kAttenuationZ>
+{
+    template <typename T>
+    static void Apply(const ParameterFunction* func, const double* par, const PMTStore& pmts,
+                      const int slot, T* wght, const int begin, const int end)
+    {
+        if(func->fast_math)
+            Loop<fastmath::ApproxMath>(par, pmts, slot, wght, begin, end);
+        else
+            Loop<fastmath::StdMath>(par, pmts, slot, wght, begin, end);
+    }
+
+    template <typename M, typename T>
+    static void Loop(const double* par, const PMTStore& pmts, const int slot, T* wght, const int begin, const int end)
+    {
+        const int* bins = pmts.GetParBinIndex(slot);
+        const pmt_real* R = pmts.GetR();
+        const pmt_real* omega = pmts.GetOmega();
+        const pmt_real* eff = pmts.GetEff();
+        const pmt_real* dz = pmts.GetDz();
+        const double slopeA = par[1];
+        const double alpha_z0 = par[0] + slopeA*pmts.GetZ0();
+        for(int i = begin; i < end; ++i)
+        {
+            if(bins[i] < 0) continue;
+            const double da = slopeA*dz[i];
+            double val;
+            if (fabs(da)>1.e-9)
+                val = M::Pow(1+da/alpha_z0,-R[i]/da);
+            else
+                val = M::Exp(-R[i]/alpha_z0);
+            wght[i] *= val*omega[i]*eff[i];
+        }
+    }
+};
+
+template <>
+struct ReWeightKernel<kSourcePhiVar>
+{
+    template <typename T>
+    static void Apply(const ParameterFunction* func, const double* par, const PMTStore& pmts,
+                      const int slot, T* wght, const int begin, const int end)
+    {
+        const int* bins = pmts.GetParBinIndex(slot);
+        const pmt_real* phis = pmts.GetPhis();
+        for(int i = begin; i < end; ++i)
+        {
+            if(bins[i] < 0) continue;
+            wght[i] *= 1+par[bins[i]]*std::cos(phis[i]);
+        }
+    }
+};
+
+template <>
+struct ReWeightKernel<kSolidAngle>
+{
+    // PMTs per call of the batch solid angle
+    static const int kBlock = 256;
+
+    template <typename T>
+    static void Apply(const ParameterFunction* func, const double* par, const PMTStore& pmts,
+                      const int slot, T* wght, const int begin, const int end)
+    {
+        const int* bins = pmts.GetParBinIndex(slot);
+        const pmt_real* R = pmts.GetR();
+        const pmt_real* costh = pmts.GetCosth();
+        const pmt_real* omega = pmts.GetOmega();
+        double a[kBlock], r[kBlock], c[kBlock], out[kBlock];
+        for(int b0 = begin; b0 < end; b0 += kBlock)
+        {
+            const int n = std::min(kBlock, end - b0);
+            for(int i = 0; i < n; ++i)
+            {
+                const int bin = bins[b0 + i];
+                a[i] = bin < 0 ? 1.0 : par[bin];
+                r[i] = R[b0 + i];
+                c[i] = costh[b0 + i];
+            }
+            carlson::DiskSolidAngleBatch(n, a, r, c, out);
+            for(int i = 0; i < n; ++i)
+            {
+                if(bins[b0 + i] < 0 || omega[b0 + i] <= 0) continue;
+                wght[b0 + i] *= out[i] / omega[b0 + i];
+            }
+        }
+    }
+};
+
+template <>
+struct ReWeightKernel<kFormula>
+{
+    template <typename T>
+    static void Apply(const ParameterFunction* func, const double* par, const PMTStore& pmts,
+                      const int slot, T* wght, const int begin, const int end)
+    {
+        static_cast<const Formula*>(func)->engine.Apply(par, pmts, pmts.GetParBinIndex(slot), wght, begin, end, func->fast_math);
+    }
+};
+
+template <>
+struct ReWeightKernel<kLEDProfile>
+{
+    template <typename T>
+    static void Apply(const ParameterFunction* func, const double* par, const PMTStore& pmts,
+                      const int slot, T* wght, const int begin, const int end)
+    {
+        const int* bins = pmts.GetParBinIndex(slot);
+        const pmt_real* basis = pmts.GetParBasis(slot);
+        const double p0 = par[0];
+        const double p1 = par[1];
+        for(int i = begin; i < end; ++i)
+        {
+            if(bins[i] < 0) continue;
+            wght[i] *= basis[2*i]*p0 + basis[2*i+1]*p1;
+        }
+    }
+};
+
+template <>
+struct ReWeightKernel<kPolynomialCosth>
+{
+    // Dense GEMV of the per-PMT basis rows built at InitEventMap with the parameters,
+    // the segment search and the continuity constraints are folded into the rows
+    template <typename T>
+    static void Apply(const ParameterFunction* func, const double* par, const PMTStore& pmts,
+                      const int slot, T* wght, const int begin, const int end)
+    {
+        const int* bins = pmts.GetParBinIndex(slot);
+        const int width = pmts.GetParBasisWidth(slot);
+        const pmt_real* basis = pmts.GetParBasis(slot);
+        const int* len = pmts.GetParBasisLen(slot);
+        for(int i = begin; i < end; ++i)
+        {
+            if(bins[i] < 0) continue;
+            const pmt_real* row = basis + (std::size_t)i*width;
+            double val = 0;
+#pragma omp simd reduction(+:val)
+            for(int p = 0; p < len[i]; ++p)
+                val += row[p]*par[p];
+            wght[i] *= val;
+        }
     }
 };
 
@@ -0,0 +1,149 @@
+#include "SplineEngine.hh"
+
+SplineEngine::SplineEngine()
+    : m_mode(kLinear)
+    , m_nsplines(0)
+    , m_ncoeff(2)
+{
+}
+
+void SplineEngine::Clear()
+{
+    m_nsplines = 0;
+    m_knots.clear();
+    m_origin.clear();
+    m_coeff.clear();
+}
+
+void SplineEngine::Init(const std::vector<double>& knots, const int nsplines, const int mode)
+{
+    Clear();
+
+    if(knots.size() < 2)
+    {
+        std::cerr << ERR << "In Init()\n"
+                  << "Need at least two knots, got " << knots.size() << std::endl;
+        return;
+    }
+
+    m_mode = mode;
+    m_ncoeff = m_mode == kCubic ? 4 : 2;
+    m_nsplines = nsplines;
+    m_knots = knots;
+
+    const int nknots = m_knots.size();
+    m_origin.resize(nknots + 1);
+    m_origin[0] = m_knots[0];
+    for(int s = 1; s < nknots; ++s)
+        m_origin[s] = m_knots[s-1];
+    m_origin[nknots] = m_knots[nknots-1];
+
+    // flat splines until SetSpline is called
+    m_coeff.assign((nknots + 1) * m_ncoeff * m_nsplines, 0.0);
+    for(int s = 0; s <= nknots; ++s)
+        std::fill(m_coeff.begin() + s * m_ncoeff * m_nsplines, m_coeff.begin() + (s * m_ncoeff + 1) * m_nsplines, 1.0);
+}
+
+void SplineEngine::SetSpline(const int idx, const double* y)
+{
+    const int nknots = m_knots.size();
+    const int nseg = nknots - 1;
+
+    std::vector<double> h(nseg);
+    for(int k = 0; k < nseg; ++k)
+        h[k] = m_knots[k+1] - m_knots[k];
+
+    // second derivatives at the knots, natural boundary conditions
+    std::vector<double> M(nknots, 0.0);
+    if(m_mode == kCubic && nknots > 2)
+    {
+        // Thomas algorithm on the tridiagonal system of the interior knots
+        const int n = nknots - 2;
+        std::vector<double> diag(n), upper(n), rhs(n);
+        for(int i = 0; i < n; ++i)
+        {
+            diag[i]  = 2.0 * (h[i] + h[i+1]);
+            upper[i] = h[i+1];
+            rhs[i]   = 6.0 * ((y[i+2] - y[i+1]) / h[i+1] - (y[i+1] - y[i]) / h[i]);
+        }
+        for(int i = 1; i < n; ++i)
+        {
+            const double w = h[i] / diag[i-1];
+            diag[i] -= w * upper[i-1];
+            rhs[i]  -= w * rhs[i-1];
+        }
+        M[n] = rhs[n-1] / diag[n-1];
+        for(int i = n - 2; i >= 0; --i)
+            M[i+1] = (rhs[i] - upper[i] * M[i+2]) / diag[i];
+    }
+
+    auto coeff = [&](const int seg, const int j) -> double& {
+        return m_coeff[(seg * m_ncoeff + j) * m_nsplines + idx];
+    };
+
+    for(int k = 0; k < nseg; ++k)
+    {
+        const double slope = (y[k+1] - y[k]) / h[k];
+        coeff(k+1, 0) = y[k];
+        if(m_mode == kCubic)
+        {
+            coeff(k+1, 1) = slope - h[k] * (2.0 * M[k] + M[k+1]) / 6.0;
+            coeff(k+1, 2) = M[k] / 2.0;
+            coeff(k+1, 3) = (M[k+1] - M[k]) / (6.0 * h[k]);
+        }
+        else
+            coeff(k+1, 1) = slope;
+    }
+
+    // linear extrapolation with the value and slope at the end knots
+    coeff(0, 0) = y[0];
+    coeff(0, 1) = coeff(1, 1);
+    const double hl = h[nseg-1];
+    coeff(nknots, 0) = y[nknots-1];
+    if(m_mode == kCubic)
+        coeff(nknots, 1) = coeff(nseg, 1) + hl * (2.0 * coeff(nseg, 2) + 3.0 * hl * coeff(nseg, 3));
+    else
+        coeff(nknots, 1) = coeff(nseg, 1);
+}
+
+int SplineEngine::FindSegment(const double x) const
+{
+    if(x < m_knots.front())
+        return 0;
+    if(x >= m_knots.back())
+        return m_knots.size();
+    return std::upper_bound(m_knots.begin(), m_knots.end(), x) - m_knots.begin();
+}
+
+void SplineEngine::Scale(const double x, double* out, const int begin, const int end) const
+{
+    const int seg = FindSegment(x);
+    const double dx = x - m_origin[seg];
+    const double* a = &m_coeff[seg * m_ncoeff * m_nsplines];
+    const double* b = a + m_nsplines;
+
+    if(m_mode == kCubic)
+    {
+        const double* c = b + m_nsplines;
+        const double* d = c + m_nsplines;
+#pragma omp simd
+        for(int i = begin; i < end; ++i)
+            out[i] *= a[i] + dx * (b[i] + dx * (c[i] + dx * d[i]));
+    }
+    else
+    {
+#pragma omp simd
+        for(int i = begin; i < end; ++i)
+            out[i] *= a[i] + dx * b[i];
+    }
+}
+
+double SplineEngine::Eval(const int idx, const double x) const
+{
+    const int seg = FindSegment(x);
+    const double dx = x - m_origin[seg];
+    double val = 0.0;
+    for(int j = m_ncoeff - 1; j >= 0; --j)
+        val = val * dx + m_coeff[(seg * m_ncoeff + j) * m_nsplines + idx];
+    return val;
+}
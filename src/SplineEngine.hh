@@ -0,0 +1,62 @@
+#ifndef __SplineEngine_hh__
+#define __SplineEngine_hh__
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "AlignedAllocator.hh"
+#include "ColorOutput.hh"
+
+// Evaluates many splines that share the same x-knots.
+// The segment of x and its offset are found once per call, then every spline is a short
+// polynomial in the offset whose coefficients are packed segment by segment,
+// so one call streams through a single contiguous block of coefficients.
+// Outside the knots the splines are extrapolated linearly, as TGraph::Eval does.
+class SplineEngine
+{
+public:
+    enum Mode
+    {
+        kLinear = 0,
+        kCubic  = 1
+    };
+
+    SplineEngine();
+
+    void Init(const std::vector<double>& knots, const int nsplines, const int mode = kLinear);
+    void Clear();
+
+    // y are the values of spline idx at the knots
+    void SetSpline(const int idx, const double* y);
+
+    // Multiplies out[i] by the value of spline i at x, for i in [begin,end)
+    void Scale(const double x, double* out, const int begin, const int end) const;
+    double Eval(const int idx, const double x) const;
+
+    inline bool IsEmpty() const { return m_nsplines == 0; }
+    inline int GetNSplines() const { return m_nsplines; }
+    inline int GetNKnots() const { return m_knots.size(); }
+    inline int GetMode() const { return m_mode; }
+    inline const std::vector<double>& GetKnots() const { return m_knots; }
+
+private:
+    int FindSegment(const double x) const;
+
+    int m_mode;
+    int m_nsplines;
+    int m_ncoeff; // 2 for linear, 4 for cubic
+
+    std::vector<double> m_knots;
+    // Segment 0 is the extrapolation below the first knot, segment nknots the one above the last knot.
+    // Segment s in between covers [knots[s-1], knots[s]).
+    std::vector<double> m_origin; // x at which the polynomial of each segment is expanded
+    AlignedVector<double> m_coeff; // [segment][coefficient][spline]
+
+    const std::string TAG = color::GREEN_STR + "[SplineEngine]: " + color::RESET_STR;
+    const std::string ERR = color::RED_STR + "[SplineEngine ERROR]: " + color::RESET_STR;
+};
+
+#endif
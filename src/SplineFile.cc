@@ -0,0 +1,215 @@
+#include "SplineFile.hh"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+
+const char SplineFile::MAGIC[8] = {'O', 'F', 'S', 'P', 'L', 'I', 'N', 'E'};
+
+namespace
+{
+    inline int64_t Pad8(const int64_t n) { return (n + 7) / 8 * 8; }
+}
+
+SplineFile::SplineFile()
+    : m_data(nullptr)
+    , m_size(0)
+    , m_knots(nullptr)
+    , m_present(nullptr)
+    , m_values(nullptr)
+{
+    std::memset(&m_header, 0, sizeof(m_header));
+}
+
+SplineFile::~SplineFile()
+{
+    Close();
+}
+
+void SplineFile::Close()
+{
+    if(m_data != nullptr)
+        munmap(m_data, m_size);
+    m_data = nullptr;
+    m_size = 0;
+    m_knots = nullptr;
+    m_present = nullptr;
+    m_values = nullptr;
+    m_dim_nknots.clear();
+    m_dim_offset.clear();
+    std::memset(&m_header, 0, sizeof(m_header));
+}
+
+bool SplineFile::IsSplineFile(const std::string& fname)
+{
+    std::ifstream f(fname, std::ios::binary);
+    char magic[8];
+    if(!f.read(magic, sizeof(magic)))
+        return false;
+    return std::memcmp(magic, MAGIC, sizeof(magic)) == 0;
+}
+
+bool SplineFile::Open(const std::string& fname)
+{
+    Close();
+
+    int fd = open(fname.c_str(), O_RDONLY);
+    if(fd < 0)
+    {
+        std::cerr << ERR << "Could not open input file: " << fname << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SplineFileHeader))
+    {
+        std::cerr << ERR << "File is too short to be a spline file: " << fname << std::endl;
+        close(fd);
+        return false;
+    }
+
+    m_size = st.st_size;
+    m_data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(m_data == MAP_FAILED)
+    {
+        std::cerr << ERR << "Could not map file: " << fname << std::endl;
+        m_data = nullptr;
+        m_size = 0;
+        return false;
+    }
+
+    std::memcpy(&m_header, m_data, sizeof(m_header));
+    const SplineFileHeader& h = m_header;
+    const char* base = static_cast<const char*>(m_data);
+
+    // knots of each grid dimension, a version 1 file is a single dimension
+    int64_t nknots_total = h.nknots;
+    bool dims_ok = true;
+    if(h.version == 2)
+    {
+        const int64_t dim_offset = Pad8(sizeof(h));
+        int32_t ndim = 0;
+        if(dim_offset + (int64_t)sizeof(int32_t) <= (int64_t)m_size)
+            std::memcpy(&ndim, base + dim_offset, sizeof(ndim));
+        dims_ok = ndim > 0 && h.knot_offset <= (int64_t)m_size
+                  && dim_offset + (1 + (int64_t)ndim) * (int64_t)sizeof(int32_t) <= h.knot_offset;
+        int64_t npoints = 1;
+        nknots_total = 0;
+        for(int32_t d = 0; d < ndim && dims_ok; ++d)
+        {
+            int32_t n;
+            std::memcpy(&n, base + dim_offset + (1 + d) * sizeof(int32_t), sizeof(n));
+            dims_ok = n >= 2;
+            m_dim_offset.push_back(nknots_total);
+            m_dim_nknots.push_back(n);
+            nknots_total += n;
+            npoints *= n;
+        }
+        dims_ok = dims_ok && npoints == h.nknots;
+    }
+    else
+    {
+        m_dim_offset.assign(1, 0);
+        m_dim_nknots.assign(1, h.nknots);
+    }
+
+    const int64_t nval = (int64_t)h.npmt_ids * h.nbins * h.nknots;
+    if(std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || (h.version != 1 && h.version != VERSION) || !dims_ok
+       || h.npmt_ids < 0 || h.nbins < 0 || h.nknots < 2
+       || h.file_size != (int64_t)m_size
+       || h.knot_offset + nknots_total * (int64_t)sizeof(double) > h.present_offset
+       || h.present_offset + h.npmt_ids > h.value_offset
+       || h.value_offset + nval * (int64_t)sizeof(double) > h.file_size)
+    {
+        std::cerr << ERR << "Invalid spline file: " << fname << std::endl;
+        Close();
+        return false;
+    }
+
+    m_knots = reinterpret_cast<const double*>(base + h.knot_offset);
+    m_present = reinterpret_cast<const uint8_t*>(base + h.present_offset);
+    m_values = reinterpret_cast<const double*>(base + h.value_offset);
+
+    std::cout << TAG << "Mapped " << fname << ": " << h.npmt_ids << " PMT ids, "
+              << h.nbins << " bins, " << h.nknots << " knots";
+    if(GetNDim() > 1)
+        std::cout << " on a grid of " << GetNDim() << " dimensions";
+    std::cout << std::endl;
+
+    return true;
+}
+
+const double* SplineFile::GetValues(const int pmt_id) const
+{
+    if(pmt_id < 0 || pmt_id >= m_header.npmt_ids || !m_present[pmt_id])
+        return nullptr;
+    return m_values + (int64_t)pmt_id * m_header.nbins * m_header.nknots;
+}
+
+bool SplineFile::Write(const std::string& fname, const std::vector<double>& knots, const int nbins,
+                       const std::vector<uint8_t>& present, const std::vector<double>& values)
+{
+    return Write(fname, std::vector<std::vector<double>>(1, knots), nbins, present, values);
+}
+
+bool SplineFile::Write(const std::string& fname, const std::vector<std::vector<double>>& knots, const int nbins,
+                       const std::vector<uint8_t>& present, const std::vector<double>& values)
+{
+    const int npmt_ids = present.size();
+    const int ndim = knots.size();
+    int64_t nknots = 1;
+    std::vector<double> knots_flat;
+    std::vector<int32_t> dims(1, ndim);
+    for(const auto& k : knots)
+    {
+        nknots *= k.size();
+        knots_flat.insert(knots_flat.end(), k.begin(), k.end());
+        dims.push_back(k.size());
+    }
+    if(ndim == 0 || (int64_t)values.size() != (int64_t)npmt_ids * nbins * nknots)
+    {
+        std::cerr << color::RED_STR << "[SplineFile ERROR]: " << color::RESET_STR
+                  << "Expect " << (int64_t)npmt_ids * nbins * nknots << " spline values, got " << values.size() << std::endl;
+        return false;
+    }
+
+    SplineFileHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = ndim > 1 ? VERSION : 1;
+    h.npmt_ids = npmt_ids;
+    h.nbins = nbins;
+    h.nknots = nknots;
+    const int64_t dim_offset = Pad8(sizeof(h));
+    h.knot_offset = h.version == 1 ? dim_offset : Pad8(dim_offset + dims.size() * sizeof(int32_t));
+    h.present_offset = h.knot_offset + knots_flat.size() * sizeof(double);
+    h.value_offset = Pad8(h.present_offset + npmt_ids);
+    h.file_size = h.value_offset + values.size() * sizeof(double);
+
+    std::ofstream f(fname, std::ios::binary | std::ios::trunc);
+    if(!f.is_open())
+    {
+        std::cerr << color::RED_STR << "[SplineFile ERROR]: " << color::RESET_STR
+                  << "Could not open output file: " << fname << std::endl;
+        return false;
+    }
+
+    const char zeros[8] = {0};
+    f.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    f.write(zeros, dim_offset - sizeof(h));
+    if(h.version != 1)
+    {
+        f.write(reinterpret_cast<const char*>(dims.data()), dims.size() * sizeof(int32_t));
+        f.write(zeros, h.knot_offset - dim_offset - dims.size() * sizeof(int32_t));
+    }
+    f.write(reinterpret_cast<const char*>(knots_flat.data()), knots_flat.size() * sizeof(double));
+    f.write(reinterpret_cast<const char*>(present.data()), npmt_ids);
+    f.write(zeros, h.value_offset - h.present_offset - npmt_ids);
+    f.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(double));
+
+    return f.good();
+}
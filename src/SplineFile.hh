@@ -0,0 +1,90 @@
+#ifndef __SplineFile_hh__
+#define __SplineFile_hh__
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "ColorOutput.hh"
+
+// Compact binary file of the template splines, produced by app/spline_convert.cc.
+//
+// Layout (native byte order, every block starts at a multiple of 8 bytes):
+//   SplineFileHeader
+//   int32_t ndim, dim_nknots[ndim] (padded to 8) version 2 only, knots of each grid dimension
+//   double  knots[sum of dim_nknots]            shared knots of all splines, dimension after dimension
+//   uint8_t present[npmt_ids] (padded to 8)     1 if the PMT had splines in the ROOT file
+//   double  values[npmt_ids][nbins][nknots]     spline values at the knots, 1 for missing PMTs
+//
+// Version 1 files are one-dimensional splines. In version 2 each spline is a response grid over ndim
+// parameters and nknots is the number of grid points, the product of dim_nknots, with the last dimension fastest.
+//
+// Values are indexed directly by PMT_id, so the file is memory-mapped and
+// the splines of any PMT are found without a lookup.
+struct SplineFileHeader
+{
+    char magic[8];
+    int32_t version;
+    int32_t npmt_ids;   // highest PMT_id + 1
+    int32_t nbins;      // time bins per PMT
+    int32_t nknots;     // values per spline
+    int64_t knot_offset;
+    int64_t present_offset;
+    int64_t value_offset;
+    int64_t file_size;
+};
+
+class SplineFile
+{
+public:
+    static const char MAGIC[8];
+    static const int32_t VERSION = 2;
+
+    SplineFile();
+    ~SplineFile();
+
+    // Maps the file read-only, returns false if it is not a valid spline file
+    bool Open(const std::string& fname);
+    void Close();
+    inline bool IsOpen() const { return m_data != nullptr; }
+
+    // Checks only the magic at the start of the file
+    static bool IsSplineFile(const std::string& fname);
+
+    // values are laid out as [pmt_id][bin][knot], present as [pmt_id]
+    static bool Write(const std::string& fname, const std::vector<double>& knots, const int nbins,
+                      const std::vector<uint8_t>& present, const std::vector<double>& values);
+    // Response grids with the knots of each dimension, values laid out as [pmt_id][bin][grid point].
+    // A single dimension is written as a version 1 file
+    static bool Write(const std::string& fname, const std::vector<std::vector<double>>& knots, const int nbins,
+                      const std::vector<uint8_t>& present, const std::vector<double>& values);
+
+    inline int GetNPMTIDs() const { return m_header.npmt_ids; }
+    inline int GetNBins() const { return m_header.nbins; }
+    inline int GetNKnots() const { return m_header.nknots; }
+    inline const double* GetKnots() const { return m_knots; }
+    // Knots of each grid dimension, a version 1 file has one
+    inline int GetNDim() const { return m_dim_nknots.size(); }
+    inline int GetNKnots(const int d) const { return m_dim_nknots[d]; }
+    inline const double* GetKnots(const int d) const { return m_knots + m_dim_offset[d]; }
+
+    // Values at the knots of the nbins splines of a PMT, nullptr if the PMT is not in the file
+    const double* GetValues(const int pmt_id) const;
+
+private:
+    void* m_data;
+    std::size_t m_size;
+    SplineFileHeader m_header;
+    const double* m_knots;
+    const uint8_t* m_present;
+    const double* m_values;
+    std::vector<int> m_dim_nknots;
+    std::vector<int> m_dim_offset;
+
+    const std::string TAG = color::GREEN_STR + "[SplineFile]: " + color::RESET_STR;
+    const std::string ERR = color::RED_STR + "[SplineFile ERROR]: " + color::RESET_STR;
+};
+
+#endif
@@ -0,0 +1,155 @@
+#include "ThreadAffinity.hh"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace
+{
+    const std::string TAG = color::GREEN_STR + "[ThreadAffinity]: " + color::RESET_STR;
+    const std::string WAR = color::RED_STR + "[ThreadAffinity WARNING]: " + color::RESET_STR;
+
+    int ReadTopology(const int cpu, const char* name)
+    {
+        char fname[128];
+        std::snprintf(fname, sizeof(fname), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+        FILE* f = std::fopen(fname, "r");
+        if(f == nullptr)
+            return 0;
+        int val = 0;
+        if(std::fscanf(f, "%d", &val) != 1)
+            val = 0;
+        std::fclose(f);
+        return val;
+    }
+
+#ifdef __linux__
+    // CPUs of the process, read once before any thread is pinned
+    const cpu_set_t* ProcessMask()
+    {
+        static cpu_set_t mask;
+        static const bool valid = [] { CPU_ZERO(&mask); return sched_getaffinity(0, sizeof(mask), &mask) == 0; }();
+        return valid ? &mask : nullptr;
+    }
+#endif
+}
+
+AffinityPolicy ThreadAffinity::ParsePolicy(const std::string& name)
+{
+    if(name == "compact")
+        return kAffinityCompact;
+    else if(name == "scatter")
+        return kAffinityScatter;
+    else if(name != "none" && !name.empty())
+        std::cout << WAR << "Unknown affinity policy " << name << ", threads are not pinned." << std::endl;
+    return kAffinityNone;
+}
+
+std::vector<int> ThreadAffinity::CPUOrder(const AffinityPolicy policy)
+{
+    std::vector<int> order;
+#ifdef __linux__
+    const cpu_set_t* mask = ProcessMask();
+    if(mask == nullptr)
+        return order;
+
+    // (socket, core, cpu) of every allowed CPU, hyperthreads of a core come after all cores of the socket
+    struct CPUInfo { int socket, core, smt, cpu; };
+    std::vector<CPUInfo> cpus;
+    std::vector<int> seen_core;
+    for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if(!CPU_ISSET(cpu, mask))
+            continue;
+        CPUInfo info;
+        info.socket = ReadTopology(cpu, "physical_package_id");
+        info.core = ReadTopology(cpu, "core_id");
+        info.cpu = cpu;
+        const int key = info.socket * 65536 + info.core;
+        info.smt = std::count(seen_core.begin(), seen_core.end(), key);
+        seen_core.push_back(key);
+        cpus.push_back(info);
+    }
+
+    std::sort(cpus.begin(), cpus.end(), [](const CPUInfo& a, const CPUInfo& b)
+    {
+        if(a.socket != b.socket) return a.socket < b.socket;
+        if(a.smt != b.smt) return a.smt < b.smt;
+        if(a.core != b.core) return a.core < b.core;
+        return a.cpu < b.cpu;
+    });
+
+    if(policy == kAffinityScatter)
+    {
+        // round robin over the sockets
+        std::vector<std::vector<int>> per_socket;
+        int last_socket = -1;
+        for(const auto& c : cpus)
+        {
+            if(c.socket != last_socket)
+            {
+                per_socket.emplace_back();
+                last_socket = c.socket;
+            }
+            per_socket.back().push_back(c.cpu);
+        }
+        for(std::size_t i = 0; order.size() < cpus.size(); ++i)
+            for(const auto& socket : per_socket)
+                if(i < socket.size())
+                    order.push_back(socket[i]);
+    }
+    else
+    {
+        for(const auto& c : cpus)
+            order.push_back(c.cpu);
+    }
+#endif
+    return order;
+}
+
+bool ThreadAffinity::PinThreads(const int nthreads, const AffinityPolicy policy)
+{
+    if(policy == kAffinityNone)
+        return true;
+
+#if defined(__linux__) && defined(_OPENMP)
+    const std::vector<int> order = CPUOrder(policy);
+    if(order.empty())
+    {
+        std::cout << WAR << "Could not read the CPU topology, threads are not pinned." << std::endl;
+        return false;
+    }
+
+    // the OpenMP runtime keeps the same threads for later teams of this size, so the pinning persists
+    int nfail = 0;
+#pragma omp parallel num_threads(nthreads) reduction(+:nfail)
+    {
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        CPU_SET(order[omp_get_thread_num() % order.size()], &mask);
+        if(sched_setaffinity(0, sizeof(mask), &mask) != 0)
+            nfail++;
+    }
+
+    if(nfail > 0)
+    {
+        std::cout << WAR << "Failed to pin " << nfail << " threads." << std::endl;
+        return false;
+    }
+    std::cout << TAG << "Pinned " << nthreads << " threads with "
+              << (policy == kAffinityCompact ? "compact" : "scatter") << " policy over " << order.size() << " CPUs." << std::endl;
+    return true;
+#else
+    std::cout << WAR << "Thread pinning needs Linux and OpenMP, threads are not pinned." << std::endl;
+    return false;
+#endif
+}
+
+void ThreadAffinity::UnpinThread()
+{
+#ifdef __linux__
+    const cpu_set_t* mask = ProcessMask();
+    if(mask != nullptr)
+        sched_setaffinity(0, sizeof(*mask), mask);
+#endif
+}
@@ -0,0 +1,44 @@
+#ifndef __ThreadAffinity_hh__
+#define __ThreadAffinity_hh__
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "ColorOutput.hh"
+
+// Pinning of the OpenMP threads to CPUs, so that the PMT ranges first touched by a thread
+// stay on the memory node of the socket it runs on.
+//   kAffinityCompact: fill the cores of one socket before the next
+//   kAffinityScatter: spread consecutive threads over the sockets
+enum AffinityPolicy
+{
+    kAffinityNone = 0,
+    kAffinityCompact = 1,
+    kAffinityScatter = 2,
+};
+
+class ThreadAffinity
+{
+public:
+    // "none", "compact" or "scatter", kAffinityNone for anything else
+    static AffinityPolicy ParsePolicy(const std::string& name);
+
+    // Order in which threads are assigned to the CPUs this process may run on
+    static std::vector<int> CPUOrder(const AffinityPolicy policy);
+
+    // Pins thread t of an nthreads team to CPUOrder()[t % ncpu], returns false if not supported
+    static bool PinThreads(const int nthreads, const AffinityPolicy policy);
+
+    // Gives the calling thread the CPUs of the process before PinThreads. Threads created by a pinned
+    // thread inherit its single CPU, so threads that do not belong to the OpenMP team call this when they start.
+    static void UnpinThread();
+};
+
+#endif
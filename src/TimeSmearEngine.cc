@@ -0,0 +1,352 @@
+#include "TimeSmearEngine.hh"
+
+namespace
+{
+    // B&L 20" hit time smearing of WCSIMDigitization.hh at 1 p.e.: Gaussian(-0.2, sigma) plus an exponential of decay 1/lambda
+    const double BNL_MEAN = -0.2;
+    const double BNL_SIGMA = 0.6314 * (std::exp(-0.06260) + 0.5711);
+    const double BNL_TAU = 1.0 / (0.4113 + 0.07827);
+    // upper bound of the midpoint steps of a B&L kernel, about 750 are needed when the width is below a template bin
+    const int MAX_FINE_STEPS = 1 << 14;
+}
+
+TimeSmearEngine::TimeSmearEngine()
+    : m_nrows(0)
+    , m_ntbins(0)
+    , m_nfft(0)
+    , m_nspec(0)
+    , m_nhalf(0)
+    , m_shape(kGaussian)
+    , m_width(1.)
+{
+}
+
+void TimeSmearEngine::Clear()
+{
+    m_nrows = 0;
+    m_ntbins = 0;
+    m_nfft = 0;
+    m_nspec = 0;
+    m_bitrev.clear();
+    m_cos.clear();
+    m_sin.clear();
+    m_spec.clear();
+    m_kernel.clear();
+}
+
+double TimeSmearEngine::Density(const int shape, const double par, const double t)
+{
+    if(shape == kBnL)
+    {
+        // exponentially modified Gaussian stretched by par, shifted to zero mean
+        const double sigma = par * BNL_SIGMA;
+        const double tau = par * BNL_TAU;
+        const double x = t + tau; // time from the Gaussian mean
+        const double z = (sigma / tau - x / sigma) / std::sqrt(2.0);
+        // exp(sigma^2/(2 tau^2) - x/tau) erfc(z) / (2 tau), with the asymptotic erfc where the exponent overflows
+        const double a = sigma * sigma / (2 * tau * tau) - x / tau;
+        if(z < 5)
+            return std::exp(a) * std::erfc(z) / (2 * tau);
+        return std::exp(a - z * z) / (z * std::sqrt(M_PI)) * (1 - 0.5 / (z * z)) / (2 * tau);
+    }
+
+    const double sigma = par;
+    return std::exp(-0.5 * t * t / (sigma * sigma)) / (std::sqrt(2 * M_PI) * sigma);
+}
+
+void TimeSmearEngine::Init(const double* tnom, const int nrows, const int ntbins, const double width, const int shape, const double max_par)
+{
+    Clear();
+
+    if(nrows <= 0 || ntbins <= 0 || width <= 0)
+    {
+        std::cerr << ERR << "In Init()\n"
+                  << "Invalid template of " << nrows << " rows, " << ntbins << " bins of width " << width << std::endl;
+        return;
+    }
+
+    m_nrows = nrows;
+    m_ntbins = ntbins;
+    m_width = width;
+    m_shape = shape;
+
+    const double extent = m_shape == kBnL ? max_par * (6 * BNL_SIGMA + 15 * BNL_TAU) : 6 * max_par;
+    m_nhalf = std::max(1, (int)std::ceil(extent / m_width) + 1);
+    m_nfft = 2;
+    while(m_nfft < m_ntbins + m_nhalf)
+        m_nfft *= 2;
+    m_nspec = m_nfft / 2 + 1;
+
+    int nbits = 0;
+    while((1 << nbits) < m_nfft)
+        nbits++;
+    m_bitrev.resize(m_nfft);
+    for(int i = 0; i < m_nfft; ++i)
+    {
+        int r = 0;
+        for(int b = 0; b < nbits; ++b)
+            r |= ((i >> b) & 1) << (nbits - 1 - b);
+        m_bitrev[i] = r;
+    }
+    m_cos.resize(m_nfft / 2);
+    m_sin.resize(m_nfft / 2);
+    for(int k = 0; k < m_nfft / 2; ++k)
+    {
+        m_cos[k] = std::cos(2 * M_PI * k / m_nfft);
+        m_sin[k] = std::sin(2 * M_PI * k / m_nfft);
+    }
+
+    // spectra of the nominal rows, two rows per complex lane
+    m_spec.resize((std::size_t)m_nrows * m_nspec * 2);
+    std::vector<double> re((std::size_t)m_nfft * kLanes), im((std::size_t)m_nfft * kLanes);
+    for(int r0 = 0; r0 < m_nrows; r0 += 2 * kLanes)
+    {
+        std::fill(re.begin(), re.end(), 0.0);
+        std::fill(im.begin(), im.end(), 0.0);
+        for(int l = 0; l < kLanes; ++l)
+        {
+            const int ra = r0 + 2 * l;
+            const int rb = ra + 1;
+            for(int i = 0; i < m_ntbins; ++i)
+            {
+                if(ra < m_nrows)
+                    re[i * kLanes + l] = tnom[(std::size_t)ra * m_ntbins + i];
+                if(rb < m_nrows)
+                    im[i * kLanes + l] = tnom[(std::size_t)rb * m_ntbins + i];
+            }
+        }
+        FFTBlock(re.data(), im.data(), false);
+
+        // separate the spectra of the two real rows with the conjugate symmetry
+        for(int l = 0; l < kLanes; ++l)
+        {
+            const int ra = r0 + 2 * l;
+            const int rb = ra + 1;
+            for(int k = 0; k < m_nspec; ++k)
+            {
+                const int nk = (m_nfft - k) % m_nfft;
+                const double zr = re[k * kLanes + l], zi = im[k * kLanes + l];
+                const double nr = re[nk * kLanes + l], ni = im[nk * kLanes + l];
+                if(ra < m_nrows)
+                {
+                    m_spec[((std::size_t)ra * m_nspec + k) * 2] = 0.5 * (zr + nr);
+                    m_spec[((std::size_t)ra * m_nspec + k) * 2 + 1] = 0.5 * (zi - ni);
+                }
+                if(rb < m_nrows)
+                {
+                    m_spec[((std::size_t)rb * m_nspec + k) * 2] = 0.5 * (zi + ni);
+                    m_spec[((std::size_t)rb * m_nspec + k) * 2 + 1] = -0.5 * (zr - nr);
+                }
+            }
+        }
+    }
+
+    const double mem_kb = sizeof(pmt_real) * m_spec.size() / 1000.0;
+    std::cout << TAG << "Template spectra of " << m_nrows << " PMTs, FFT size " << m_nfft << " for a kernel of +-"
+              << m_nhalf << " bins, " << mem_kb << " kB." << std::endl;
+}
+
+void TimeSmearEngine::FFTBlock(double* re, double* im, const bool inverse) const
+{
+    const int n = m_nfft;
+    for(int i = 0; i < n; ++i)
+    {
+        const int j = m_bitrev[i];
+        if(i < j)
+        {
+            for(int l = 0; l < kLanes; ++l)
+            {
+                std::swap(re[i * kLanes + l], re[j * kLanes + l]);
+                std::swap(im[i * kLanes + l], im[j * kLanes + l]);
+            }
+        }
+    }
+
+    const double sign = inverse ? 1.0 : -1.0;
+    for(int len = 2; len <= n; len *= 2)
+    {
+        const int half = len / 2;
+        const int step = n / len;
+        for(int i = 0; i < n; i += len)
+        {
+            for(int k = 0; k < half; ++k)
+            {
+                const double wr = m_cos[k * step];
+                const double wi = sign * m_sin[k * step];
+                double* ar = re + (i + k) * kLanes;
+                double* ai = im + (i + k) * kLanes;
+                double* br = re + (i + k + half) * kLanes;
+                double* bi = im + (i + k + half) * kLanes;
+#pragma omp simd
+                for(int l = 0; l < kLanes; ++l)
+                {
+                    const double tr = wr * br[l] - wi * bi[l];
+                    const double ti = wr * bi[l] + wi * br[l];
+                    br[l] = ar[l] - tr;
+                    bi[l] = ai[l] - ti;
+                    ar[l] += tr;
+                    ai[l] += ti;
+                }
+            }
+        }
+    }
+}
+
+void TimeSmearEngine::BuildKernel(const double par, std::vector<double>& kernel) const
+{
+    kernel.assign(2 * m_nhalf + 1, 0.0);
+    if(!(par > 0))
+    {
+        kernel[m_nhalf] = 1.0;
+        return;
+    }
+
+    if(m_shape == kGaussian)
+    {
+        // closed form: tri is a sum of three ramps, and E[max(0, U-a)] = sigma phi(a/sigma) - a Q(a/sigma) for U ~ N(0, sigma)
+        const double sigma = par;
+        auto ramp = [sigma](const double a)
+        {
+            const double z = a / sigma;
+            return sigma * std::exp(-0.5 * z * z) / std::sqrt(2 * M_PI) - a * 0.5 * std::erfc(z / std::sqrt(2.0));
+        };
+        for(int d = -m_nhalf; d <= m_nhalf; ++d)
+        {
+            const double k = (ramp((d - 1) * m_width) - 2 * ramp(d * m_width) + ramp((d + 1) * m_width)) / m_width;
+            kernel[d + m_nhalf] = std::max(0.0, k); // round-off of the cancelling ramps far from the peak
+        }
+    }
+    else
+    {
+        // midpoint rule over the support of the resolution function only, on a grid resolving both it and the
+        // template bins, so the number of steps is bounded whatever the parameter
+        const double sigma = par * BNL_SIGMA;
+        const double tau = par * BNL_TAU;
+        const double lo = std::max(-(m_nhalf + 1) * m_width, -tau - 6 * sigma);
+        const double hi = std::min((m_nhalf + 1) * m_width, 6 * sigma + 15 * tau);
+        const int nfine = std::min(MAX_FINE_STEPS, (int)std::ceil((hi - lo) / (std::min(m_width, std::min(sigma, tau)) / 16.0)));
+        const double h = (hi - lo) / nfine;
+        for(int i = 0; i < nfine; ++i)
+        {
+            const double u = lo + (i + 0.5) * h;
+            const double g = Density(m_shape, par, u) * h;
+            // tri(u/w - d) is non-zero for the two bins around u/w
+            const double x = u / m_width;
+            const int d0 = std::floor(x);
+            const double f = x - d0;
+            if(d0 >= -m_nhalf && d0 <= m_nhalf)
+                kernel[d0 + m_nhalf] += g * (1 - f);
+            if(d0 + 1 >= -m_nhalf && d0 + 1 <= m_nhalf)
+                kernel[d0 + 1 + m_nhalf] += g * f;
+        }
+    }
+
+    // the tails cut by the kernel range would otherwise lower the normalization
+    double sum = 0;
+    for(const double k : kernel)
+        sum += k;
+    if(sum > 0)
+        for(auto& k : kernel)
+            k /= sum;
+}
+
+void TimeSmearEngine::SetKernels(const int point, const std::vector<double>& params)
+{
+    if(IsEmpty())
+        return;
+
+    if(m_kernel.size() <= point)
+        m_kernel.resize(point + 1);
+    const int nbins = params.size();
+    std::vector<double>& spec = m_kernel[point];
+    spec.assign((std::size_t)nbins * m_nspec * 2, 0.0);
+
+    // kernel spectra of kLanes bins at a time, K(d) at index d mod nfft
+    std::vector<double> re((std::size_t)m_nfft * kLanes), im((std::size_t)m_nfft * kLanes);
+    std::vector<double> kernel;
+    for(int b0 = 0; b0 < nbins; b0 += kLanes)
+    {
+        std::fill(re.begin(), re.end(), 0.0);
+        std::fill(im.begin(), im.end(), 0.0);
+        for(int l = 0; l < kLanes && b0 + l < nbins; ++l)
+        {
+            BuildKernel(params[b0 + l], kernel);
+            for(int d = -m_nhalf; d <= m_nhalf; ++d)
+                re[((d + m_nfft) % m_nfft) * kLanes + l] += kernel[d + m_nhalf];
+        }
+        FFTBlock(re.data(), im.data(), false);
+        for(int l = 0; l < kLanes && b0 + l < nbins; ++l)
+        {
+            for(int k = 0; k < m_nspec; ++k)
+            {
+                spec[((std::size_t)(b0 + l) * m_nspec + k) * 2] = re[k * kLanes + l];
+                spec[((std::size_t)(b0 + l) * m_nspec + k) * 2 + 1] = im[k * kLanes + l];
+            }
+        }
+    }
+}
+
+void TimeSmearEngine::Smear(const int point, const int* parbin, double* out, const int begin, const int end) const
+{
+    if(IsEmpty() || m_kernel.size() <= point)
+        return;
+
+    const std::vector<double>& kspec = m_kernel[point];
+    const double norm = 1.0 / m_nfft;
+    std::vector<double> re((std::size_t)m_nfft * kLanes), im((std::size_t)m_nfft * kLanes);
+    std::vector<double> pa(m_nspec * 2), pb(m_nspec * 2);
+    for(int r0 = begin; r0 < end; r0 += 2 * kLanes)
+    {
+        for(int l = 0; l < kLanes; ++l)
+        {
+            const int ra = r0 + 2 * l;
+            // product spectra of the two rows of this lane, a row past the end or without a bin is zero
+            for(int n = 0; n < 2; ++n)
+            {
+                const int r = ra + n;
+                double* p = n == 0 ? pa.data() : pb.data();
+                if(r >= end || parbin[r] < 0)
+                {
+                    std::fill(p, p + m_nspec * 2, 0.0);
+                    continue;
+                }
+                const pmt_real* s = m_spec.data() + (std::size_t)r * m_nspec * 2;
+                const double* kk = kspec.data() + (std::size_t)parbin[r] * m_nspec * 2;
+#pragma omp simd
+                for(int k = 0; k < m_nspec; ++k)
+                {
+                    p[2 * k] = s[2 * k] * kk[2 * k] - s[2 * k + 1] * kk[2 * k + 1];
+                    p[2 * k + 1] = s[2 * k] * kk[2 * k + 1] + s[2 * k + 1] * kk[2 * k];
+                }
+            }
+
+            // z = a + i b, the upper half of the spectrum from the conjugate symmetry of the real rows
+            for(int k = 0; k < m_nspec; ++k)
+            {
+                re[k * kLanes + l] = pa[2 * k] - pb[2 * k + 1];
+                im[k * kLanes + l] = pa[2 * k + 1] + pb[2 * k];
+            }
+            for(int k = m_nspec; k < m_nfft; ++k)
+            {
+                const int m = m_nfft - k;
+                re[k * kLanes + l] = pa[2 * m] + pb[2 * m + 1];
+                im[k * kLanes + l] = pb[2 * m] - pa[2 * m + 1];
+            }
+        }
+
+        FFTBlock(re.data(), im.data(), true);
+
+        for(int l = 0; l < kLanes; ++l)
+        {
+            const int ra = r0 + 2 * l;
+            const int rb = ra + 1;
+            // clip the round-off around zero, the likelihood takes the log of the template
+            if(ra < end && parbin[ra] >= 0)
+                for(int i = 0; i < m_ntbins; ++i)
+                    out[(std::size_t)ra * m_ntbins + i] = std::max(0.0, re[i * kLanes + l] * norm);
+            if(rb < end && parbin[rb] >= 0)
+                for(int i = 0; i < m_ntbins; ++i)
+                    out[(std::size_t)rb * m_ntbins + i] = std::max(0.0, im[i * kLanes + l] * norm);
+        }
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef __TimeSmearEngine_hh__
+#define __TimeSmearEngine_hh__
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "AlignedAllocator.hh"
+#include "PMTStore.hh"
+#include "ColorOutput.hh"
+
+// Convolves the timetof template of every PMT with a time resolution function of variable width.
+// The template content is taken uniform inside each template bin, so convolving on a fine grid and summing back
+// into the template bins is the same as a convolution on the template bins with the kernel
+//   K(d) = int g(u) tri(u/w - d) du,  tri(x) = max(0, 1-|x|),  w = template bin width,
+// which is exact in closed form for the Gaussian and integrated on a fine grid over the support of the B&L shape,
+// once per parameter value and in a time independent of it. The convolution of the rows is done with FFTs:
+// the spectra of the nominal rows are computed once, then each call multiplies them by the kernel spectrum of
+// their parameter bin and transforms back. The FFTs run on blocks of rows with the rows innermost, so that the
+// butterflies vectorize across rows, and two real rows share one complex transform.
+// Content smeared out of the template range is lost, none comes in from outside of it.
+class TimeSmearEngine
+{
+public:
+    enum Shape
+    {
+        kGaussian = 0, // Gaussian of sigma = parameter (ns)
+        kBnL      = 1  // B&L 20" 1 p.e. resolution of WCSIMDigitization.hh stretched by the parameter, zero mean
+    };
+
+    // complex lanes of the batched FFT, each holds two rows
+    static const int kLanes = 8;
+
+    TimeSmearEngine();
+
+    // ntbins template bins of width (ns) for nrows rows of tnom, max_par is the largest parameter the fit can reach
+    void Init(const double* tnom, const int nrows, const int ntbins, const double width, const int shape, const double max_par);
+    void Clear();
+
+    // Kernel spectra of every parameter bin for point `point` of a parameter batch
+    void SetKernels(const int point, const std::vector<double>& params);
+
+    // Smeared template of rows [begin, end) into out (same layout as tnom) with the kernels of `point`,
+    // parbin is the parameter bin of each row, rows with a negative bin are not written
+    void Smear(const int point, const int* parbin, double* out, const int begin, const int end) const;
+
+    inline bool IsEmpty() const { return m_nrows == 0; }
+    inline int GetFFTSize() const { return m_nfft; }
+
+    // Resolution function of shape at time t (ns) for parameter par
+    static double Density(const int shape, const double par, const double t);
+
+private:
+    // in place radix-2 FFT of kLanes interleaved complex sequences, re[k*kLanes + lane]
+    void FFTBlock(double* re, double* im, const bool inverse) const;
+    // Kernel on the template bins, K[d + m_nhalf] for d in [-m_nhalf, m_nhalf]
+    void BuildKernel(const double par, std::vector<double>& kernel) const;
+
+    int m_nrows;
+    int m_ntbins;
+    int m_nfft;  // FFT size, at least ntbins + m_nhalf so the circular convolution does not wrap into the template
+    int m_nspec; // m_nfft/2 + 1 non-redundant frequencies of a real row
+    int m_nhalf; // kernel half width in template bins
+    int m_shape;
+    double m_width;
+
+    std::vector<int> m_bitrev;
+    std::vector<double> m_cos, m_sin;
+    AlignedVector<pmt_real> m_spec; // [row][frequency][re, im] of the nominal rows
+    std::vector<std::vector<double>> m_kernel; // [point][bin][frequency][re, im]
+
+    const std::string TAG = color::GREEN_STR + "[TimeSmearEngine]: " + color::RESET_STR;
+    const std::string ERR = color::RED_STR + "[TimeSmearEngine ERROR]: " + color::RESET_STR;
+};
+
+#endif
@@ -4,10 +4,10 @@
 #include <TGraph.h>
 #include <TMath.h>
 
-class AttenuationZ
+class AttenuationZWeight
 {
 public:
-    AttenuationZ(double wl, double zpos, double slope, double abw, double ray)
+    AttenuationZWeight(double wl, double zpos, double slope, double abw, double ray)
     {
         std::cout<<"Set up AttenuationZ for event reweight"<<std::endl;
         wavelength = wl;
@@ -21,7 +21,7 @@ public:
 
         SetAttenuationLength();
     };
-    ~AttenuationZ() 
+    ~AttenuationZWeight() 
     {
     };
 
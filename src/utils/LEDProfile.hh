@@ -54,6 +54,19 @@ public:
         return gr_power_cosths->Eval(cosths)*(1.+gr_variation_cosths->Eval(cosths)/100.*cos(phis));
     }
 
+    // Power spectrum and phi variation (in %) of the weight, 0 outside of the profile
+    double GetPower(double cosths) const
+    {
+        if (cosths<0.76655) return 0.;
+        return gr_power_cosths->Eval(cosths);
+    }
+
+    double GetVariation(double cosths) const
+    {
+        if (cosths<0.76655) return 0.;
+        return gr_variation_cosths->Eval(cosths);
+    }
+
     void SetPowerSpectrum(TH1* hist)
     {
         if(gr_power_cosths != nullptr)